@@ -0,0 +1,113 @@
+#include "src/assertions.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "src/util.h"
+
+namespace test_harness {
+namespace {
+
+constexpr size_t kBytesPerRow = 16;
+constexpr size_t kMaxRows = 8;
+
+void AppendRow(const char* label, const uint8_t* data, size_t begin,
+               size_t end, std::string* out) {
+  char hex[4];
+  out->append(label);
+  for (size_t i = begin; i < end; ++i) {
+    snprintf(hex, sizeof(hex), " %02x", data[i]);
+    out->append(hex);
+  }
+  out->append("\n");
+}
+
+}  // namespace
+
+::testing::AssertionResult CallSucceeded(const char* call_expr,
+                                         const char* /* reply_expr */,
+                                         int code, const raw_message* reply) {
+  if (code == NO_ERROR) {
+    return ::testing::AssertionSuccess();
+  }
+
+  ::testing::AssertionResult failure = ::testing::AssertionFailure();
+  failure << call_expr << " returned " << code << " ("
+          << error_codes_name(code) << ")";
+  if (code == UNEXPECTED_TYPE) {
+    failure << "\nreceived type " << reply->type << " ("
+            << ::nugget::app::protoapi::APImessageID_Name(
+                   (::nugget::app::protoapi::APImessageID) reply->type)
+            << ")";
+    ::nugget::app::protoapi::Notice notice;
+    if (reply->type == ::nugget::app::protoapi::APImessageID::NOTICE &&
+        notice.ParseFromArray(reinterpret_cast<const char *>(reply->data),
+                              reply->data_len)) {
+      failure << "\n" << notice.DebugString();
+    }
+  } else if (code == UNEXPECTED_SUBTYPE) {
+    failure << "\nreceived " << reply->data_len << " bytes";
+    if (reply->data_len >= 2) {
+      failure << " with subtype " << ((reply->data[0] << 8) | reply->data[1]);
+    }
+  }
+  return failure;
+}
+
+::testing::AssertionResult BufferEq(const char* expected_expr,
+                                    const char* actual_expr,
+                                    const char* len_expr,
+                                    const void* expected, const void* actual,
+                                    size_t len) {
+  if (len == 0 || memcmp(expected, actual, len) == 0) {
+    return ::testing::AssertionSuccess();
+  }
+
+  const uint8_t* lhs = static_cast<const uint8_t*>(expected);
+  const uint8_t* rhs = static_cast<const uint8_t*>(actual);
+
+  size_t first = len;
+  size_t mismatches = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (lhs[i] != rhs[i]) {
+      if (first == len) {
+        first = i;
+      }
+      ++mismatches;
+    }
+  }
+
+  // Only rows which contain a difference are printed.
+  std::string diff;
+  size_t rows = 0;
+  for (size_t row = first - first % kBytesPerRow; row < len;
+       row += kBytesPerRow) {
+    const size_t end = row + kBytesPerRow < len ? row + kBytesPerRow : len;
+    if (memcmp(lhs + row, rhs + row, end - row) == 0) {
+      continue;
+    }
+    if (rows++ == kMaxRows) {
+      diff.append("  ...\n");
+      break;
+    }
+
+    char offset[16];
+    snprintf(offset, sizeof(offset), "  %04zx\n", row);
+    diff.append(offset);
+    AppendRow("    expected:", lhs, row, end, &diff);
+    AppendRow("    actual:  ", rhs, row, end, &diff);
+    diff.append("             ");
+    for (size_t i = row; i < end; ++i) {
+      diff.append(lhs[i] != rhs[i] ? " ^^" : "   ");
+    }
+    diff.append("\n");
+  }
+
+  return ::testing::AssertionFailure()
+      << expected_expr << " and " << actual_expr << " differ in "
+      << mismatches << " of " << len_expr << " (" << len << ") bytes, "
+      << "first at offset " << first << "\n" << diff;
+}
+
+}  // namespace test_harness
@@ -0,0 +1,73 @@
+#ifndef SRC_ASSERTIONS_H
+#define SRC_ASSERTIONS_H
+
+#include <cstddef>
+
+#include "gtest/gtest.h"
+#include "nugget/app/protoapi/control.pb.h"
+#include "nugget/app/protoapi/header.pb.h"
+
+/** Fails unless the raw_message @msg has the APImessageID @type_. A NOTICE
+ * received instead is decoded into the failure message. */
+#define ASSERT_MSG_TYPE(msg, type_) \
+do { \
+  if (type_ != ::nugget::app::protoapi::APImessageID::NOTICE && \
+      (msg).type == ::nugget::app::protoapi::APImessageID::NOTICE) { \
+    ::nugget::app::protoapi::Notice received; \
+    received.ParseFromArray(reinterpret_cast<const char *>((msg).data), \
+                            (msg).data_len); \
+    ASSERT_EQ((msg).type, type_) \
+        << (msg).type << " is " \
+        << ::nugget::app::protoapi::APImessageID_Name( \
+               (::nugget::app::protoapi::APImessageID) (msg).type) \
+        << "\n" << received.DebugString(); \
+  } else { \
+    ASSERT_EQ((msg).type, type_) \
+        << (msg).type << " is " \
+        << ::nugget::app::protoapi::APImessageID_Name( \
+               (::nugget::app::protoapi::APImessageID) (msg).type); \
+  } \
+} while (0)
+
+/** Checks the oneof case in the first two bytes of a TESTING_API_RESPONSE. */
+#define ASSERT_SUBTYPE(msg, type_) \
+do { \
+  EXPECT_GT((msg).data_len, 2); \
+  uint16_t subtype = ((msg).data[0] << 8) | (msg).data[1]; \
+  EXPECT_EQ(subtype, type_); \
+} while (0)
+
+/** Compares @len bytes of two buffers. The comparison is a single memcmp; the
+ * hex diff is only built when the buffers differ and anything streamed into
+ * the assertion (e.g. a DebugString()) is only evaluated on failure too. */
+#define ASSERT_BUFFER_EQ(expected, actual, len) \
+  ASSERT_PRED_FORMAT3(::test_harness::BufferEq, expected, actual, len)
+#define EXPECT_BUFFER_EQ(expected, actual, len) \
+  EXPECT_PRED_FORMAT3(::test_harness::BufferEq, expected, actual, len)
+
+/** Runs (harness)->Call(request, result) from src/protoapi_call.h. On failure
+ * the error is named and an unexpected reply is decoded. */
+#define ASSERT_CALL(harness, request, result) \
+  ASSERT_PRED_FORMAT2(::test_harness::CallSucceeded, \
+                      (harness)->Call(request, result), \
+                      &(harness)->LastReply())
+
+namespace test_harness {
+
+struct raw_message;
+
+/** Predicate formatter behind ASSERT_CALL. */
+::testing::AssertionResult CallSucceeded(const char* call_expr,
+                                         const char* reply_expr, int code,
+                                         const raw_message* reply);
+
+/** Predicate formatter behind ASSERT_BUFFER_EQ. */
+::testing::AssertionResult BufferEq(const char* expected_expr,
+                                    const char* actual_expr,
+                                    const char* len_expr,
+                                    const void* expected, const void* actual,
+                                    size_t len);
+
+}  // namespace test_harness
+
+#endif  // SRC_ASSERTIONS_H
@@ -0,0 +1,183 @@
+#include "src/avb_lock_model.h"
+
+#include <application.h>
+#include <avb.h>
+
+#include <cstdio>
+#include <cstring>
+
+namespace test_harness {
+
+constexpr int AvbLockModel::UNSPECIFIED;
+
+bool AvbLockModel::State::operator==(const State& other) const {
+  return bootloader == other.bootloader && production == other.production &&
+      memcmp(locks, other.locks, sizeof(locks)) == 0;
+}
+
+AvbLockModel::AvbLockModel() {
+  current.bootloader = false;
+  current.production = false;
+  memset(current.locks, 0, sizeof(current.locks));
+}
+
+int AvbLockModel::Apply(const Step& step) {
+  State& s = current;
+  uint8_t *locks = s.locks;
+  const uint8_t v = step.value;
+
+  switch (step.op) {
+    case SET_CARRIER_LOCK:
+      // Only the factory may touch the carrier lock.
+      if (s.production) {
+        return APP_ERROR_AVB_AUTHORIZATION;
+      }
+      if (locks[CARRIER] && v && v != locks[CARRIER]) {
+        return UNSPECIFIED;
+      }
+      locks[CARRIER] = v;
+      return APP_SUCCESS;
+
+    case SET_DEVICE_LOCK:
+      // Set from the HLOS once in production.
+      if (s.production && s.bootloader) {
+        return APP_ERROR_AVB_HLOS;
+      }
+      if (locks[DEVICE] && v && v != locks[DEVICE]) {
+        return APP_ERROR_AVB_DENIED;
+      }
+      if (locks[DEVICE] && !v && locks[BOOT]) {
+        return UNSPECIFIED;
+      }
+      locks[DEVICE] = v;
+      return APP_SUCCESS;
+
+    case SET_BOOT_LOCK:
+      if (s.production && !s.bootloader) {
+        return APP_ERROR_AVB_BOOTLOADER;
+      }
+      if (v == locks[BOOT]) {
+        return APP_SUCCESS;
+      }
+      // Once the carrier or device lock is set, a set boot lock can't be
+      // removed or changed.
+      if (locks[BOOT] && (locks[CARRIER] || locks[DEVICE])) {
+        if (!s.production) {
+          return UNSPECIFIED;
+        }
+        if (locks[CARRIER] || !v) {
+          return APP_ERROR_AVB_DENIED;
+        }
+        return UNSPECIFIED;
+      }
+      locks[BOOT] = v;
+      return APP_SUCCESS;
+
+    case SET_OWNER_LOCK:
+      if (s.production) {
+        return UNSPECIFIED;
+      }
+      if (locks[BOOT]) {
+        return v ? APP_ERROR_AVB_DENIED : UNSPECIFIED;
+      }
+      if (locks[OWNER] && v) {
+        return v == locks[OWNER] ? UNSPECIFIED : APP_ERROR_AVB_DENIED;
+      }
+      locks[OWNER] = v;
+      return APP_SUCCESS;
+
+    case SET_PRODUCTION:
+      if (s.production) {
+        return v ? UNSPECIFIED : APP_ERROR_AVB_AUTHORIZATION;
+      }
+      if (!v) {
+        return UNSPECIFIED;
+      }
+      s.production = true;
+      return APP_SUCCESS;
+
+    case RESET_PRODUCTION:
+      // Whether the locks survive is not covered by the tests.
+      return UNSPECIFIED;
+
+    case RESET_LOCKS:
+      if (s.production) {
+        return UNSPECIFIED;
+      }
+      memset(locks, 0, sizeof(s.locks));
+      return APP_SUCCESS;
+
+    case SET_BOOTLOADER:
+      s.bootloader = true;
+      return APP_SUCCESS;
+
+    case BOOTLOADER_DONE:
+      if (!s.bootloader) {
+        return UNSPECIFIED;
+      }
+      s.bootloader = false;
+      return APP_SUCCESS;
+
+    case NUM_OPS:
+      break;
+  }
+  return UNSPECIFIED;
+}
+
+AvbLockModel::Step AvbLockModel::RandomStep(std::mt19937 *rng) {
+  // Zero is listed twice so unlocking is as likely as locking, and there
+  // are two non-zero values so changing a set lock is tried too.
+  static const uint8_t kValues[] = {0x00, 0x00, 0x5a, 0xa5};
+  std::uniform_int_distribution<int> op(0, NUM_OPS - 1);
+  std::uniform_int_distribution<size_t> value(0, sizeof(kValues) - 1);
+
+  Step step;
+  step.op = static_cast<Op>(op(*rng));
+  step.value = kValues[value(*rng)];
+  if (step.op == SET_PRODUCTION) {
+    step.value = step.value != 0;
+  }
+  return step;
+}
+
+std::string AvbLockModel::Describe(const Step& step) {
+  static const char *const kNames[] = {
+    "SetCarrierLock", "SetDeviceLock", "SetBootLock", "SetOwnerLock",
+    "SetProduction", "ResetProduction", "Reset(LOCKS)", "SetBootloader",
+    "BootloaderDone",
+  };
+  static_assert(sizeof(kNames) / sizeof(kNames[0]) == NUM_OPS,
+                "Missing name for an op");
+
+  char buffer[48];
+  switch (step.op) {
+    case SET_CARRIER_LOCK:
+    case SET_DEVICE_LOCK:
+    case SET_BOOT_LOCK:
+    case SET_OWNER_LOCK:
+      snprintf(buffer, sizeof(buffer), "%s(0x%02x)", kNames[step.op],
+               step.value);
+      break;
+    case SET_PRODUCTION:
+      snprintf(buffer, sizeof(buffer), "%s(%s)", kNames[step.op],
+               step.value ? "true" : "false");
+      break;
+    default:
+      snprintf(buffer, sizeof(buffer), "%s",
+               step.op < NUM_OPS ? kNames[step.op] : "?");
+      break;
+  }
+  return buffer;
+}
+
+std::string AvbLockModel::Describe(const State& state) {
+  char buffer[96];
+  snprintf(buffer, sizeof(buffer),
+           "bootloader=%d production=%d carrier=0x%02x device=0x%02x "
+           "boot=0x%02x owner=0x%02x", state.bootloader, state.production,
+           state.locks[CARRIER], state.locks[DEVICE], state.locks[BOOT],
+           state.locks[OWNER]);
+  return buffer;
+}
+
+}  // namespace test_harness
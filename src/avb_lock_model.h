@@ -0,0 +1,73 @@
+#ifndef SRC_AVB_LOCK_MODEL_H
+#define SRC_AVB_LOCK_MODEL_H
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+namespace test_harness {
+
+/**
+ * An executable model of the AVB app's lock state: the four locks, the
+ * bootloader flag and production mode. Each step predicts the status code
+ * of the call and the state afterwards, so a random walk can check the
+ * device after every call without resetting in between.
+ *
+ * The rules are those the hand written tests in avb_tests.cc rely on.
+ * Where they say nothing the step is unspecified: the walk accepts whatever
+ * the device does and adopts its state, rather than guessing. */
+class AvbLockModel {
+ public:
+  enum Op {
+    SET_CARRIER_LOCK,
+    SET_DEVICE_LOCK,
+    SET_BOOT_LOCK,
+    SET_OWNER_LOCK,
+    SET_PRODUCTION,
+    RESET_PRODUCTION,
+    RESET_LOCKS,
+    SET_BOOTLOADER,
+    BOOTLOADER_DONE,
+    NUM_OPS,
+  };
+
+  struct Step {
+    Op op;
+    uint8_t value;  /* The lock value, or whether to enter production. */
+  };
+
+  struct State {
+    bool bootloader;
+    bool production;
+    uint8_t locks[4];
+
+    bool operator==(const State& other) const;
+    bool operator!=(const State& other) const { return !(*this == other); }
+  };
+
+  /* Returned by Apply() when the outcome is not modelled. */
+  static constexpr int UNSPECIFIED = -1;
+
+  /* Starts in the state AvbTest::SetUp() leaves the device in: outside the
+   * bootloader, production cleared and no locks. */
+  AvbLockModel();
+
+  /* Returns the expected status code of @step and moves to the expected
+   * state, or returns UNSPECIFIED and leaves the state alone. */
+  int Apply(const Step& step);
+
+  const State& state() const { return current; }
+  /* Takes the device's state after an unspecified step. */
+  void Adopt(const State& state) { current = state; }
+
+  static Step RandomStep(std::mt19937 *rng);
+  static std::string Describe(const Step& step);
+  static std::string Describe(const State& state);
+
+ private:
+  State current;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_AVB_LOCK_MODEL_H
@@ -1,7 +1,15 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <memory>
+#include <random>
+#include <set>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "avb_tools.h"
+#include "device_state.h"
+#include "latency_samples.h"
 #include "nugget_tools.h"
 #include "nugget/app/avb/avb.pb.h"
 #include "Avb.client.h"
@@ -11,13 +19,37 @@
 #include <nos/NuggetClientInterface.h>
 #include "util.h"
 
+#include "src/avb_lock_model.h"
+
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
 
+#ifdef ANDROID
+#define FLAGS_avb_rollback_sweep_rounds 4
+#define FLAGS_avb_walk_steps 1000
+#define FLAGS_avb_walk_seed 0
+#define FLAGS_avb_walk_shrink_attempts 64
+#else
+#include <gflags/gflags.h>
+
+DEFINE_int32(avb_rollback_sweep_rounds, 4,
+             "Number of versions AvbTest.RollbackSweep stores in every "
+             "rollback slot.");
+DEFINE_int32(avb_walk_steps, 1000,
+             "Random lock transitions made by AvbTest.LockModelRandomWalk.");
+DEFINE_uint64(avb_walk_seed, 0,
+              "Seed for AvbTest.LockModelRandomWalk, 0 picks a random one.");
+DEFINE_int32(avb_walk_shrink_attempts, 64,
+             "Replays spent shrinking a failing random walk.");
+#endif  // ANDROID
+
 using std::cout;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+
+using test_harness::AvbLockModel;
 
 using namespace nugget::app::avb;
 using namespace avb_tools;
@@ -45,10 +77,14 @@ class AvbTest: public testing::Test {
   int SetDeviceLock(uint8_t locked);
   int SetBootLock(uint8_t locked);
   int SetOwnerLock(uint8_t locked, const uint8_t *metadata, size_t size);
-  int GetOwnerKey(uint32_t offset, uint8_t *metadata, size_t *size);
   int SetCarrierLock(uint8_t locked, const uint8_t *metadata, size_t size);
 
+  int Execute(const AvbLockModel::Step& step);
+  size_t Walk(const vector<AvbLockModel::Step>& steps, string *why,
+              size_t *unspecified, std::set<string> *states);
+
  public:
+  const uint8_t ROLLBACK_SLOTS = 8;
   const uint64_t LAST_NONCE = 0x4141414141414140ULL;
   const uint64_t VERSION = 1;
   const uint64_t NONCE = 0x4141414141414141ULL;
@@ -114,29 +150,24 @@ void AvbTest::TearDownTestCase() {
 
 void AvbTest::SetUp(void)
 {
-  bool bootloader;
-  bool production;
-  uint8_t locks[4];
-  int code;
-
-  avb_tools::BootloaderDone(client.get());  // We don't need BL for setup.
-  // Perform a challenge/response. If this fails, either
-  // the reset path is broken or the image is probably not
-  // TEST_IMAGE=1.
+  // Every test starts outside the bootloader with production and the locks
+  // cleared. Only the transitions which are still needed are made; if the
+  // reset path fails the image is probably not TEST_IMAGE=1.
   // Note: the reset tests are not safe on -UTEST_IMAGE unless
   //       the storage can be reflashed.
-  ResetProduction(client.get());
-
-  code = Reset(client.get(), ResetRequest::LOCKS, NULL, 0);
-  ASSERT_NO_ERROR(code, "");
-
-  GetState(client.get(), &bootloader, &production, locks);
-  EXPECT_EQ(bootloader, false);
-  EXPECT_EQ(production, false);
-  EXPECT_EQ(locks[BOOT], 0x00);
-  EXPECT_EQ(locks[CARRIER], 0x00);
-  EXPECT_EQ(locks[DEVICE], 0x00);
-  EXPECT_EQ(locks[OWNER], 0x00);
+  device_state::Requirements required;
+  required.bootloader = device_state::BOOTLOADER_DONE;
+  required.production_cleared = true;
+  required.locks_cleared = true;
+  device_state::AvbState state;
+  ASSERT_NO_FATAL_FAILURE(device_state::Ensure(client.get(), required, &state));
+
+  EXPECT_EQ(state.bootloader, false);
+  EXPECT_EQ(state.production, false);
+  EXPECT_EQ(state.locks[BOOT], 0x00);
+  EXPECT_EQ(state.locks[CARRIER], 0x00);
+  EXPECT_EQ(state.locks[DEVICE], 0x00);
+  EXPECT_EQ(state.locks[OWNER], 0x00);
 }
 
 static const uint8_t kResetKeyPem[] =
@@ -295,34 +326,6 @@ int AvbTest::SetOwnerLock(uint8_t locked, const uint8_t *metadata, size_t size)
   return service.SetOwnerLock(request, nullptr);
 }
 
-int AvbTest::GetOwnerKey(uint32_t offset, uint8_t *metadata, size_t *size)
-{
-  GetOwnerKeyRequest request;
-  GetOwnerKeyResponse response;
-  size_t i;
-  int code;
-
-  request.set_offset(offset);
-  if (size != NULL)
-    request.set_size(*size);
-
-  Avb service(*client);
-  code = service.GetOwnerKey(request, &response);
-
-  if (code == APP_SUCCESS) {
-    auto chunk = response.chunk();
-
-    if (metadata != NULL) {
-      for (i = 0; i < chunk.size(); i++)
-        metadata[i] = chunk[i];
-    }
-    if (size != NULL)
-      *size = chunk.size();
-  }
-
-  return code;
-}
-
 int AvbTest::SetCarrierLock(uint8_t locked, const uint8_t *metadata, size_t size)
 {
   CarrierLockRequest request;
@@ -336,6 +339,99 @@ int AvbTest::SetCarrierLock(uint8_t locked, const uint8_t *metadata, size_t size
   return service.CarrierLock(request, nullptr);
 }
 
+// Makes the call for a step of the lock model and returns its status.
+int AvbTest::Execute(const AvbLockModel::Step& step)
+{
+  switch (step.op) {
+  case AvbLockModel::SET_CARRIER_LOCK:
+    if (step.value)
+      return SetCarrierLock(step.value, DEVICE_DATA, sizeof(DEVICE_DATA));
+    return SetCarrierLock(0, NULL, 0);
+  case AvbLockModel::SET_DEVICE_LOCK:
+    return SetDeviceLock(step.value);
+  case AvbLockModel::SET_BOOT_LOCK:
+    return SetBootLock(step.value);
+  case AvbLockModel::SET_OWNER_LOCK:
+    return SetOwnerLock(step.value, NULL, 0);
+  case AvbLockModel::SET_PRODUCTION:
+    return SetProduction(client.get(), step.value, NULL, 0);
+  case AvbLockModel::RESET_PRODUCTION:
+    ResetProduction(client.get());
+    return APP_SUCCESS;
+  case AvbLockModel::RESET_LOCKS:
+    return Reset(client.get(), ResetRequest::LOCKS, NULL, 0);
+  case AvbLockModel::SET_BOOTLOADER:
+    avb_tools::SetBootloader(client.get());
+    return APP_SUCCESS;
+  case AvbLockModel::BOOTLOADER_DONE: {
+    // Not avb_tools::BootloaderDone(), which asserts it succeeds.
+    BootloaderDoneRequest request;
+    Avb service(*client);
+    return service.BootloaderDone(request, nullptr);
+  }
+  case AvbLockModel::NUM_OPS:
+    break;
+  }
+  return -1;
+}
+
+// The number of fatal failures recorded so far in the running test.
+// HasFatalFailure() stays true once the first one happens, so Walk() compares
+// this before and after each step to tell whether that step broke something.
+static int FatalFailureCount()
+{
+  const testing::TestResult *result =
+      testing::UnitTest::GetInstance()->current_test_info()->result();
+  int count = 0;
+  for (int i = 0; i < result->total_part_count(); i++) {
+    if (result->GetTestPartResult(i).fatally_failed())
+      count++;
+  }
+  return count;
+}
+
+// Runs @steps from the SetUp() state, checking the status and GetState()
+// against the model after each one. Returns the index of the first step
+// where they disagree, described in @why, or steps.size().
+size_t AvbTest::Walk(const vector<AvbLockModel::Step>& steps, string *why,
+                     size_t *unspecified, std::set<string> *states)
+{
+  AvbLockModel model;
+  for (size_t i = 0; i < steps.size(); i++) {
+    const int expected = model.Apply(steps[i]);
+    const int fatal_failures = FatalFailureCount();
+    const int code = Execute(steps[i]);
+
+    AvbLockModel::State actual;
+    GetState(client.get(), &actual.bootloader, &actual.production,
+             actual.locks);
+    if (FatalFailureCount() != fatal_failures) {
+      *why = "step " + std::to_string(i) + ": " +
+          AvbLockModel::Describe(steps[i]) + " broke the connection";
+      return i;
+    }
+    if (states)
+      states->insert(AvbLockModel::Describe(actual));
+
+    if (expected == AvbLockModel::UNSPECIFIED) {
+      model.Adopt(actual);
+      if (unspecified)
+        ++*unspecified;
+      continue;
+    }
+    if (code != expected || actual != model.state()) {
+      *why = "step " + std::to_string(i) + ": " +
+          AvbLockModel::Describe(steps[i]) + " returned " +
+          std::to_string(code) + ", model expected " +
+          std::to_string(expected) + "\n  device: " +
+          AvbLockModel::Describe(actual) + "\n  model:  " +
+          AvbLockModel::Describe(model.state());
+      return i;
+    }
+  }
+  return steps.size();
+}
+
 // Tests
 
 TEST_F(AvbTest, CarrierLockTest)
@@ -549,8 +645,10 @@ TEST_F(AvbTest, SetBootLockAfterWipingUserData) {
 TEST_F(AvbTest, OwnerLockTest)
 {
   uint8_t owner_key[AVB_METADATA_MAX_SIZE];
-  uint8_t chunk[AVB_CHUNK_MAX_SIZE];
   uint8_t locks[4];
+  TransferStats write_stats;
+  TransferStats read_stats;
+  size_t mismatch = 0;
   int code;
   size_t i;
 
@@ -560,23 +658,22 @@ TEST_F(AvbTest, OwnerLockTest)
   }
 
   // This should pass when BOOT lock is not set
-  code = SetOwnerLock(0x65, owner_key, sizeof(owner_key));
+  code = WriteOwnerKey(client.get(), 0x65, owner_key, sizeof(owner_key),
+                       &write_stats);
   ASSERT_NO_ERROR(code, "");
 
   GetState(client.get(), NULL, NULL, locks);
   ASSERT_EQ(locks[OWNER], 0x65);
 
-  for (i = 0; i < AVB_METADATA_MAX_SIZE; i += AVB_CHUNK_MAX_SIZE) {
-    size_t size = sizeof(chunk);
-    size_t j;
-
-    code = GetOwnerKey(i, chunk, &size);
-    ASSERT_NO_ERROR(code, "");
-    ASSERT_EQ(size, sizeof(chunk));
-    for (j = 0; j < size; j++) {
-      ASSERT_EQ(chunk[j], owner_key[i + j]);
-    }
-  }
+  code = VerifyOwnerKey(client.get(), owner_key, sizeof(owner_key), &mismatch,
+                        &read_stats);
+  const string where = code == APP_ERROR_BOGUS_ARGS ?
+      ": differs at byte " + std::to_string(mismatch) : "";
+  ASSERT_NO_ERROR(code, where);
+  printf("owner key: wrote %zu bytes at %.0f B/s, read %zu bytes in %zu "
+         "calls at %.0f B/s\n", write_stats.bytes,
+         write_stats.BytesPerSecond(), read_stats.bytes, read_stats.calls,
+         read_stats.BytesPerSecond());
 
   // Test setting the lock while set fails
   code = SetOwnerLock(0x87, owner_key, sizeof(owner_key));
@@ -656,7 +753,7 @@ TEST_F(AvbTest, Rollback)
   // Test we cannot change values in normal mode
   code = SetProduction(client.get(), true, NULL, 0);
   ASSERT_NO_ERROR(code, "");
-  for (i = 0; i < 8; i++) {
+  for (i = 0; i < ROLLBACK_SLOTS; i++) {
     code = Store(i, 0xFF00000011223344 + i);
     ASSERT_EQ(code, APP_ERROR_AVB_BOOTLOADER);
 
@@ -667,7 +764,7 @@ TEST_F(AvbTest, Rollback)
 
   // Test we can change values in bootloader mode
   avb_tools::SetBootloader(client.get());
-  for (i = 0; i < 8; i++) {
+  for (i = 0; i < ROLLBACK_SLOTS; i++) {
     code = Store(i, 0xFF00000011223344 + i);
     ASSERT_NO_ERROR(code, "");
 
@@ -684,6 +781,143 @@ TEST_F(AvbTest, Rollback)
   }
 }
 
+// Prints the distribution of @latencies, in milliseconds.
+static void PrintLatencies(const char *what, vector<double> *latencies)
+{
+  if (latencies->empty())
+    return;
+  const nugget_tools::LatencySummary summary =
+      nugget_tools::SummarizeLatencies(latencies);
+  printf("%-12s %6zu %10.2f %10.2f %10.2f %10.2f\n", what, summary.count,
+         summary.min, summary.median, summary.p95, summary.max);
+}
+
+// Stores increasing versions in every rollback slot, as successive OTAs
+// would, and checks they survive deep sleep and a hard reboot. The latency
+// of each Store and Load is reported since the bootloader makes these calls
+// on every boot.
+TEST_F(AvbTest, RollbackSweep)
+{
+  const uint64_t BASE = 0x0000000100000000ULL;
+  const int rounds = std::max(FLAGS_avb_rollback_sweep_rounds, 1);
+  vector<double> store_ms;
+  vector<double> load_ms;
+  vector<uint64_t> expected(ROLLBACK_SLOTS, 0);
+  // Stores which changed the value, so must have been written to flash.
+  vector<int> writes(ROLLBACK_SLOTS, 0);
+  uint64_t loaded;
+
+  auto timed_load = [&](uint8_t slot, uint64_t *version) {
+    const auto start = std::chrono::steady_clock::now();
+    const int code = Load(slot, version);
+    load_ms.push_back(std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count());
+    return code;
+  };
+  auto check_slots = [&](const char *when) {
+    for (uint8_t slot = 0; slot < ROLLBACK_SLOTS; slot++) {
+      loaded = ~0ULL;
+      ASSERT_NO_ERROR(timed_load(slot, &loaded), when);
+      ASSERT_EQ(loaded, expected[slot]) << "slot " << (int)slot << " " << when;
+    }
+  };
+
+  avb_tools::SetBootloader(client.get());
+  for (int round = 0; round < rounds; round++) {
+    for (uint8_t slot = 0; slot < ROLLBACK_SLOTS; slot++) {
+      const uint64_t version = BASE * (round + 1) + slot;
+      const auto start = std::chrono::steady_clock::now();
+      const int code = Store(slot, version);
+      store_ms.push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count());
+      ASSERT_NO_ERROR(code, "");
+      if (version != expected[slot])
+        writes[slot]++;
+      expected[slot] = version;
+
+      ASSERT_NO_ERROR(timed_load(slot, &loaded), "");
+      ASSERT_EQ(loaded, version) << "slot " << (int)slot;
+    }
+  }
+
+  ASSERT_TRUE(nugget_tools::WaitForSleep(client.get(), nullptr));
+  ASSERT_NO_FATAL_FAILURE(check_slots("after deep sleep"));
+  ASSERT_TRUE(nugget_tools::RebootNugget(client.get()));
+  ASSERT_NO_FATAL_FAILURE(check_slots("after reboot"));
+
+  // Leave the slots as the other tests expect to find them.
+  avb_tools::SetBootloader(client.get());
+  for (uint8_t slot = 0; slot < ROLLBACK_SLOTS; slot++) {
+    ASSERT_NO_ERROR(Store(slot, 0), "");
+    writes[slot]++;
+    expected[slot] = 0;
+  }
+  ASSERT_NO_FATAL_FAILURE(check_slots("after clearing"));
+
+  printf("%-12s %6s %10s %10s %10s %10s\n", "call", "n", "min ms",
+         "median ms", "p95 ms", "max ms");
+  PrintLatencies("Store", &store_ms);
+  PrintLatencies("Load", &load_ms);
+  printf("flash writes per slot:");
+  for (int count : writes)
+    printf(" %d", count);
+  printf("\n");
+}
+
+// Makes random lock transitions without resetting in between and checks
+// each one against AvbLockModel. A failing walk is shrunk by replaying
+// shorter versions from SetUp() before it is reported.
+TEST_F(AvbTest, LockModelRandomWalk)
+{
+  const uint32_t seed = FLAGS_avb_walk_seed
+      ? static_cast<uint32_t>(FLAGS_avb_walk_seed) : std::random_device()();
+  std::mt19937 rng(seed);
+  vector<AvbLockModel::Step> steps;
+  for (int i = 0; i < FLAGS_avb_walk_steps; i++)
+    steps.push_back(AvbLockModel::RandomStep(&rng));
+
+  string why;
+  size_t unspecified = 0;
+  std::set<string> states;
+  const size_t failed = Walk(steps, &why, &unspecified, &states);
+  printf("%zu steps, %zu distinct states, %zu unspecified steps, seed %u\n",
+         std::min(failed + 1, steps.size()), states.size(), unspecified, seed);
+  if (failed == steps.size())
+    return;
+
+  // Drop ever smaller runs of steps while the walk still fails.
+  vector<AvbLockModel::Step> failing(steps.begin(),
+                                     steps.begin() + failed + 1);
+  int attempts = 0;
+  for (size_t chunk = failing.size() / 2; chunk > 0; chunk /= 2) {
+    for (size_t start = 0; start < failing.size() &&
+             attempts < FLAGS_avb_walk_shrink_attempts;) {
+      vector<AvbLockModel::Step> candidate(failing);
+      candidate.erase(candidate.begin() + start,
+                      candidate.begin() + std::min(start + chunk,
+                                                   candidate.size()));
+      attempts++;
+      ASSERT_NO_FATAL_FAILURE(SetUp());
+      string candidate_why;
+      const size_t at = Walk(candidate, &candidate_why, nullptr, nullptr);
+      if (at < candidate.size()) {
+        candidate.resize(at + 1);
+        failing.swap(candidate);
+        why = candidate_why;
+      } else {
+        start += chunk;
+      }
+    }
+  }
+
+  string sequence;
+  for (const auto& step : failing)
+    sequence += "\n  " + AvbLockModel::Describe(step);
+  FAIL() << why << "\nShortest failing sequence from SetUp() after "
+         << attempts << " replays:" << sequence
+         << "\nReproduce with --avb_walk_seed=" << seed;
+}
+
 TEST_F(AvbTest, Reset)
 {
   bool bootloader;
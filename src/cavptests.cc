@@ -1,13 +1,17 @@
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <string>
 
 #include "gtest/gtest.h"
 #include "gflags/gflags.h"
 #include "nugget/app/protoapi/control.pb.h"
 #include "nugget/app/protoapi/header.pb.h"
 #include "nugget/app/protoapi/testing_api.pb.h"
+#include "src/assertions.h"
 #include "src/macros.h"
+#include "src/protoapi_call.h"
 #include "src/util.h"
 
 using nugget::app::protoapi::AesGcmEncryptTest;
@@ -19,28 +23,19 @@ using nugget::app::protoapi::NoticeCode;
 using nugget::app::protoapi::OneofTestParametersCase;
 using nugget::app::protoapi::OneofTestResultsCase;
 using std::cout;
-using std::stringstream;
 using std::unique_ptr;
 
 DEFINE_bool(nos_test_dump_protos, false, "Dump binary protobufs to a file.");
 DEFINE_int32(test_input_number, -1, "Run a specific test input.");
-
-#define ASSERT_MSG_TYPE(msg, type_) \
-do{if(type_ != APImessageID::NOTICE && msg.type == APImessageID::NOTICE){ \
-  Notice received; \
-  received.ParseFromArray(reinterpret_cast<char *>(msg.data), msg.data_len); \
-  ASSERT_EQ(msg.type, type_) \
-      << msg.type << " is " << APImessageID_Name((APImessageID) msg.type) \
-      << "\n" << received.DebugString(); \
-}else{ \
-  ASSERT_EQ(msg.type, type_) \
-      << msg.type << " is " << APImessageID_Name((APImessageID) msg.type); \
-}}while(0)
-
-#define ASSERT_SUBTYPE(msg, type_) \
-  EXPECT_GT(msg.data_len, 2); \
-  uint16_t subtype = (msg.data[0] << 8) | msg.data[1]; \
-  EXPECT_EQ(subtype, type_)
+DEFINE_string(vector_range, "",
+              "Only run the vectors in begin:end, end exclusive. Either side "
+              "may be left empty, e.g. 5000: resumes from vector 5000.");
+DEFINE_int32(shard_index, 0, "Which of the --shard_count shards to run.");
+DEFINE_int32(shard_count, 1,
+             "Split the vectors into this many shards by stride, so shard i "
+             "runs vectors i, i + count, i + 2 * count and so on.");
+DEFINE_int32(progress_interval, 1000,
+             "Print progress every this many vectors; 0 disables it.");
 
 namespace {
 
@@ -51,14 +46,51 @@ class NuggetOsTest: public testing::Test {
   static void SetUpTestCase();
   static void TearDownTestCase();
 
+  void CheckVector(size_t i, AesGcmEncryptTest *request,
+                   AesGcmEncryptTestResult *result);
+
  public:
   static unique_ptr<test_harness::TestHarness> harness;
 };
 
 unique_ptr<test_harness::TestHarness> NuggetOsTest::harness;
 
+// Parses a vector index of at most @count. strtoul() would accept a sign and
+// wrap "-5" around, so only plain digits are allowed.
+bool ParseVectorIndex(const std::string& text, size_t count, size_t *index) {
+  if (text.empty() || text.size() > 9 ||
+      text.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  *index = strtoul(text.c_str(), nullptr, 10);
+  return *index <= count;
+}
+
+// Parses "begin:end" into [*begin, *end) within @count vectors.
+bool ParseVectorRange(const std::string& range, size_t count, size_t *begin,
+                      size_t *end) {
+  *begin = 0;
+  *end = count;
+  if (range.empty()) {
+    return true;
+  }
+  const size_t colon = range.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  const std::string first = range.substr(0, colon);
+  const std::string last = range.substr(colon + 1);
+  if (!first.empty() && !ParseVectorIndex(first, count, begin)) {
+    return false;
+  }
+  if (!last.empty() && !ParseVectorIndex(last, count, end)) {
+    return false;
+  }
+  return *begin <= *end;
+}
+
 void NuggetOsTest::SetUpTestCase() {
-  harness = TestHarness::MakeUnique();
+  harness = test_harness::TestHarness::MakeUnique();
 
   if (!harness->UsingSpi()) {
     EXPECT_TRUE(harness->SwitchFromConsoleToProtoApi());
@@ -67,7 +99,7 @@ void NuggetOsTest::SetUpTestCase() {
 }
 
 void NuggetOsTest::TearDownTestCase() {
-  harness->ReadUntil(test_harness::BYTE_TIME * 1024);
+  harness->ReadUntilPromptOrIdle(test_harness::BYTE_TIME * 1024);
   if (!harness->UsingSpi()) {
     EXPECT_TRUE(harness->SwitchFromProtoApiToConsole(NULL));
   }
@@ -76,92 +108,105 @@ void NuggetOsTest::TearDownTestCase() {
 
 #include "src/test-data/NIST-CAVP/aes-gcm-cavp.h"
 
-TEST_F(NuggetOsTest, AesGcm) {
-  const int verbosity = harness->getVerbosity();
-  harness->setVerbosity(verbosity - 1);
-  harness->ReadUntil(test_harness::BYTE_TIME * 1024);
+void NuggetOsTest::CheckVector(size_t i, AesGcmEncryptTest *request,
+                               AesGcmEncryptTestResult *result) {
+  const gcm_data *test_case = &NIST_GCM_DATA[i];
+
+  request->Clear();
+  request->set_key(test_case->key, test_case->key_len / 8);
+  request->set_iv(test_case->IV, test_case->IV_len / 8);
+  request->set_plain_text(test_case->PT, test_case->PT_len / 8);
+  request->set_aad(test_case->AAD, test_case->AAD_len / 8);
+  request->set_tag_len(test_case->tag_len / 8);
+
+  if (FLAGS_nos_test_dump_protos) {
+    std::ofstream outfile;
+    outfile.open("AesGcmEncryptTest_" + std::to_string(test_case->key_len) +
+                 ".proto.bin", std::ios_base::binary);
+    outfile << request->SerializeAsString();
+    outfile.close();
+  }
 
-  size_t i = 0;
-  size_t test_input_count = ARRAYSIZE(NIST_GCM_DATA);
+  ASSERT_CALL(harness, *request, result);
+  EXPECT_EQ(result->result_code(), DcryptError::DE_NO_ERROR)
+      << result->result_code() << " is "
+      << DcryptError_Name(result->result_code());
+
+  ASSERT_EQ(result->cipher_text().size(), test_case->PT_len / 8)
+          << "\n" << result->DebugString();
+  ASSERT_BUFFER_EQ(test_case->CT, result->cipher_text().data(),
+                   test_case->PT_len / 8)
+      << "test_case: " << i << "\n"
+      << "result   : " << result->DebugString();
+
+  ASSERT_EQ(result->tag().size(), test_case->tag_len / 8)
+          << "\n" << result->DebugString();
+  ASSERT_BUFFER_EQ(test_case->tag, result->tag().data(),
+                   test_case->tag_len / 8)
+      << "test_case: " << i << "\n"
+      << "result   : " << result->DebugString();
+}
+
+TEST_F(NuggetOsTest, AesGcm) {
+  size_t begin;
+  size_t end;
+  ASSERT_TRUE(ParseVectorRange(FLAGS_vector_range, ARRAYSIZE(NIST_GCM_DATA),
+                               &begin, &end))
+      << "Bad --vector_range=" << FLAGS_vector_range;
   if (FLAGS_test_input_number != -1) {
-    i = FLAGS_test_input_number;
-    test_input_count = FLAGS_test_input_number + 1;
+    ASSERT_GE(FLAGS_test_input_number, 0);
+    ASSERT_LT(static_cast<size_t>(FLAGS_test_input_number),
+              ARRAYSIZE(NIST_GCM_DATA));
+    begin = FLAGS_test_input_number;
+    end = FLAGS_test_input_number + 1;
   }
-  for (; i < test_input_count; i++) {
-    const gcm_data *test_case = &NIST_GCM_DATA[i];
-
-    AesGcmEncryptTest request;
-    request.set_key(test_case->key, test_case->key_len / 8);
-    request.set_iv(test_case->IV, test_case->IV_len / 8);
-    request.set_plain_text(test_case->PT, test_case->PT_len / 8);
-    request.set_aad(test_case->AAD, test_case->AAD_len / 8);
-    request.set_tag_len(test_case->tag_len / 8);
-
-    if (FLAGS_nos_test_dump_protos) {
-      std::ofstream outfile;
-      outfile.open("AesGcmEncryptTest_" + std::to_string(test_case->key_len) +
-                   ".proto.bin", std::ios_base::binary);
-      outfile << request.SerializeAsString();
-      outfile.close();
-    }
-
-    ASSERT_NO_ERROR(harness->SendOneofProto(
-        APImessageID::TESTING_API_CALL,
-        OneofTestParametersCase::kAesGcmEncryptTest,
-        request), "");
-
-    test_harness::raw_message msg;
-    ASSERT_NO_ERROR(harness->GetData(&msg, 4096 * BYTE_TIME), "");
-    ASSERT_MSG_TYPE(msg, APImessageID::TESTING_API_RESPONSE);
-    ASSERT_SUBTYPE(msg, OneofTestResultsCase::kAesGcmEncryptTestResult);
-
-    AesGcmEncryptTestResult result;
-    ASSERT_TRUE(result.ParseFromArray(reinterpret_cast<char *>(msg.data + 2),
-                                      msg.data_len - 2));
-    EXPECT_EQ(result.result_code(), DcryptError::DE_NO_ERROR)
-        << result.result_code() << " is "
-        << DcryptError_Name(result.result_code());
-
-    ASSERT_EQ(result.cipher_text().size(), test_case->PT_len / 8)
-            << "\n" << result.DebugString();
-    const uint8_t *CT = (const uint8_t *)test_case->CT;
-    stringstream ct_ss;
-    for (size_t j = 0; j < test_case->PT_len / 8; j++) {
-      if (CT[j] < 16) {
-        ct_ss << '0';
-      }
-      ct_ss << std::hex << (unsigned int)CT[j];
-    }
-    for (size_t j = 0; j < test_case->PT_len / 8; j++) {
-      ASSERT_EQ(result.cipher_text()[j] & 0x00FF, CT[j] & 0x00FF)
-              << "\n"
-              << "test_case: " << i << "\n"
-              << "result   : " << result.DebugString()
-              << "CT       : " << ct_ss.str() << "\n"
-              << "mis-match: " << j;
-    }
+  ASSERT_GT(FLAGS_shard_count, 0);
+  ASSERT_GE(FLAGS_shard_index, 0);
+  ASSERT_LT(FLAGS_shard_index, FLAGS_shard_count);
+  const size_t shard_count = FLAGS_shard_count;
+  const size_t shard_index = FLAGS_shard_index;
+
+  // Vectors are dealt out by their absolute index so the shards of a range
+  // don't depend on where the range starts.
+  const size_t first =
+      begin + (shard_index + shard_count - begin % shard_count) % shard_count;
+  const size_t shard_size =
+      first < end ? (end - first + shard_count - 1) / shard_count : 0;
+  const std::string shard = "[shard " + std::to_string(shard_index) + "/" +
+      std::to_string(shard_count) + "] ";
+  cout << shard << shard_size << " vectors in " << begin << ":" << end
+       << "\n";
 
-    ASSERT_EQ(result.tag().size(), test_case->tag_len / 8)
-            << "\n" << result.DebugString();
-    const uint8_t *tag = (const uint8_t *)test_case->tag;
-    stringstream tag_ss;
-    for (size_t j = 0; j < test_case->tag_len / 8; j++) {
-      if (tag[j] < 16) {
-        tag_ss << '0';
-      }
-      tag_ss << std::hex << (unsigned int)tag[j];
+  const int verbosity = harness->getVerbosity();
+  harness->setVerbosity(verbosity - 1);
+  harness->ReadUntilPromptOrIdle(test_harness::BYTE_TIME * 1024);
+
+  // The messages are reused across the vectors; Clear() keeps the capacity of
+  // their string fields.
+  AesGcmEncryptTest request;
+  AesGcmEncryptTestResult result;
+  const auto start = std::chrono::steady_clock::now();
+  size_t done = 0;
+  for (size_t i = first; i < end; i += shard_count) {
+    CheckVector(i, &request, &result);
+    if (HasFatalFailure()) {
+      cout << shard << "stopped at vector " << i << "; resume with "
+           << "--vector_range=" << i << ":" << end << "\n";
+      break;
     }
-    for (size_t j = 0; j < test_case->tag_len / 8; j++) {
-      ASSERT_EQ(result.tag()[j] & 0x00ff, tag[j] & 0x00ff)
-              << "\n"
-              << "test_case: " << i << "\n"
-              << "result   : " << result.DebugString()
-              << "TAG      : " << tag_ss.str() << "\n"
-              << "mis-match: " << j;
+    done++;
+
+    if (FLAGS_progress_interval > 0 &&
+        (done % FLAGS_progress_interval == 0 || done == shard_size)) {
+      const double seconds = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+      cout << shard << done << "/" << shard_size << " vectors, last " << i
+           << ", " << (seconds > 0 ? done / seconds : 0) << " vectors/s"
+           << std::endl;
     }
   }
 
-  harness->ReadUntil(test_harness::BYTE_TIME * 1024);
+  harness->ReadUntilPromptOrIdle(test_harness::BYTE_TIME * 1024);
   harness->setVerbosity(verbosity);
 }
 
@@ -0,0 +1,78 @@
+#include "src/concurrent_harness.h"
+
+#include <cstdio>
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+namespace test_harness {
+
+void FairMutex::lock() {
+  std::unique_lock<std::mutex> lock(mutex);
+  const uint64_t ticket = next_ticket++;
+  turn.wait(lock, [&]() { return serving == ticket; });
+}
+
+void FairMutex::unlock() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    serving++;
+  }
+  turn.notify_all();
+}
+
+ConcurrentTestHarness::Context::Context(ConcurrentTestHarness* owner,
+                                        const std::string& name)
+    : owner(owner), caller_name(name) {
+  caller_stats.calls = 0;
+  caller_stats.waited = std::chrono::nanoseconds(0);
+  caller_stats.max_wait = std::chrono::nanoseconds(0);
+  last_reply.type = 0;
+  last_reply.data_len = 0;
+}
+
+uint32_t ConcurrentTestHarness::Context::CallApp(
+    uint32_t app_id, uint16_t arg, const std::vector<uint8_t>& request,
+    std::vector<uint8_t>* response) {
+  return Serialized([&]() {
+    return owner->client
+        ? owner->client->CallApp(app_id, arg, request, response)
+        : owner->harness->CallApp(app_id, arg, request, response);
+  });
+}
+
+int ConcurrentTestHarness::Context::Exchange(const raw_message& request,
+                                             raw_message* reply,
+                                             microseconds timeout) {
+  return Serialized([&]() {
+    const int code = owner->harness->SendData(request);
+    if (code != error_codes::NO_ERROR) {
+      return code;
+    }
+    return owner->harness->GetData(reply, timeout);
+  });
+}
+
+ConcurrentTestHarness::ConcurrentTestHarness(
+    TestHarness* harness, nos::NuggetClientInterface* client)
+    : harness(harness), client(client) {}
+
+std::unique_ptr<ConcurrentTestHarness::Context>
+ConcurrentTestHarness::NewContext(const std::string& name) {
+  return std::unique_ptr<Context>(new Context(this, name));
+}
+
+void ConcurrentTestHarness::PrintStats(
+    const std::vector<std::unique_ptr<Context>>& contexts) {
+  for (const auto& context : contexts) {
+    const CallerStats& stats = context->stats();
+    const long long mean = stats.calls
+        ? duration_cast<microseconds>(stats.waited).count() / stats.calls : 0;
+    printf("%-12s %6zu calls, mean wait %8lld us, max wait %8lld us\n",
+           context->name().c_str(), stats.calls, mean,
+           static_cast<long long>(
+               duration_cast<microseconds>(stats.max_wait).count()));
+  }
+}
+
+}  // namespace test_harness
@@ -0,0 +1,150 @@
+#ifndef SRC_CONCURRENT_HARNESS_H
+#define SRC_CONCURRENT_HARNESS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nos/NuggetClientInterface.h>
+
+#include "src/util.h"
+
+namespace test_harness {
+
+/**
+ * A mutex which hands itself out in the order it was asked for. std::mutex
+ * lets a thread which has just unlocked take the lock straight back, which
+ * starves the other callers when every thread is in a tight request loop. */
+class FairMutex {
+ public:
+  FairMutex() : next_ticket(0), serving(0) {}
+
+  FairMutex(const FairMutex&) = delete;
+  FairMutex& operator=(const FairMutex&) = delete;
+
+  void lock();
+  void unlock();
+
+ private:
+  std::mutex mutex;
+  std::condition_variable turn;
+  uint64_t next_ticket;
+  uint64_t serving;
+};
+
+/**
+ * Lets several threads drive one board through one TestHarness. The harness
+ * keeps the request and reply of a single exchange in shared buffers, so
+ * each thread gets its own Context and the contexts take turns at the device
+ * one whole exchange at a time, first come first served.
+ *
+ * A Context is also a nos::NuggetClientInterface so app clients such as
+ * Weaver can be built on it directly. */
+class ConcurrentTestHarness {
+ public:
+  /* How long a context has waited for the device. */
+  struct CallerStats {
+    size_t calls;
+    std::chrono::nanoseconds waited;
+    std::chrono::nanoseconds max_wait;
+  };
+
+  class Context : public nos::NuggetClientInterface {
+   public:
+    /* The device is opened and closed by the harness. */
+    void Open() override {}
+    void Close() override {}
+    bool IsOpen() const override { return true; }
+    uint32_t CallApp(uint32_t app_id, uint16_t arg,
+                     const std::vector<uint8_t>& request,
+                     std::vector<uint8_t>* response) override;
+
+    /** Sends @request and waits for the reply without letting another
+     * context in between.
+     *
+     * @return an error_codes value. */
+    int Exchange(const raw_message& request, raw_message* reply,
+                 std::chrono::microseconds timeout = 4096 * BYTE_TIME);
+
+    /** TestHarness::Call() for this context; include src/protoapi_call.h to
+     * use it. A reply the call rejected is copied into LastReply() before
+     * the next context gets the device. */
+    template <typename Request>
+    int Call(const Request& request,
+             typename TestCall<Request>::Result* result,
+             std::chrono::microseconds timeout = 4096 * BYTE_TIME);
+
+    const raw_message& LastReply() const { return last_reply; }
+
+    const std::string& name() const { return caller_name; }
+    /* Only valid once the thread using the context is done with it. */
+    const CallerStats& stats() const { return caller_stats; }
+
+   private:
+    friend class ConcurrentTestHarness;
+    Context(ConcurrentTestHarness* owner, const std::string& name);
+
+    /* Runs @f while holding the device and accounts for the wait. */
+    template <typename F>
+    auto Serialized(F f) -> decltype(f());
+
+    ConcurrentTestHarness* owner;
+    std::string caller_name;
+    CallerStats caller_stats;
+    raw_message last_reply;
+  };
+
+  /**
+   * @param harness Not owned, must outlive the contexts.
+   * @param client If given, carries CallApp() instead of the harness's own
+   * client, e.g. a fixture which already has a connection open. */
+  explicit ConcurrentTestHarness(TestHarness* harness,
+                                 nos::NuggetClientInterface* client = nullptr);
+
+  /* One per thread. A context must not be shared between threads. */
+  std::unique_ptr<Context> NewContext(const std::string& name);
+
+  /* Prints a line of wait times per context. */
+  static void PrintStats(
+      const std::vector<std::unique_ptr<Context>>& contexts);
+
+ private:
+  TestHarness* harness;
+  nos::NuggetClientInterface* client;
+  FairMutex dispatch;
+};
+
+template <typename F>
+auto ConcurrentTestHarness::Context::Serialized(F f) -> decltype(f()) {
+  const auto asked = std::chrono::steady_clock::now();
+  std::lock_guard<FairMutex> lock(owner->dispatch);
+  const auto waited = std::chrono::steady_clock::now() - asked;
+  caller_stats.calls++;
+  caller_stats.waited += waited;
+  if (waited > caller_stats.max_wait) {
+    caller_stats.max_wait = waited;
+  }
+  return f();
+}
+
+template <typename Request>
+int ConcurrentTestHarness::Context::Call(
+    const Request& request, typename TestCall<Request>::Result* result,
+    std::chrono::microseconds timeout) {
+  return Serialized([&]() {
+    const int code = owner->harness->Call(request, result, timeout);
+    if (code == UNEXPECTED_TYPE || code == UNEXPECTED_SUBTYPE ||
+        code == PARSE_ERROR) {
+      last_reply = owner->harness->LastReply();
+    }
+    return code;
+  });
+}
+
+}  // namespace test_harness
+
+#endif  // SRC_CONCURRENT_HARNESS_H
@@ -0,0 +1,430 @@
+
+#include <gtest/gtest.h>
+#include <openssl/aes.h>
+#include <openssl/cmac.h>
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "nugget/app/protoapi/control.pb.h"
+#include "nugget/app/protoapi/header.pb.h"
+#include "nugget/app/protoapi/testing_api.pb.h"
+#include "src/assertions.h"
+#include "src/protoapi_call.h"
+#include "src/util.h"
+
+#ifdef ANDROID
+#define FLAGS_dcrypto_diff_seed 0
+#define FLAGS_dcrypto_diff_iterations 64
+#define FLAGS_dcrypto_diff_case -1
+#else
+#include <gflags/gflags.h>
+
+DEFINE_uint64(dcrypto_diff_seed, 0,
+              "Seed for the differential crypto tests, 0 picks a random one.");
+DEFINE_int32(dcrypto_diff_iterations, 64,
+             "Number of random cases per differential crypto test.");
+DEFINE_int32(dcrypto_diff_case, -1,
+             "Only run this case index, to reproduce a reported mismatch.");
+#endif  // ANDROID
+
+using nugget::app::protoapi::AesCbcEncryptTest;
+using nugget::app::protoapi::AesCbcEncryptTestResult;
+using nugget::app::protoapi::AesCmacTest;
+using nugget::app::protoapi::AesCmacTestResult;
+using nugget::app::protoapi::AesGcmEncryptTest;
+using nugget::app::protoapi::AesGcmEncryptTestResult;
+using nugget::app::protoapi::APImessageID;
+using nugget::app::protoapi::DcryptError;
+using nugget::app::protoapi::KeySize;
+using nugget::app::protoapi::OneofTestParametersCase;
+using nugget::app::protoapi::OneofTestResultsCase;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using test_harness::TestHarness;
+
+namespace {
+
+using test_harness::BYTE_TIME;
+
+// Cases are generated and checked in batches; the BoringSSL results for a
+// batch are computed on other threads while the device works through it.
+const size_t BATCH_SIZE = 16;
+
+// The request and the response both have to fit in one protoapi message.
+const size_t MAX_CBC_BLOCKS = 16;
+const size_t MAX_GCM_PLAIN_TEXT = 160;
+const size_t MAX_GCM_AAD = 64;
+const size_t MAX_GCM_IV = 32;
+const size_t MAX_CMAC_MESSAGE = 256;
+
+const KeySize KEY_SIZES[] = {KeySize::s128b, KeySize::s192b, KeySize::s256b};
+const size_t GCM_TAG_LENGTHS[] = {4, 8, 12, 13, 14, 15, 16};
+
+enum Mode : uint32_t {
+  MODE_AES_CBC = 1,
+  MODE_AES_GCM = 2,
+  MODE_AES_CMAC = 3,
+};
+
+string Hex(const string& data) {
+  static const char digits[] = "0123456789abcdef";
+  string out;
+  out.reserve(data.size() * 2);
+  for (const char c : data) {
+    out.push_back(digits[(c >> 4) & 0xf]);
+    out.push_back(digits[c & 0xf]);
+  }
+  return out;
+}
+
+string RandomBytes(std::mt19937* rng, size_t len) {
+  string out(len, '\0');
+  for (auto& c : out) {
+    c = static_cast<char>((*rng)() & 0xff);
+  }
+  return out;
+}
+
+size_t RandomRange(std::mt19937* rng, size_t low, size_t high) {
+  return std::uniform_int_distribution<size_t>(low, high)(*rng);
+}
+
+struct CbcCase {
+  KeySize key_size;
+  string key;
+  size_t number_of_blocks;
+};
+
+struct GcmCase {
+  string key;
+  string iv;
+  string plain_text;
+  string aad;
+  size_t tag_len;
+};
+
+struct CmacCase {
+  string key;
+  string message;
+};
+
+struct Expected {
+  string output;
+  string extra;  // The final IV for CBC, the tag for GCM.
+};
+
+CbcCase GenerateCbc(std::mt19937* rng) {
+  CbcCase c;
+  c.key_size = KEY_SIZES[RandomRange(rng, 0, 2)];
+  c.key = RandomBytes(rng, c.key_size);
+  c.number_of_blocks = RandomRange(rng, 1, MAX_CBC_BLOCKS);
+  return c;
+}
+
+GcmCase GenerateGcm(std::mt19937* rng) {
+  GcmCase c;
+  c.key = RandomBytes(rng, KEY_SIZES[RandomRange(rng, 0, 2)]);
+  // Mostly the recommended 96 bit IV, but also exercise GHASH of the IV.
+  const size_t iv_len =
+      RandomRange(rng, 0, 3) ? 12 : RandomRange(rng, 1, MAX_GCM_IV);
+  c.iv = RandomBytes(rng, iv_len);
+  c.plain_text = RandomBytes(rng, RandomRange(rng, 0, MAX_GCM_PLAIN_TEXT));
+  c.aad = RandomBytes(rng, RandomRange(rng, 0, MAX_GCM_AAD));
+  c.tag_len = GCM_TAG_LENGTHS[RandomRange(rng, 0, 6)];
+  return c;
+}
+
+CmacCase GenerateCmac(std::mt19937* rng) {
+  CmacCase c;
+  // The device only implements AES-128 CMAC.
+  c.key = RandomBytes(rng, 16);
+  c.message = RandomBytes(rng, RandomRange(rng, 0, MAX_CMAC_MESSAGE));
+  return c;
+}
+
+// The device encrypts zero blocks with a zero IV and returns the final
+// chaining value as the IV.
+Expected OracleCbc(const CbcCase& c) {
+  Expected expected;
+  uint8_t iv[AES_BLOCK_SIZE] = {};
+  uint8_t in[AES_BLOCK_SIZE] = {};
+  uint8_t out[AES_BLOCK_SIZE];
+  AES_KEY aes_key;
+  AES_set_encrypt_key(reinterpret_cast<const uint8_t *>(c.key.data()),
+                      c.key.size() * 8, &aes_key);
+  for (size_t x = 0; x < c.number_of_blocks; ++x) {
+    AES_cbc_encrypt(in, out, AES_BLOCK_SIZE, &aes_key, iv, AES_ENCRYPT);
+    expected.output.append(reinterpret_cast<char *>(out), sizeof(out));
+  }
+  expected.extra.assign(reinterpret_cast<char *>(iv), sizeof(iv));
+  return expected;
+}
+
+const EVP_CIPHER *GcmCipher(size_t key_len) {
+  switch (key_len) {
+    case 16:
+      return EVP_aes_128_gcm();
+    case 24:
+      return EVP_aes_192_gcm();
+    default:
+      return EVP_aes_256_gcm();
+  }
+}
+
+Expected OracleGcm(const GcmCase& c) {
+  Expected expected;
+  std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(
+      EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+  int len = 0;
+  uint8_t tag[16];
+
+  EVP_EncryptInit_ex(ctx.get(), GcmCipher(c.key.size()), nullptr, nullptr,
+                     nullptr);
+  EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, c.iv.size(), nullptr);
+  EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr,
+                     reinterpret_cast<const uint8_t *>(c.key.data()),
+                     reinterpret_cast<const uint8_t *>(c.iv.data()));
+  if (!c.aad.empty()) {
+    EVP_EncryptUpdate(ctx.get(), nullptr, &len,
+                      reinterpret_cast<const uint8_t *>(c.aad.data()),
+                      c.aad.size());
+  }
+  expected.output.resize(c.plain_text.size());
+  if (!c.plain_text.empty()) {
+    EVP_EncryptUpdate(ctx.get(),
+                      reinterpret_cast<uint8_t *>(&expected.output[0]), &len,
+                      reinterpret_cast<const uint8_t *>(c.plain_text.data()),
+                      c.plain_text.size());
+  }
+  EVP_EncryptFinal_ex(ctx.get(), tag, &len);
+  EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, sizeof(tag), tag);
+  expected.extra.assign(reinterpret_cast<char *>(tag), c.tag_len);
+  return expected;
+}
+
+Expected OracleCmac(const CmacCase& c) {
+  Expected expected;
+  std::unique_ptr<CMAC_CTX, decltype(&CMAC_CTX_free)> ctx(CMAC_CTX_new(),
+                                                          CMAC_CTX_free);
+  uint8_t mac[AES_BLOCK_SIZE];
+  size_t mac_len = sizeof(mac);
+  CMAC_Init(ctx.get(), c.key.data(), c.key.size(), EVP_aes_128_cbc(), nullptr);
+  CMAC_Update(ctx.get(), c.message.data(), c.message.size());
+  CMAC_Final(ctx.get(), mac, &mac_len);
+  expected.output.assign(reinterpret_cast<char *>(mac), mac_len);
+  return expected;
+}
+
+class DcryptoDifferentialTest: public testing::Test {
+ protected:
+  static void SetUpTestCase();
+  static void TearDownTestCase();
+
+  /* Runs the cases for @mode. @check is called with each case and the
+   * oracle's answer for it and talks to the device. */
+  template <typename Case>
+  void Run(Mode mode, std::function<Case(std::mt19937*)> generate,
+           std::function<Expected(const Case&)> oracle,
+           std::function<void(const Case&, const Expected&)> check);
+
+  /* Calls the device with @request and checks the result code. */
+  template <typename Request>
+  void Transact(const Request& request,
+                typename test_harness::TestCall<Request>::Result* result);
+
+  /* How to rerun the current case on its own. */
+  string Repro(size_t index) const;
+
+ public:
+  static unique_ptr<TestHarness> harness;
+  static uint64_t seed;
+};
+
+unique_ptr<TestHarness> DcryptoDifferentialTest::harness;
+uint64_t DcryptoDifferentialTest::seed;
+
+void DcryptoDifferentialTest::SetUpTestCase() {
+  harness = TestHarness::MakeUnique();
+
+#ifndef CONFIG_NO_UART
+  if (!harness->UsingSpi()) {
+    EXPECT_TRUE(harness->SwitchFromConsoleToProtoApi());
+    EXPECT_TRUE(harness->ttyState());
+  }
+#endif  // CONFIG_NO_UART
+
+  seed = FLAGS_dcrypto_diff_seed;
+  if (seed == 0) {
+    std::random_device random_number_generator;
+    seed = (static_cast<uint64_t>(random_number_generator()) << 32) |
+           random_number_generator();
+  }
+  std::cout << "Differential crypto seed: " << seed << "\n";
+  std::cout.flush();
+}
+
+void DcryptoDifferentialTest::TearDownTestCase() {
+#ifndef CONFIG_NO_UART
+  if (!harness->UsingSpi()) {
+    harness->ReadUntilPromptOrIdle(test_harness::BYTE_TIME * 1024);
+    EXPECT_TRUE(harness->SwitchFromProtoApiToConsole(NULL));
+  }
+#endif  // CONFIG_NO_UART
+  harness = unique_ptr<TestHarness>();
+}
+
+string DcryptoDifferentialTest::Repro(size_t index) const {
+  const testing::TestInfo *info =
+      testing::UnitTest::GetInstance()->current_test_info();
+  std::stringstream ss;
+  ss << "reproduce with --gtest_filter=" << info->test_case_name() << "."
+     << info->name() << " --dcrypto_diff_seed=" << seed
+     << " --dcrypto_diff_case=" << index << "\n";
+  return ss.str();
+}
+
+template <typename Case>
+void DcryptoDifferentialTest::Run(
+    Mode mode, std::function<Case(std::mt19937*)> generate,
+    std::function<Expected(const Case&)> oracle,
+    std::function<void(const Case&, const Expected&)> check) {
+  size_t begin = 0;
+  size_t end = FLAGS_dcrypto_diff_iterations;
+  if (FLAGS_dcrypto_diff_case >= 0) {
+    begin = FLAGS_dcrypto_diff_case;
+    end = begin + 1;
+  }
+
+  const int verbosity = harness->getVerbosity();
+  harness->setVerbosity(verbosity - 1);
+
+  for (size_t batch = begin; batch < end; batch += BATCH_SIZE) {
+    const size_t batch_end = std::min(end, batch + BATCH_SIZE);
+
+    // Every case gets its own generator so it can be replayed on its own.
+    vector<Case> cases;
+    vector<std::future<Expected>> expected;
+    for (size_t index = batch; index < batch_end; ++index) {
+      std::seed_seq seq{static_cast<uint32_t>(seed),
+                        static_cast<uint32_t>(seed >> 32),
+                        static_cast<uint32_t>(mode),
+                        static_cast<uint32_t>(index)};
+      std::mt19937 rng(seq);
+      cases.push_back(generate(&rng));
+    }
+    for (const auto& c : cases) {
+      expected.push_back(std::async(std::launch::async, oracle, c));
+    }
+
+    for (size_t i = 0; i < cases.size(); ++i) {
+      SCOPED_TRACE(Repro(batch + i));
+      check(cases[i], expected[i].get());
+      if (HasFatalFailure()) {
+        // Don't leave oracle threads running past the test.
+        for (size_t j = i + 1; j < expected.size(); ++j) {
+          expected[j].wait();
+        }
+        harness->setVerbosity(verbosity);
+        return;
+      }
+    }
+  }
+
+  harness->setVerbosity(verbosity);
+}
+
+template <typename Request>
+void DcryptoDifferentialTest::Transact(
+    const Request& request,
+    typename test_harness::TestCall<Request>::Result* result) {
+  ASSERT_CALL(harness, request, result);
+  ASSERT_EQ(result->result_code(), DcryptError::DE_NO_ERROR)
+      << result->result_code() << " is "
+      << DcryptError_Name(result->result_code());
+}
+
+TEST_F(DcryptoDifferentialTest, AesCbc) {
+  Run<CbcCase>(MODE_AES_CBC, GenerateCbc, OracleCbc,
+               [this](const CbcCase& c, const Expected& expected) {
+    AesCbcEncryptTest request;
+    request.set_key_size(c.key_size);
+    request.set_key(c.key);
+    request.set_number_of_blocks(c.number_of_blocks);
+
+    AesCbcEncryptTestResult result;
+    Transact(request, &result);
+    if (HasFatalFailure()) {
+      return;
+    }
+
+    ASSERT_EQ(result.cipher_text().size(), expected.output.size());
+    ASSERT_BUFFER_EQ(expected.output.data(), result.cipher_text().data(),
+                     expected.output.size())
+        << "key: " << Hex(c.key) << "\nblocks: " << c.number_of_blocks;
+    ASSERT_EQ(result.initialization_vector().size(), expected.extra.size());
+    ASSERT_BUFFER_EQ(expected.extra.data(),
+                     result.initialization_vector().data(),
+                     expected.extra.size())
+        << "key: " << Hex(c.key) << "\nblocks: " << c.number_of_blocks;
+  });
+}
+
+TEST_F(DcryptoDifferentialTest, AesGcm) {
+  Run<GcmCase>(MODE_AES_GCM, GenerateGcm, OracleGcm,
+               [this](const GcmCase& c, const Expected& expected) {
+    AesGcmEncryptTest request;
+    request.set_key(c.key);
+    request.set_iv(c.iv);
+    request.set_plain_text(c.plain_text);
+    request.set_aad(c.aad);
+    request.set_tag_len(c.tag_len);
+
+    AesGcmEncryptTestResult result;
+    Transact(request, &result);
+    if (HasFatalFailure()) {
+      return;
+    }
+
+    ASSERT_EQ(result.cipher_text().size(), expected.output.size());
+    ASSERT_BUFFER_EQ(expected.output.data(), result.cipher_text().data(),
+                     expected.output.size())
+        << request.DebugString();
+    ASSERT_EQ(result.tag().size(), expected.extra.size());
+    ASSERT_BUFFER_EQ(expected.extra.data(), result.tag().data(),
+                     expected.extra.size())
+        << request.DebugString();
+  });
+}
+
+TEST_F(DcryptoDifferentialTest, AesCmac) {
+  Run<CmacCase>(MODE_AES_CMAC, GenerateCmac, OracleCmac,
+                [this](const CmacCase& c, const Expected& expected) {
+    AesCmacTest request;
+    request.set_key(c.key);
+    if (!c.message.empty()) {
+      request.set_plain_text(c.message);
+    }
+
+    AesCmacTestResult result;
+    Transact(request, &result);
+    if (HasFatalFailure()) {
+      return;
+    }
+
+    ASSERT_EQ(result.cmac().size(), expected.output.size());
+    ASSERT_BUFFER_EQ(expected.output.data(), result.cmac().data(),
+                     expected.output.size())
+        << "key: " << Hex(c.key) << "\nmessage: " << Hex(c.message);
+  });
+}
+
+}  // namespace
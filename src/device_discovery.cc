@@ -0,0 +1,167 @@
+#include "src/device_discovery.h"
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace test_harness {
+namespace {
+
+constexpr char kDevPath[] = "/dev/";
+constexpr char kPrefix[] = "ttyUltraTarget_";
+constexpr size_t kPrefixLength = sizeof(kPrefix) - 1;
+
+}  // namespace
+
+DeviceDiscovery& DeviceDiscovery::Get() {
+  static DeviceDiscovery discovery;
+  return discovery;
+}
+
+DeviceDiscovery::DeviceDiscovery() : inotify_fd(-1) {
+  stop_pipe[0] = stop_pipe[1] = -1;
+
+  // Start watching before the scan so nothing created in between is missed.
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd >= 0 &&
+      inotify_add_watch(inotify_fd, kDevPath,
+                        IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                        IN_MOVED_TO) < 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  if (inotify_fd < 0) {
+    perror("WARNING inotify");
+  }
+
+  Scan();
+
+  if (inotify_fd >= 0 && pipe(stop_pipe) == 0) {
+    watcher = std::thread(&DeviceDiscovery::Run, this);
+  }
+}
+
+DeviceDiscovery::~DeviceDiscovery() {
+  if (watcher.joinable()) {
+    const char stop = 0;
+    if (write(stop_pipe[1], &stop, 1) != 1) {
+      perror("ERROR write()");
+    }
+    watcher.join();
+  }
+  for (int fd : {stop_pipe[0], stop_pipe[1], inotify_fd}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+std::string DeviceDiscovery::UartPath(const std::string& serial) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (inotify_fd < 0) {
+    // Without the watch the cache can't be trusted.
+    lock.unlock();
+    Scan();
+    lock.lock();
+  }
+  return Find(serial);
+}
+
+std::string DeviceDiscovery::WaitForUart(const std::string& serial,
+                                         std::chrono::milliseconds timeout) {
+  if (!watcher.joinable()) {
+    return UartPath(serial);
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  std::string path;
+  changed.wait_for(lock, timeout, [&] {
+    path = Find(serial);
+    return !path.empty();
+  });
+  return path;
+}
+
+void DeviceDiscovery::Scan() {
+  auto dir = opendir(kDevPath);
+  if (!dir) {
+    return;
+  }
+  std::map<std::string, std::string> found;
+  while (auto listing = readdir(dir)) {
+    if (strncmp(listing->d_name, kPrefix, kPrefixLength) == 0) {
+      found[listing->d_name + kPrefixLength] =
+          std::string(kDevPath) + listing->d_name;
+    }
+  }
+  closedir(dir);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  uarts.swap(found);
+}
+
+void DeviceDiscovery::Run() {
+  // Large enough for several events with names.
+  alignas(struct inotify_event) char buffer[4096];
+  struct pollfd fds[2] = {
+    {inotify_fd, POLLIN, 0},
+    {stop_pipe[0], POLLIN, 0},
+  };
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("ERROR poll()");
+      return;
+    }
+    if (fds[1].revents) {
+      return;
+    }
+
+    ssize_t len;
+    while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+      for (char* p = buffer; p < buffer + len;) {
+        const struct inotify_event* event =
+            reinterpret_cast<const struct inotify_event*>(p);
+        if (event->len) {
+          Update(event->name, event->mask & (IN_CREATE | IN_MOVED_TO));
+        }
+        if (event->mask & IN_Q_OVERFLOW) {
+          Scan();
+          changed.notify_all();
+        }
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    }
+  }
+}
+
+void DeviceDiscovery::Update(const char* name, bool present) {
+  if (strncmp(name, kPrefix, kPrefixLength) != 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (present) {
+      uarts[name + kPrefixLength] = std::string(kDevPath) + name;
+    } else {
+      uarts.erase(name + kPrefixLength);
+    }
+  }
+  changed.notify_all();
+}
+
+std::string DeviceDiscovery::Find(const std::string& serial) const {
+  if (serial.empty()) {
+    return uarts.empty() ? "" : uarts.begin()->second;
+  }
+  auto it = uarts.find(serial);
+  return it == uarts.end() ? "" : it->second;
+}
+
+}  // namespace test_harness
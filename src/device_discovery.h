@@ -0,0 +1,56 @@
+#ifndef SRC_DEVICE_DISCOVERY_H
+#define SRC_DEVICE_DISCOVERY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace test_harness {
+
+/**
+ * Cache of the UltraDebug UARTs which are plugged in.
+ *
+ * /dev is scanned once for ttyUltraTarget_<serial> entries and then watched
+ * with inotify, so constructing a TestHarness doesn't rescan the directory
+ * and a board which is re-enumerated after a reboot is picked up as soon as
+ * udev recreates its link. */
+class DeviceDiscovery {
+ public:
+  static DeviceDiscovery& Get();
+
+  ~DeviceDiscovery();
+
+  /** The UART of the board with @serial, or of any board if @serial is
+   * empty. Empty if there is no such board. */
+  std::string UartPath(const std::string& serial);
+
+  /** Like UartPath() but waits up to @timeout for the board to appear. */
+  std::string WaitForUart(const std::string& serial,
+                          std::chrono::milliseconds timeout);
+
+ private:
+  DeviceDiscovery();
+
+  void Scan();
+  void Run();
+  /** Applies a create (@present) or delete of the /dev entry @name. */
+  void Update(const char* name, bool present);
+  /** mutex must be held. */
+  std::string Find(const std::string& serial) const;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  // Serial number to device path.
+  std::map<std::string, std::string> uarts;
+
+  int inotify_fd;
+  int stop_pipe[2];
+  std::thread watcher;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_DEVICE_DISCOVERY_H
@@ -2,19 +2,41 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <set>
 #include <sstream>
 
+#include "src/result_cache.h"
+#include "src/test_deadline.h"
+#include "src/time_attribution.h"
+#include "src/trace_listener.h"
+#include "src/trace_log.h"
+#include "src/uart_capture.h"
+#include "latency_samples.h"
+#include "nugget_tools.h"
+#include "trace_events.h"
+#include "watchdog.h"
+
 #ifdef ANDROID
 #define FLAGS_list_slow_tests false
 #define FLAGS_disable_slow_tests false
 // TODO: how does FLAGS_release_tests feature here?
 #define FLAGS_release_tests true
+#define FLAGS_time_attribution false
+#define FLAGS_test_deadline_s 0
+#define FLAGS_incremental false
+#define FLAGS_incremental_cache std::string()
 #else
 #include <gflags/gflags.h>
 DEFINE_bool(list_slow_tests, false, "List tests included in the set of slow tests.");
 DEFINE_bool(disable_slow_tests, false, "Enables a filter to disable a set of slow tests.");
 DEFINE_bool(release_tests, false, "Disables tests that would fail for firmware images built with TEST_IMAGE=0");
+DEFINE_bool(time_attribution, false, "Print where each test spent its time: host CPU, transport, sleeps and chip cycles.");
+DEFINE_int32(test_deadline_s, 0, "Exit if a single test runs longer than this; 0 disables the limit.");
+DEFINE_bool(incremental, false, "Skip tests which passed last time with the same firmware version, device class and test binary.");
+DEFINE_string(incremental_cache, ".nos_test_results", "Where --incremental keeps the results of earlier runs.");
 #endif  // ANDROID
 
 static void generate_disabled_test_list(
@@ -30,10 +52,64 @@ static void generate_disabled_test_list(
     }
 }
 
+// Filters out the tests which already passed against this firmware and test
+// binary, and records the results of the rest for the next run.
+//
+// Returns the cache, or nullptr if the run can't be identified.
+static test_harness::ResultCache *SetUpIncremental() {
+  std::unique_ptr<nos::NuggetClientInterface> client =
+      nugget_tools::MakeNuggetClient();
+  client->Open();
+  const std::string device_key = client->IsOpen() ?
+      test_harness::ResultCache::DeviceKey(client.get()) : std::string();
+  client->Close();
+  const std::string binary_hash = test_harness::ResultCache::BinaryHash();
+  if (device_key.empty() || binary_hash.empty()) {
+    std::cerr << "--incremental: unable to identify the firmware or the test "
+              << "binary, running every test\n";
+    return nullptr;
+  }
+
+  // Lives as long as the listener, which gtest never deletes before exit.
+  test_harness::ResultCache *cache = new test_harness::ResultCache(
+      FLAGS_incremental_cache,
+      test_harness::ResultCache::MakeKey(device_key, binary_hash));
+  if (!cache->Load()) {
+    std::cerr << "--incremental: " << FLAGS_incremental_cache
+              << " is corrupt, some results are lost\n";
+  }
+
+  std::set<std::string> cached;
+  const testing::UnitTest& unit_test = *testing::UnitTest::GetInstance();
+  for (int i = 0; i < unit_test.total_test_case_count(); ++i) {
+    const testing::TestCase *test_case = unit_test.GetTestCase(i);
+    for (int j = 0; j < test_case->total_test_count(); ++j) {
+      const std::string name = std::string(test_case->name()) + "." +
+          test_case->GetTestInfo(j)->name();
+      if (cache->Passed(name)) {
+        cached.insert(name);
+      }
+    }
+  }
+  for (const auto& name : cached) {
+    std::cout << "[  CACHED  ] " << name << "\n";
+  }
+  std::cout << "[  CACHED  ] " << cached.size() << " tests passed before with "
+            << "key " << cache->key() << "\n";
+
+  ::testing::GTEST_FLAG(filter) = test_harness::ExcludeFromFilter(
+      ::testing::GTEST_FLAG(filter), cached);
+  testing::UnitTest::GetInstance()->listeners().Append(
+      new test_harness::ResultCacheListener(cache));
+  return cache;
+}
+
 int main(int argc, char** argv) {
   const std::vector<std::string> slow_tests{
       "AvbTest.*",
+      "DcryptoDifferentialTest.*",
       "ImportKeyTest.RSASuccess",
+      "ImportWrappedKeyTest.Throughput",
       "NuggetCoreTest.EnterDeepSleep",
       "NuggetCoreTest.HardRebootTest",
       "WeaverTest.ReadAttemptCounterPersistsDeepSleep",
@@ -46,6 +122,7 @@ int main(int argc, char** argv) {
   };
 
   const std::vector<std::string> disabled_for_release_tests{
+      "DcryptoDifferentialTest.*",
       "DcryptoTest.AesCmacRfc4493Test",
       "KeymasterProvisionTest.ProvisionDeviceIdsSuccess",
       "KeymasterProvisionTest.ReProvisionDeviceIdsSuccess",
@@ -62,10 +139,13 @@ int main(int argc, char** argv) {
       "NuggetOsTest.Echo",
       "NuggetOsTest.AesCbc",
       "NuggetOsTest.Trng",
+      "NuggetOsTest.ConcurrentCallers",
       "WeaverTest.ProductionResetWipesUserData",
       "AvbTest.*",
       "ImportKeyTest.*",
       "ImportWrappedKeyTest.ImportSuccess",
+      "ImportWrappedKeyTest.ImportFreshKeysSuccess",
+      "ImportWrappedKeyTest.Throughput",
   };
 
   testing::InitGoogleMock(&argc, argv);
@@ -93,6 +173,42 @@ int main(int argc, char** argv) {
   if (FLAGS_disable_slow_tests || FLAGS_release_tests) {
     ::testing::GTEST_FLAG(filter) = ss.str();
   }
+  test_harness::ResultCache *cache = nullptr;
+  if (FLAGS_incremental) {
+    cache = SetUpIncremental();
+  }
+
+  if (FLAGS_time_attribution) {
+    testing::UnitTest::GetInstance()->listeners().Append(
+        new test_harness::TimeAttributionListener());
+  }
+  if (nugget_tools::TraceEnabled()) {
+    testing::UnitTest::GetInstance()->listeners().Append(
+        new test_harness::TraceListener());
+  }
+
+  // A wedged device ends the run without the listeners' OnTestProgramEnd(),
+  // so fail the running test and write out what they would have.
+  nugget_tools::SetWatchdogExpiryHook([cache](const std::string& report) {
+    ADD_FAILURE() << "Watchdog: " << report;
+    testing::UnitTest& unit_test = *testing::UnitTest::GetInstance();
+    testing::TestEventListener *report_writer =
+        unit_test.listeners().default_xml_generator();
+    if (report_writer) {
+      report_writer->OnTestProgramEnd(unit_test);
+    }
+    if (cache && !cache->Save()) {
+      perror("Saving the result cache");
+    }
+    test_harness::TraceLog::Get().Flush();
+    nugget_tools::FinishTrace();
+    nugget_tools::FlushLatencies();
+  });
+  testing::UnitTest::GetInstance()->listeners().Append(
+      new test_harness::TestDeadlineListener(
+          std::chrono::seconds(FLAGS_test_deadline_s)));
+  testing::UnitTest::GetInstance()->listeners().Append(
+      new test_harness::UartCaptureListener());
 
   return RUN_ALL_TESTS();
 }
@@ -1,6 +1,6 @@
 #include "gtest/gtest.h"
 #include "avb_tools.h"
-#include "keymaster_tools.h"
+#include "device_state.h"
 #include "nugget_tools.h"
 #include "nugget/app/keymaster/keymaster.pb.h"
 #include "nugget/app/keymaster/keymaster_defs.pb.h"
@@ -9,6 +9,7 @@
 #include "util.h"
 
 #include "src/blob.h"
+#include "src/km_blob_view.h"
 #include "src/macros.h"
 #include "src/test-data/test-keys/rsa.h"
 
@@ -17,11 +18,17 @@
 #include "openssl/nid.h"
 
 #include <sstream>
+#include <vector>
 
 using std::cout;
 using std::string;
 using std::stringstream;
 using std::unique_ptr;
+using std::vector;
+
+using test_harness::KmBlobError;
+using test_harness::KmBlobErrorName;
+using test_harness::KmBlobView;
 
 using namespace nugget::app::keymaster;
 
@@ -92,8 +99,11 @@ void ImportKeyTest::SetUpTestCase() {
 
   service.reset(new Keymaster(*client));
 
-  // Do setup that is normally done by the bootloader.
-  keymaster_tools::SetRootOfTrust(client.get());
+  // Do setup that is normally done by the bootloader, unless it has already
+  // been done since Citadel last reset.
+  device_state::Requirements required;
+  required.root_of_trust = true;
+  device_state::Ensure(client.get(), required);
 }
 
 void ImportKeyTest::TearDownTestCase() {
@@ -232,6 +242,7 @@ TEST_F(ImportKeyTest, RSASuccess) {
   initRSARequest(&request, Algorithm::RSA);
   KeyParameters *params = request.mutable_params();
   KeyParameter *param = params->add_params();
+  vector<string> blobs;
   for (size_t i = 0; i < ARRAYSIZE(TEST_RSA_KEYS); i++) {
     param->set_tag(Tag::RSA_PUBLIC_EXPONENT);
     param->set_long_integer(TEST_RSA_KEYS[i].e);
@@ -246,14 +257,20 @@ TEST_F(ImportKeyTest, RSASuccess) {
     EXPECT_EQ((ErrorCode)response.error_code(), ErrorCode::OK)
         << "Failed at TEST_RSA_KEYS[" << i << "]";
 
-    /* TODO: add separate tests for blobs! */
-    EXPECT_EQ(sizeof(struct km_blob), response.blob().blob().size());
-    const struct km_blob *blob =
-        (const struct km_blob *)response.blob().blob().data();
-    EXPECT_EQ(memcmp(blob->b.key.rsa.N_bytes, TEST_RSA_KEYS[i].n,
+    const KmBlobView blob(response.blob().blob());
+    ASSERT_NE(blob.rsa(), nullptr) << "Failed at TEST_RSA_KEYS[" << i << "]";
+    EXPECT_EQ(memcmp(blob.rsa()->N_bytes, TEST_RSA_KEYS[i].n,
                      TEST_RSA_KEYS[i].size), 0);
-    EXPECT_EQ(memcmp(blob->b.key.rsa.d_bytes,
+    EXPECT_EQ(memcmp(blob.rsa()->d_bytes,
                      TEST_RSA_KEYS[i].d, TEST_RSA_KEYS[i].size), 0);
+    blobs.push_back(response.blob().blob());
+  }
+
+  const vector<KmBlobError> errors = test_harness::ValidateKmBlobs(
+      blobs, test_harness::KM_BLOB_CHECK_DEVICE);
+  for (size_t i = 0; i < errors.size(); i++) {
+    EXPECT_EQ(errors[i], test_harness::KM_BLOB_OK)
+        << "TEST_RSA_KEYS[" << i << "]: " << KmBlobErrorName(errors[i]);
   }
 }
 
@@ -268,12 +285,13 @@ TEST_F(ImportKeyTest, RSA1024OptionalParamsAbsentSuccess) {
   ASSERT_NO_ERROR(service->ImportKey(request, &response), "");
   EXPECT_EQ((ErrorCode)response.error_code(), ErrorCode::OK);
 
-  EXPECT_EQ(sizeof(struct km_blob), response.blob().blob().size());
-  const struct km_blob *blob =
-      (const struct km_blob *)response.blob().blob().data();
-  EXPECT_EQ(memcmp(blob->b.key.rsa.N_bytes, RSA_1024_N,
+  const KmBlobView blob(response.blob().blob());
+  const KmBlobError error = blob.Validate(test_harness::KM_BLOB_CHECK_DEVICE);
+  EXPECT_EQ(error, test_harness::KM_BLOB_OK) << KmBlobErrorName(error);
+  ASSERT_NE(blob.rsa(), nullptr);
+  EXPECT_EQ(memcmp(blob.rsa()->N_bytes, RSA_1024_N,
                    sizeof(RSA_1024_N)), 0);
-  EXPECT_EQ(memcmp(blob->b.key.rsa.d_bytes,
+  EXPECT_EQ(memcmp(blob.rsa()->d_bytes,
                    RSA_1024_D, sizeof(RSA_1024_D)), 0);
 }
 
@@ -1,6 +1,7 @@
 #include "gtest/gtest.h"
 #include "avb_tools.h"
-#include "keymaster_tools.h"
+#include "device_state.h"
+#include "latency_samples.h"
 #include "nugget_tools.h"
 #include "nugget/app/keymaster/keymaster.pb.h"
 #include "nugget/app/keymaster/keymaster_defs.pb.h"
@@ -9,17 +10,38 @@
 #include "util.h"
 
 #include "src/blob.h"
+#include "src/km_blob_view.h"
 #include "src/macros.h"
 #include "src/test-data/test-keys/rsa.h"
+#include "src/wrapped_key_builder.h"
 
 #include "openssl/bn.h"
 #include "openssl/ec_key.h"
 #include "openssl/nid.h"
-#include "openssl/sha.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#ifdef ANDROID
+#define FLAGS_wrapped_key_bench_iterations 16
+#else
+#include <gflags/gflags.h>
+
+DEFINE_int32(wrapped_key_bench_iterations, 16,
+             "Number of imports of each key type to time in the "
+             "ImportWrappedKeyTest.Throughput benchmark.");
+#endif  // ANDROID
 
 using std::cout;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+
+using test_harness::KmBlobView;
+using test_harness::WrappedKeyBuilder;
+using test_harness::WrappedKeySpec;
 
 using namespace nugget::app::keymaster;
 
@@ -50,8 +72,11 @@ void ImportWrappedKeyTest::SetUpTestCase() {
 
   service.reset(new Keymaster(*client));
 
-  // Do setup that is normally done by the bootloader.
-  keymaster_tools::SetRootOfTrust(client.get());
+  // Do setup that is normally done by the bootloader, unless it has already
+  // been done since Citadel last reset.
+  device_state::Requirements required;
+  required.root_of_trust = true;
+  device_state::Ensure(client.get(), required);
 }
 
 void ImportWrappedKeyTest::TearDownTestCase() {
@@ -199,31 +224,17 @@ const uint8_t IMPORTED_KEY[32] = {
   0x7f, 0x97, 0x04, 0xe6, 0x79, 0x29, 0xff, 0xcf
 };
 
+/* TODO: do key generation via rpc. */
+const WrappedKeyBuilder& Builder() {
+  static const WrappedKeyBuilder builder(wrapping_key_N, wrapping_key_D,
+                                         sizeof(wrapping_key_N));
+  return builder;
+}
+
 TEST_F(ImportWrappedKeyTest, ImportSuccess) {
   ImportWrappedKeyRequest request;
   ImportKeyResponse response;
   const uint8_t masking_key[32] = {};
-  struct km_blob blob;
-
-  /* TODO: do key generation via rpc. */
-  memset(&blob, 0, sizeof(blob));
-  blob.b.algorithm = BLOB_RSA;
-  blob.b.key.rsa.rsa.e = 65537;
-  blob.b.key.rsa.rsa.N.dmax = sizeof(wrapping_key_N) / sizeof(uint32_t);
-  blob.b.key.rsa.rsa.d.dmax = sizeof(wrapping_key_D) / sizeof(uint32_t);
-
-  memcpy(&blob.b.key.rsa.N_bytes, wrapping_key_N, sizeof(wrapping_key_N));
-  memcpy(&blob.b.key.rsa.d_bytes, wrapping_key_D, sizeof(wrapping_key_D));
-
-  blob.b.tee_enforced.params[0].tag = Tag::PADDING;
-  blob.b.tee_enforced.params[0].integer = PaddingMode::PADDING_RSA_OAEP;
-  blob.b.tee_enforced.params_count++;
-  blob.b.tee_enforced.params[1].tag = Tag::PURPOSE;
-  blob.b.tee_enforced.params[1].integer = KeyPurpose::WRAP_KEY;
-  blob.b.tee_enforced.params_count++;
-  SHA256(reinterpret_cast<const uint8_t *>(&blob),
-         sizeof(struct km_blob) - SHA256_DIGEST_LENGTH,
-         reinterpret_cast<uint8_t *>(&blob.hmac));
 
   request.set_key_format(KeyFormat::RAW);
   KeyParameters *params = request.mutable_params();
@@ -238,18 +249,99 @@ TEST_F(ImportWrappedKeyTest, ImportSuccess) {
                                     sizeof(ENCRYPTED_IMPORT_KEY));
   request.set_aad(AAD, sizeof(AAD));
   request.set_gcm_tag(GCM_TAG, sizeof(GCM_TAG));
-  request.mutable_wrapping_key_blob()->set_blob(&blob, sizeof(blob));
+  request.mutable_wrapping_key_blob()->set_blob(Builder().WrappingKeyBlob());
   request.set_masking_key(masking_key, sizeof(masking_key));
 
   ASSERT_NO_ERROR(service->ImportWrappedKey(request, &response), "");
   EXPECT_EQ((ErrorCode)response.error_code(), ErrorCode::OK);
 
-  EXPECT_EQ(sizeof(struct km_blob), response.blob().blob().size());
-  const struct km_blob *response_blob =
-      (const struct km_blob *)response.blob().blob().data();
-  EXPECT_EQ(response_blob->b.key.sym.key_bits >> 3, sizeof(IMPORTED_KEY));
-  EXPECT_EQ(memcmp(response_blob->b.key.sym.bytes, IMPORTED_KEY,
+  const test_harness::KmBlobView response_blob(response.blob().blob());
+  const test_harness::KmBlobError error =
+      response_blob.Validate(test_harness::KM_BLOB_CHECK_DEVICE);
+  EXPECT_EQ(error, test_harness::KM_BLOB_OK)
+      << test_harness::KmBlobErrorName(error);
+  ASSERT_NE(response_blob.sym(), nullptr);
+  EXPECT_EQ(response_blob.sym()->key_bits >> 3, sizeof(IMPORTED_KEY));
+  EXPECT_EQ(memcmp(response_blob.sym()->bytes, IMPORTED_KEY,
                    sizeof(IMPORTED_KEY)), 0);
 }
 
+TEST_F(ImportWrappedKeyTest, ImportFreshKeysSuccess) {
+  const vector<WrappedKeySpec> specs = {
+    test_harness::RandomAesKeySpec(128),
+    test_harness::RandomAesKeySpec(256),
+    test_harness::RandomHmacKeySpec(256),
+  };
+  vector<ImportWrappedKeyRequest> requests;
+  ASSERT_TRUE(Builder().BuildAll(specs, &requests));
+
+  for (size_t i = 0; i < specs.size(); i++) {
+    ImportKeyResponse response;
+    ASSERT_NO_ERROR(service->ImportWrappedKey(requests[i], &response), "");
+    EXPECT_EQ((ErrorCode)response.error_code(), ErrorCode::OK)
+        << "Failed at specs[" << i << "]";
+
+    const KmBlobView blob(response.blob().blob());
+    ASSERT_NE(blob.sym(), nullptr) << "Failed at specs[" << i << "]";
+    EXPECT_EQ(blob.sym()->key_bits, specs[i].key_size);
+    EXPECT_EQ(memcmp(blob.sym()->bytes, specs[i].key_material.data(),
+                     specs[i].key_material.size()), 0)
+        << "Failed at specs[" << i << "]";
+  }
+}
+
+/* Times ImportWrappedKey for each kind of key, the path taken when a key is
+ * provisioned from a server. The envelopes are all built up front so only
+ * the device is timed. */
+TEST_F(ImportWrappedKeyTest, Throughput) {
+  struct Kind {
+    const char *name;
+    WrappedKeySpec (*make)(uint32_t key_size);
+    uint32_t key_size;
+  };
+  const Kind kinds[] = {
+    {"AES-128", test_harness::RandomAesKeySpec, 128},
+    {"AES-256", test_harness::RandomAesKeySpec, 256},
+    {"HMAC-256", test_harness::RandomHmacKeySpec, 256},
+    {"HMAC-512", test_harness::RandomHmacKeySpec, 512},
+    {"EC-P224", test_harness::RandomEcKeySpec, 224},
+    {"EC-P256", test_harness::RandomEcKeySpec, 256},
+  };
+  const size_t iterations = std::max(FLAGS_wrapped_key_bench_iterations, 1);
+
+  vector<WrappedKeySpec> specs;
+  for (const Kind& kind : kinds) {
+    for (size_t i = 0; i < iterations; i++) {
+      specs.push_back(kind.make(kind.key_size));
+    }
+  }
+  vector<ImportWrappedKeyRequest> requests;
+  ASSERT_TRUE(Builder().BuildAll(specs, &requests));
+
+  printf("%-10s %6s %10s %10s %10s %10s\n", "key", "n", "min ms",
+         "median ms", "p95 ms", "imports/s");
+  ImportKeyResponse response;
+  for (size_t k = 0; k < ARRAYSIZE(kinds); k++) {
+    vector<double> latencies;
+    latencies.reserve(iterations);
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = k * iterations; i < (k + 1) * iterations; i++) {
+      const auto call_start = std::chrono::steady_clock::now();
+      ASSERT_NO_ERROR(service->ImportWrappedKey(requests[i], &response), "");
+      latencies.push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - call_start).count());
+      EXPECT_EQ((ErrorCode)response.error_code(), ErrorCode::OK)
+          << kinds[k].name;
+    }
+    const double total = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    const nugget_tools::LatencySummary summary =
+        nugget_tools::SummarizeLatencies(&latencies);
+    printf("%-10s %6zu %10.2f %10.2f %10.2f %10.1f\n", kinds[k].name,
+           summary.count, summary.min, summary.median, summary.p95,
+           summary.count / total);
+  }
+}
+
 } // namespace
@@ -2,6 +2,7 @@
 
 #include "gtest/gtest.h"
 #include "avb_tools.h"
+#include "device_state.h"
 #include "nugget_tools.h"
 #include "nugget/app/avb/avb.pb.h"
 #include "nugget/app/keymaster/keymaster.pb.h"
@@ -57,7 +58,9 @@ void KeymasterProvisionTest::TearDownTestCase() {
 }
 
 void KeymasterProvisionTest::SetUp(void) {
-  avb_tools::ResetProduction(client.get());
+  device_state::Requirements required;
+  required.production_cleared = true;
+  device_state::Ensure(client.get(), required);
 }
 
 void KeymasterProvisionTest::PopulateDefaultRequest(
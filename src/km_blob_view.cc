@@ -0,0 +1,216 @@
+#include "src/km_blob_view.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "openssl/sha.h"
+
+namespace test_harness {
+namespace {
+
+constexpr size_t kMaxParams =
+    sizeof(((struct blob_enforcements *)nullptr)->params) /
+    sizeof(struct blob_params);
+
+static_assert(sizeof(((struct km_blob *)nullptr)->hmac) == SHA256_DIGEST_LENGTH,
+              "km_blob hash is not SHA-256 sized");
+
+}  // namespace
+
+const char *KmBlobErrorName(KmBlobError error) {
+  switch (error) {
+    case KM_BLOB_OK:
+      return "OK";
+    case KM_BLOB_BAD_SIZE:
+      return "BAD_SIZE";
+    case KM_BLOB_BAD_MAGIC:
+      return "BAD_MAGIC";
+    case KM_BLOB_BAD_VERSION:
+      return "BAD_VERSION";
+    case KM_BLOB_BAD_PARAMS:
+      return "BAD_PARAMS";
+    case KM_BLOB_BAD_ALGORITHM:
+      return "BAD_ALGORITHM";
+    case KM_BLOB_BAD_KEY:
+      return "BAD_KEY";
+    case KM_BLOB_BAD_HASH:
+      return "BAD_HASH";
+  }
+  return "UNKNOWN";
+}
+
+KmBlobView::KmBlobView(const void *data, size_t size)
+    : contents(data && size == sizeof(struct km_blob)
+               ? reinterpret_cast<const struct km_blob *>(data) : nullptr) {}
+
+KmBlobView::KmBlobView(const std::string& bytes)
+    : KmBlobView(bytes.data(), bytes.size()) {}
+
+KmBlobError KmBlobView::Validate(unsigned checks) const {
+  if (!contents) {
+    return KM_BLOB_BAD_SIZE;
+  }
+  if (checks & KM_BLOB_CHECK_HEADER) {
+    if (contents->h.magic != KM_BLOB_MAGIC) {
+      return KM_BLOB_BAD_MAGIC;
+    }
+    if (contents->h.version != KM_BLOB_VERSION) {
+      return KM_BLOB_BAD_VERSION;
+    }
+  }
+  if (checks & KM_BLOB_CHECK_PARAMS) {
+    if (contents->b.sw_enforced.params_count > kMaxParams ||
+        contents->b.tee_enforced.params_count > kMaxParams) {
+      return KM_BLOB_BAD_PARAMS;
+    }
+  }
+  if (checks & KM_BLOB_CHECK_KEY) {
+    switch (contents->b.algorithm) {
+      case BLOB_RSA: {
+        const struct blob_rsa& rsa = contents->b.key.rsa;
+        if (rsa.rsa.N.dmax == 0 ||
+            rsa.rsa.N.dmax > sizeof(rsa.N_bytes) / sizeof(uint32_t) ||
+            rsa.rsa.d.dmax > sizeof(rsa.d_bytes) / sizeof(uint32_t)) {
+          return KM_BLOB_BAD_KEY;
+        }
+        break;
+      }
+      case BLOB_EC:
+        break;
+      case BLOB_AES:
+      case BLOB_DES:
+      case BLOB_HMAC: {
+        const struct blob_sym& sym = contents->b.key.sym;
+        if (sym.key_bits == 0 || sym.key_bits % 8 ||
+            sym.key_bits / 8 > sizeof(sym.bytes)) {
+          return KM_BLOB_BAD_KEY;
+        }
+        break;
+      }
+      default:
+        return KM_BLOB_BAD_ALGORITHM;
+    }
+  }
+  if ((checks & KM_BLOB_CHECK_HASH) && !HashMatches()) {
+    return KM_BLOB_BAD_HASH;
+  }
+  return KM_BLOB_OK;
+}
+
+uint32_t KmBlobView::magic() const {
+  return contents ? contents->h.magic : 0;
+}
+
+uint32_t KmBlobView::version() const {
+  return contents ? contents->h.version : 0;
+}
+
+uint32_t KmBlobView::id() const {
+  return contents ? contents->h.id : 0;
+}
+
+uint32_t KmBlobView::algorithm() const {
+  return contents ? contents->b.algorithm : 0;
+}
+
+const struct blob_enforcements *KmBlobView::Enforcements(
+    Enforcement which) const {
+  if (!contents) {
+    return nullptr;
+  }
+  return which == SW_ENFORCED ? &contents->b.sw_enforced
+                               : &contents->b.tee_enforced;
+}
+
+size_t KmBlobView::ParamCount(Enforcement which) const {
+  const struct blob_enforcements *enforcements = Enforcements(which);
+  if (!enforcements) {
+    return 0;
+  }
+  return std::min<size_t>(enforcements->params_count, kMaxParams);
+}
+
+const struct blob_params *KmBlobView::Param(Enforcement which,
+                                            size_t index) const {
+  if (index >= ParamCount(which)) {
+    return nullptr;
+  }
+  return &Enforcements(which)->params[index];
+}
+
+const struct blob_params *KmBlobView::FindParam(Enforcement which,
+                                                uint32_t tag) const {
+  const size_t count = ParamCount(which);
+  for (size_t i = 0; i < count; i++) {
+    const struct blob_params *param = &Enforcements(which)->params[i];
+    if (param->tag == tag) {
+      return param;
+    }
+  }
+  return nullptr;
+}
+
+const struct blob_rsa *KmBlobView::rsa() const {
+  return algorithm() == BLOB_RSA ? &contents->b.key.rsa : nullptr;
+}
+
+const struct blob_ec *KmBlobView::ec() const {
+  return algorithm() == BLOB_EC ? &contents->b.key.ec : nullptr;
+}
+
+const struct blob_sym *KmBlobView::sym() const {
+  switch (algorithm()) {
+    case BLOB_AES:
+    case BLOB_DES:
+    case BLOB_HMAC:
+      return &contents->b.key.sym;
+    default:
+      return nullptr;
+  }
+}
+
+bool KmBlobView::HashMatches() const {
+  if (!contents) {
+    return false;
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const uint8_t *>(contents),
+         sizeof(struct km_blob) - sizeof(contents->hmac), digest);
+  return memcmp(digest, contents->hmac, sizeof(digest)) == 0;
+}
+
+std::vector<KmBlobError> ValidateKmBlobs(const std::vector<std::string>& blobs,
+                                         unsigned checks, size_t threads) {
+  std::vector<KmBlobError> errors(blobs.size(), KM_BLOB_OK);
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, blobs.size());
+
+  // Each thread takes a contiguous slice so no locking is needed.
+  auto validate = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      errors[i] = KmBlobView(blobs[i]).Validate(checks);
+    }
+  };
+  if (threads <= 1) {
+    validate(0, blobs.size());
+    return errors;
+  }
+
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  const size_t slice = (blobs.size() + threads - 1) / threads;
+  for (size_t begin = slice; begin < blobs.size(); begin += slice) {
+    workers.emplace_back(validate, begin,
+                         std::min(begin + slice, blobs.size()));
+  }
+  validate(0, std::min(slice, blobs.size()));
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return errors;
+}
+
+}  // namespace test_harness
@@ -0,0 +1,94 @@
+#ifndef SRC_KM_BLOB_VIEW_H
+#define SRC_KM_BLOB_VIEW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "src/blob.h"
+
+namespace test_harness {
+
+enum KmBlobError {
+  KM_BLOB_OK = 0,
+  KM_BLOB_BAD_SIZE,
+  KM_BLOB_BAD_MAGIC,
+  KM_BLOB_BAD_VERSION,
+  KM_BLOB_BAD_PARAMS,
+  KM_BLOB_BAD_ALGORITHM,
+  KM_BLOB_BAD_KEY,
+  KM_BLOB_BAD_HASH,
+};
+
+const char *KmBlobErrorName(KmBlobError error);
+
+/* Checks done by KmBlobView::Validate(). */
+enum KmBlobCheck {
+  KM_BLOB_CHECK_HEADER = 1 << 0,  /* Magic and version. */
+  KM_BLOB_CHECK_PARAMS = 1 << 1,  /* Enforcement param counts. */
+  KM_BLOB_CHECK_KEY = 1 << 2,     /* Algorithm and key lengths. */
+  KM_BLOB_CHECK_HASH = 1 << 3,    /* Trailing SHA-256 of the blob. */
+  KM_BLOB_CHECK_ALL = 0xf,
+  /* The layout checks, which are all that is known to hold for blobs made
+   * by the device. Its header and hash have not been confirmed. */
+  KM_BLOB_CHECK_DEVICE = KM_BLOB_CHECK_PARAMS | KM_BLOB_CHECK_KEY,
+};
+
+/**
+ * A bounds checked view of a struct km_blob held in someone else's buffer,
+ * e.g. the bytes of a KeyBlob in a Keymaster response. Nothing is copied so
+ * the buffer must outlive the view. Every accessor returns nullptr, zero or
+ * false rather than reading outside the buffer, so a view can be built from
+ * whatever the device returned before it has been validated. */
+class KmBlobView {
+ public:
+  enum Enforcement { SW_ENFORCED, TEE_ENFORCED };
+
+  KmBlobView(const void *data, size_t size);
+  explicit KmBlobView(const std::string& bytes);
+
+  /* Returns the first failed check out of @checks, a KmBlobCheck mask. */
+  KmBlobError Validate(unsigned checks = KM_BLOB_CHECK_ALL) const;
+
+  /* The whole blob, or nullptr if the buffer is the wrong size. */
+  const struct km_blob *blob() const { return contents; }
+
+  uint32_t magic() const;
+  uint32_t version() const;
+  uint32_t id() const;
+  uint32_t algorithm() const;
+
+  /* Number of valid entries in the enforcement list, at most the capacity
+   * of blob_enforcements.params. */
+  size_t ParamCount(Enforcement which) const;
+  const struct blob_params *Param(Enforcement which, size_t index) const;
+  /* The first param with @tag, or nullptr. */
+  const struct blob_params *FindParam(Enforcement which, uint32_t tag) const;
+
+  /* The key material, or nullptr if the algorithm is not of that kind. */
+  const struct blob_rsa *rsa() const;
+  const struct blob_ec *ec() const;
+  const struct blob_sym *sym() const;
+
+  /* Whether the trailing hash is the SHA-256 of the rest of the blob, which
+   * is how the tests seal blobs they construct themselves. */
+  bool HashMatches() const;
+
+ private:
+  const struct blob_enforcements *Enforcements(Enforcement which) const;
+
+  const struct km_blob *contents;
+};
+
+/**
+ * Validates many blobs, e.g. every blob returned by an import sweep, spread
+ * across @threads threads (0 uses one per core). The result has the error of
+ * each blob in the same order. */
+std::vector<KmBlobError> ValidateKmBlobs(const std::vector<std::string>& blobs,
+                                         unsigned checks = KM_BLOB_CHECK_ALL,
+                                         size_t threads = 0);
+
+}  // namespace test_harness
+
+#endif  // SRC_KM_BLOB_VIEW_H
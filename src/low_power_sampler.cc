@@ -0,0 +1,101 @@
+#include "src/low_power_sampler.h"
+
+#include <app_nugget.h>
+
+#include <cinttypes>
+#include <iostream>
+
+#include "nugget_tools.h"
+#include "src/util.h"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::system_clock;
+
+namespace test_harness {
+
+LowPowerSampler::LowPowerSampler(TestHarness* harness, const std::string& path,
+                                 milliseconds period)
+    : harness(harness), path(path), period(period), stopping(false) {}
+
+LowPowerSampler::~LowPowerSampler() {
+  Stop();
+}
+
+bool LowPowerSampler::Start() {
+  if (worker.joinable()) {
+    return true;
+  }
+
+  out.open(path, std::ios_base::out | std::ios_base::app);
+  if (!out) {
+    std::cerr << "Unable to open " << path << " for low power stats\n";
+    return false;
+  }
+  // Only emit the header once when several harnesses share the file.
+  if (out.tellp() == 0) {
+    out << "host_time_us,cycles,hard_reset_count,wake_count,deep_sleep_count,"
+        << "time_spent_awake,time_spent_in_deep_sleep\n";
+  }
+
+  stopping = false;
+  worker = std::thread(&LowPowerSampler::Run, this);
+  return true;
+}
+
+void LowPowerSampler::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  if (out.is_open()) {
+    out.close();
+  }
+}
+
+void LowPowerSampler::Run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    lock.unlock();
+    Sample();
+    lock.lock();
+    wake.wait_for(lock, period, [this] { return stopping; });
+  }
+}
+
+void LowPowerSampler::Sample() {
+  struct nugget_app_low_power_stats stats;
+  uint32_t cycles = 0;
+
+  // A sample would wake the chip and fail the test waiting for it to sleep.
+  if (nugget_tools::WaitingForSleep()) {
+    return;
+  }
+
+  // A failed read usually means the chip is rebooting; skip the sample rather
+  // than writing a row of garbage.
+  if (!harness->GetLowPowerStats(&stats)) {
+    return;
+  }
+  harness->CyclesSinceBoot(&cycles);
+
+  const auto now = duration_cast<microseconds>(
+      system_clock::now().time_since_epoch()).count();
+
+  char row[192];
+  snprintf(row, sizeof(row),
+           "%" PRId64 ",%" PRIu32 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+           ",%" PRIu64 ",%" PRIu64 "\n",
+           static_cast<int64_t>(now), cycles, stats.hard_reset_count,
+           stats.wake_count, stats.deep_sleep_count, stats.time_spent_awake,
+           stats.time_spent_in_deep_sleep);
+  out << row;
+  out.flush();
+}
+
+}  // namespace test_harness
@@ -0,0 +1,58 @@
+#ifndef SRC_LOW_POWER_SAMPLER_H
+#define SRC_LOW_POWER_SAMPLER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace test_harness {
+
+class TestHarness;
+
+/**
+ * Periodically polls NUGGET_PARAM_GET_LOW_POWER_STATS and
+ * NUGGET_PARAM_CYCLES_SINCE_BOOT through a TestHarness and appends one CSV row
+ * per sample so wake / sleep / reset transitions can be lined up against
+ * host side timings.
+ *
+ * Each row is:
+ *   host_time_us,cycles,hard_reset_count,wake_count,deep_sleep_count,
+ *   time_spent_awake,time_spent_in_deep_sleep
+ *
+ * Every sample wakes the chip, so a period shorter than the deep sleep timeout
+ * will keep Citadel from ever entering deep sleep. Samples are skipped while
+ * a WaitForSleep() is in progress. */
+class LowPowerSampler {
+ public:
+  LowPowerSampler(TestHarness* harness, const std::string& path,
+                  std::chrono::milliseconds period);
+  ~LowPowerSampler();
+
+  /** Opens the output file and starts the sampling thread.
+   *
+   * @return false if the output file could not be opened. */
+  bool Start();
+  /** Stops the sampling thread. Safe to call more than once. */
+  void Stop();
+
+ private:
+  void Run();
+  void Sample();
+
+  TestHarness* harness;
+  std::string path;
+  std::chrono::milliseconds period;
+
+  std::ofstream out;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  std::thread worker;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_LOW_POWER_SAMPLER_H
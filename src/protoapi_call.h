@@ -0,0 +1,62 @@
+#ifndef SRC_PROTOAPI_CALL_H
+#define SRC_PROTOAPI_CALL_H
+
+#include <cstdint>
+
+#include "nugget/app/protoapi/header.pb.h"
+#include "nugget/app/protoapi/testing_api.pb.h"
+#include "src/util.h"
+
+namespace test_harness {
+
+/** Declares that TESTING_API_CALLs with @request are answered with @result.
+ * The oneof cases are named after the messages. */
+#define TEST_HARNESS_TEST_CALL(request, result) \
+template <> \
+struct TestCall< ::nugget::app::protoapi::request> { \
+  typedef ::nugget::app::protoapi::result Result; \
+  static const uint16_t kParameters = \
+      ::nugget::app::protoapi::OneofTestParametersCase::k##request; \
+  static const uint16_t kResults = \
+      ::nugget::app::protoapi::OneofTestResultsCase::k##result; \
+}
+
+TEST_HARNESS_TEST_CALL(AesCbcEncryptTest, AesCbcEncryptTestResult);
+TEST_HARNESS_TEST_CALL(AesCmacTest, AesCmacTestResult);
+TEST_HARNESS_TEST_CALL(AesGcmEncryptTest, AesGcmEncryptTestResult);
+TEST_HARNESS_TEST_CALL(TrngTest, TrngTestResult);
+
+template <typename Request>
+int TestHarness::Call(const Request& request,
+                      typename TestCall<Request>::Result* result,
+                      std::chrono::microseconds timeout) {
+  int code = SendOneofProto(
+      ::nugget::app::protoapi::APImessageID::TESTING_API_CALL,
+      TestCall<Request>::kParameters, request);
+  if (code != NO_ERROR) {
+    return code;
+  }
+
+  uint16_t type = 0;
+  const uint8_t *data = nullptr;
+  size_t len = 0;
+  code = ReceiveReply(&type, &data, &len, timeout);
+  if (code != NO_ERROR) {
+    return code;
+  }
+  // Parsing clears @result but keeps the capacity of its fields.
+  if (type != ::nugget::app::protoapi::APImessageID::TESTING_API_RESPONSE) {
+    code = UNEXPECTED_TYPE;
+  } else if (len < 2 ||
+             ((data[0] << 8) | data[1]) != TestCall<Request>::kResults) {
+    code = UNEXPECTED_SUBTYPE;
+  } else if (!result->ParseFromArray(data + 2, len - 2)) {
+    code = PARSE_ERROR;
+  }
+  ReleaseReply(code, type, data, len);
+  return code;
+}
+
+}  // namespace test_harness
+
+#endif  // SRC_PROTOAPI_CALL_H
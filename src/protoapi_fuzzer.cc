@@ -0,0 +1,626 @@
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <app_nugget.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nugget/app/protoapi/control.pb.h"
+#include "nugget/app/protoapi/header.pb.h"
+#include "nugget/app/protoapi/testing_api.pb.h"
+#include "src/util.h"
+
+#ifdef ANDROID
+#define FLAGS_fuzz_seed 0
+#define FLAGS_fuzz_iterations 0
+#define FLAGS_fuzz_corpus_dir std::string("/data/local/tmp/protoapi_corpus")
+#define FLAGS_fuzz_artifact_dir std::string("/data/local/tmp")
+#define FLAGS_fuzz_reset_check_interval 64
+#define FLAGS_fuzz_stats_interval_s 10
+#define FLAGS_fuzz_minimize_attempts 32
+#else
+#include "gflags/gflags.h"
+
+DEFINE_uint64(fuzz_seed, 0, "Seed for the mutator, 0 picks a random one.");
+DEFINE_uint64(fuzz_iterations, 0, "Stop after this many inputs, 0 runs until "
+              "interrupted.");
+DEFINE_string(fuzz_corpus_dir, "protoapi_corpus",
+              "Directory holding one minimized input per distinct response.");
+DEFINE_string(fuzz_artifact_dir, ".",
+              "Directory for inputs which crashed Citadel or got no reply.");
+DEFINE_int32(fuzz_reset_check_interval, 64,
+             "Read the reset counter after this many inputs. Lower values "
+             "pinpoint crashes faster at the cost of throughput.");
+DEFINE_int32(fuzz_stats_interval_s, 10, "Seconds between progress reports.");
+DEFINE_int32(fuzz_minimize_attempts, 32,
+             "Executions spent shrinking each new corpus entry.");
+#endif  // ANDROID
+
+using nugget::app::protoapi::AesCbcEncryptTest;
+using nugget::app::protoapi::AesCmacTest;
+using nugget::app::protoapi::AesGcmEncryptTest;
+using nugget::app::protoapi::APImessageID;
+using nugget::app::protoapi::KeySize;
+using nugget::app::protoapi::Notice;
+using nugget::app::protoapi::NoticeCode;
+using nugget::app::protoapi::OneofTestParametersCase;
+using nugget::app::protoapi::OneofTestResultsCase;
+using nugget::app::protoapi::TrngTest;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using test_harness::BYTE_TIME;
+using test_harness::TestHarness;
+
+namespace {
+
+const size_t MAX_PAYLOAD = sizeof(test_harness::raw_message::data);
+
+volatile sig_atomic_t stop_requested = 0;
+
+void signal_handler(int signal) {
+  if (signal) {}
+  stop_requested = 1;
+}
+
+struct Input {
+  uint16_t type;
+  string payload;
+};
+
+struct Outcome {
+  bool replied;
+  bool crashed;
+  uint64_t signature;
+};
+
+uint64_t Fnv1a(uint64_t hash, const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+template <typename T>
+uint64_t Mix(uint64_t hash, T value) {
+  return Fnv1a(hash, &value, sizeof(value));
+}
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+
+string InputName(const Input& input) {
+  uint64_t hash = Mix(FNV_OFFSET, input.type);
+  hash = Fnv1a(hash, input.payload.data(), input.payload.size());
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx",
+           static_cast<unsigned long long>(hash));
+  return name;
+}
+
+uint16_t Subtype(const Input& input) {
+  if (input.payload.size() < 2) {
+    return 0;
+  }
+  return (static_cast<uint8_t>(input.payload[0]) << 8) |
+         static_cast<uint8_t>(input.payload[1]);
+}
+
+/* Inputs which would take the chip out of the protoapi loop rather than
+ * exercise it. */
+bool Excluded(const Input& input) {
+  if (input.type == APImessageID::CONTROL_REQUEST) {
+    return true;
+  }
+  return input.type == APImessageID::TESTING_API_CALL &&
+         Subtype(input) == OneofTestParametersCase::kFullStressTest;
+}
+
+/* Summarizes a reply so inputs which take the same path through the
+ * dispatcher map to the same corpus entry. */
+uint64_t ReplySignature(const test_harness::raw_message& reply) {
+  uint64_t hash = Mix(FNV_OFFSET, reply.type);
+  if (reply.type == APImessageID::NOTICE) {
+    Notice notice;
+    if (notice.ParseFromArray(reply.data, reply.data_len)) {
+      hash = Mix(hash, static_cast<int32_t>(notice.notice_code()));
+    }
+  } else if (reply.type == APImessageID::TESTING_API_RESPONSE &&
+             reply.data_len >= 2) {
+    hash = Mix(hash, static_cast<uint16_t>((reply.data[0] << 8) |
+                                           reply.data[1]));
+  }
+  // Bucket the length so every random payload size isn't a new feature.
+  uint32_t length_bucket = 0;
+  for (uint32_t len = reply.data_len; len; len >>= 1) {
+    ++length_bucket;
+  }
+  return Mix(hash, length_bucket);
+}
+
+class ProtoapiFuzzer {
+ public:
+  ProtoapiFuzzer(TestHarness* harness, uint64_t seed)
+      : harness(harness), rng(seed), execs(0), crashes(0), no_replies(0),
+        last_reset_count(0), last_report_execs(0) {}
+
+  bool Init();
+  void Run(uint64_t iterations);
+  void PrintStats();
+
+ private:
+  Outcome Execute(const Input& input, bool check_reset);
+  bool ResetDetected();
+
+  Input Generate();
+  Input Mutate();
+  void MutateOnce(Input* input);
+
+  void AddToCorpus(const Input& input, uint64_t signature, bool minimize);
+  Input Minimize(const Input& input, uint64_t signature);
+  void TriageCrash();
+
+  string Save(const string& dir, const string& prefix, const Input& input);
+  bool Load(const string& path, Input* input);
+  void LoadCorpus();
+
+  size_t Random(size_t bound) {
+    return bound ? rng() % bound : 0;
+  }
+  string RandomBytes(size_t len);
+
+  TestHarness* harness;
+  std::mt19937_64 rng;
+  test_harness::raw_message message;
+  test_harness::raw_message reply;
+
+  // One input per reply signature, the smallest seen so far.
+  vector<Input> corpus;
+  std::map<uint64_t, size_t> corpus_by_signature;
+  vector<string> corpus_paths;
+
+  // Inputs sent since the reset counter was last read.
+  vector<Input> window;
+
+  uint64_t execs;
+  uint64_t crashes;
+  uint64_t no_replies;
+  uint64_t last_reset_count;
+  steady_clock::time_point start;
+  steady_clock::time_point last_report;
+  uint64_t last_report_execs;
+};
+
+bool ProtoapiFuzzer::Init() {
+  struct nugget_app_low_power_stats stats;
+  if (!harness->GetLowPowerStats(&stats)) {
+    std::cerr << "Unable to read the reset counter\n";
+    return false;
+  }
+  last_reset_count = stats.hard_reset_count;
+
+  mkdir(FLAGS_fuzz_corpus_dir.c_str(), 0755);
+  start = steady_clock::now();
+  last_report = start;
+  last_report_execs = 0;
+  LoadCorpus();
+  return true;
+}
+
+bool ProtoapiFuzzer::ResetDetected() {
+  struct nugget_app_low_power_stats stats;
+  if (!harness->GetLowPowerStats(&stats)) {
+    // Still rebooting; the next successful read will tell.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!harness->GetLowPowerStats(&stats)) {
+      return true;
+    }
+  }
+  const bool reset = stats.hard_reset_count != last_reset_count;
+  last_reset_count = stats.hard_reset_count;
+  return reset;
+}
+
+Outcome ProtoapiFuzzer::Execute(const Input& input, bool check_reset) {
+  Outcome outcome;
+  message.type = input.type;
+  message.data_len = input.payload.size();
+  memcpy(message.data, input.payload.data(), input.payload.size());
+
+  int code = harness->SendData(message);
+  if (code != test_harness::error_codes::NO_ERROR) {
+    outcome.replied = false;
+    outcome.signature = Mix(Mix(FNV_OFFSET, 'S'), code);
+  } else {
+    code = harness->GetData(&reply, 4096 * BYTE_TIME);
+    outcome.replied = code == test_harness::error_codes::NO_ERROR;
+    outcome.signature = outcome.replied ? ReplySignature(reply)
+                                        : Mix(Mix(FNV_OFFSET, 'R'), code);
+  }
+  ++execs;
+
+  outcome.crashed = (check_reset || !outcome.replied) && ResetDetected();
+  return outcome;
+}
+
+string ProtoapiFuzzer::RandomBytes(size_t len) {
+  string out(len, '\0');
+  for (auto& c : out) {
+    c = static_cast<char>(rng());
+  }
+  return out;
+}
+
+/* Builds a well formed request, mostly testing API calls with random but
+ * plausible fields, so the fuzzer gets past the protobuf parser. */
+Input ProtoapiFuzzer::Generate() {
+  Input input;
+  input.type = APImessageID::TESTING_API_CALL;
+  const KeySize key_sizes[] = {KeySize::s0b, KeySize::s128b, KeySize::s192b,
+                               KeySize::s256b};
+  string proto;
+  uint16_t subtype = 0;
+
+  switch (Random(6)) {
+    case 0: {
+      AesCbcEncryptTest request;
+      request.set_key_size(key_sizes[Random(4)]);
+      request.set_key(RandomBytes(Random(40)));
+      request.set_number_of_blocks(Random(64));
+      request.SerializeToString(&proto);
+      subtype = OneofTestParametersCase::kAesCbcEncryptTest;
+      break;
+    }
+    case 1: {
+      AesGcmEncryptTest request;
+      request.set_key(RandomBytes(Random(40)));
+      request.set_iv(RandomBytes(Random(64)));
+      request.set_plain_text(RandomBytes(Random(200)));
+      request.set_aad(RandomBytes(Random(100)));
+      request.set_tag_len(Random(20));
+      request.SerializeToString(&proto);
+      subtype = OneofTestParametersCase::kAesGcmEncryptTest;
+      break;
+    }
+    case 2: {
+      AesCmacTest request;
+      request.set_key(RandomBytes(Random(40)));
+      request.set_plain_text(RandomBytes(Random(300)));
+      request.SerializeToString(&proto);
+      subtype = OneofTestParametersCase::kAesCmacTest;
+      break;
+    }
+    case 3: {
+      TrngTest request;
+      request.set_number_of_bytes(Random(1024));
+      request.SerializeToString(&proto);
+      subtype = OneofTestParametersCase::kTrngTest;
+      break;
+    }
+    case 4: {
+      // Setting a code which isn't in the enum is undefined, so only valid
+      // codes are sent; the raw payload cases cover malformed notices.
+      const google::protobuf::EnumDescriptor *codes =
+          nugget::app::protoapi::NoticeCode_descriptor();
+      Notice notice;
+      notice.set_notice_code(static_cast<NoticeCode>(
+          codes->value(Random(codes->value_count()))->number()));
+      input.type = APImessageID::NOTICE;
+      notice.SerializeToString(&input.payload);
+      return input;
+    }
+    default:
+      input.type = Random(8);
+      input.payload = RandomBytes(Random(MAX_PAYLOAD + 1));
+      if (Excluded(input)) {
+        input.type = APImessageID::ECHO_THIS;
+      }
+      return input;
+  }
+
+  input.payload.push_back(static_cast<char>(subtype >> 8));
+  input.payload.push_back(static_cast<char>(subtype));
+  input.payload.append(proto.substr(0, MAX_PAYLOAD - 2));
+  return input;
+}
+
+void ProtoapiFuzzer::MutateOnce(Input* input) {
+  string& payload = input->payload;
+  const uint8_t interesting[] = {0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff};
+
+  switch (Random(8)) {
+    case 0:  // Message type, now and then one the dispatcher doesn't know.
+      input->type = Random(8) ? Random(8) : static_cast<uint16_t>(rng());
+      break;
+    case 1:  // Testing API subtype.
+      if (payload.size() >= 2) {
+        const uint16_t subtype = Random(8) ? Random(8)
+                                           : static_cast<uint16_t>(rng());
+        payload[0] = static_cast<char>(subtype >> 8);
+        payload[1] = static_cast<char>(subtype);
+      }
+      break;
+    case 2:  // Bit flip.
+      if (!payload.empty()) {
+        payload[Random(payload.size())] ^= 1 << Random(8);
+      }
+      break;
+    case 3:  // Boundary value, which often lands on a varint or length.
+      if (!payload.empty()) {
+        payload[Random(payload.size())] =
+            interesting[Random(sizeof(interesting))];
+      }
+      break;
+    case 4:  // Insert.
+      payload.insert(Random(payload.size() + 1), RandomBytes(1 + Random(16)));
+      break;
+    case 5:  // Erase.
+      if (!payload.empty()) {
+        const size_t pos = Random(payload.size());
+        payload.erase(pos, 1 + Random(payload.size() - pos));
+      }
+      break;
+    case 6:  // Truncate.
+      payload.resize(Random(payload.size() + 1));
+      break;
+    default:  // Splice in the tail of another corpus entry.
+      if (!corpus.empty()) {
+        const string& other = corpus[Random(corpus.size())].payload;
+        const size_t from = Random(other.size() + 1);
+        payload.resize(Random(payload.size() + 1));
+        payload.append(other, from, string::npos);
+      }
+      break;
+  }
+
+  if (payload.size() > MAX_PAYLOAD) {
+    payload.resize(MAX_PAYLOAD);
+  }
+}
+
+Input ProtoapiFuzzer::Mutate() {
+  if (corpus.empty() || Random(4) == 0) {
+    return Generate();
+  }
+
+  Input input = corpus[Random(corpus.size())];
+  for (size_t i = 1 + Random(4); i > 0; --i) {
+    MutateOnce(&input);
+  }
+  if (Excluded(input)) {
+    return Generate();
+  }
+  return input;
+}
+
+/* Shrinks @input while it keeps producing @signature. Removes chunks of
+ * halving size, so most of the budget goes to the large cuts first. */
+Input ProtoapiFuzzer::Minimize(const Input& input, uint64_t signature) {
+  Input best = input;
+  int attempts = FLAGS_fuzz_minimize_attempts;
+  for (size_t chunk = best.payload.size() / 2; chunk > 0 && attempts > 0;
+       chunk /= 2) {
+    for (size_t pos = 0; pos + chunk <= best.payload.size() && attempts > 0;) {
+      Input candidate = best;
+      candidate.payload.erase(pos, chunk);
+      --attempts;
+      const Outcome outcome = Execute(candidate, false);
+      if (outcome.crashed) {
+        ++crashes;
+        Save(FLAGS_fuzz_artifact_dir, "crash-", candidate);
+        return best;
+      }
+      if (outcome.signature == signature) {
+        best = candidate;
+      } else {
+        pos += chunk;
+      }
+    }
+  }
+  return best;
+}
+
+void ProtoapiFuzzer::AddToCorpus(const Input& input, uint64_t signature,
+                                 bool minimize) {
+  auto it = corpus_by_signature.find(signature);
+  if (it != corpus_by_signature.end()) {
+    // Keep the smallest input for each signature.
+    const size_t index = it->second;
+    if (input.payload.size() >= corpus[index].payload.size()) {
+      return;
+    }
+    unlink(corpus_paths[index].c_str());
+    corpus[index] = input;
+    corpus_paths[index] = Save(FLAGS_fuzz_corpus_dir, "", input);
+    return;
+  }
+
+  const Input entry = minimize ? Minimize(input, signature) : input;
+  corpus_by_signature[signature] = corpus.size();
+  corpus.push_back(entry);
+  corpus_paths.push_back(Save(FLAGS_fuzz_corpus_dir, "", entry));
+}
+
+/* Replays the inputs sent since the last good reset check one at a time to
+ * find the one which brought Citadel down. */
+void ProtoapiFuzzer::TriageCrash() {
+  vector<Input> suspects;
+  suspects.swap(window);
+
+  if (suspects.size() > 1) {
+    for (const auto& input : suspects) {
+      if (Execute(input, true).crashed) {
+        std::cout << "Crash reproduced: "
+                  << Save(FLAGS_fuzz_artifact_dir, "crash-", input) << "\n";
+        return;
+      }
+    }
+  }
+
+  // Not reproducible on its own, keep the whole sequence.
+  for (const auto& input : suspects) {
+    std::cout << "Crash candidate: "
+              << Save(FLAGS_fuzz_artifact_dir, "crash-window-", input) << "\n";
+  }
+}
+
+string ProtoapiFuzzer::Save(const string& dir, const string& prefix,
+                            const Input& input) {
+  const string path = dir + "/" + prefix + InputName(input);
+  std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+  out.put(static_cast<char>(input.type >> 8));
+  out.put(static_cast<char>(input.type));
+  out << input.payload;
+  return path;
+}
+
+bool ProtoapiFuzzer::Load(const string& path, Input* input) {
+  std::ifstream in(path, std::ios_base::binary);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  const string data = ss.str();
+  if (data.size() < 2 || data.size() > MAX_PAYLOAD + 2) {
+    return false;
+  }
+  input->type = (static_cast<uint8_t>(data[0]) << 8) |
+                static_cast<uint8_t>(data[1]);
+  input->payload = data.substr(2);
+  return !Excluded(*input);
+}
+
+/* Replays the saved corpus to learn the signature of each entry and drops the
+ * files which duplicate a smaller entry. */
+void ProtoapiFuzzer::LoadCorpus() {
+  DIR* dir = opendir(FLAGS_fuzz_corpus_dir.c_str());
+  if (!dir) {
+    return;
+  }
+  vector<string> paths;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      paths.push_back(FLAGS_fuzz_corpus_dir + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+
+  for (const auto& path : paths) {
+    Input input;
+    if (!Load(path, &input)) {
+      continue;
+    }
+    const Outcome outcome = Execute(input, true);
+    if (outcome.crashed) {
+      ++crashes;
+      std::cout << "Corpus entry crashes Citadel: " << path << "\n";
+      continue;
+    }
+    unlink(path.c_str());
+    AddToCorpus(input, outcome.signature, false);
+  }
+  std::cout << "Loaded " << corpus.size() << " corpus entries from "
+            << paths.size() << " files\n";
+}
+
+void ProtoapiFuzzer::Run(uint64_t iterations) {
+  const size_t check_interval = FLAGS_fuzz_reset_check_interval > 0 ?
+      FLAGS_fuzz_reset_check_interval : 1;
+
+  while (!stop_requested && (iterations == 0 || execs < iterations)) {
+    const Input input = Mutate();
+    window.push_back(input);
+    const bool check = window.size() >= check_interval;
+    const Outcome outcome = Execute(input, check);
+
+    if (outcome.crashed) {
+      ++crashes;
+      TriageCrash();
+      continue;
+    }
+    if (check) {
+      window.clear();
+    }
+    if (!outcome.replied &&
+        corpus_by_signature.find(outcome.signature) ==
+            corpus_by_signature.end()) {
+      ++no_replies;
+      std::cout << "No reply: "
+                << Save(FLAGS_fuzz_artifact_dir, "noreply-", input) << "\n";
+    }
+    AddToCorpus(input, outcome.signature, true);
+
+    if (steady_clock::now() - last_report >=
+        std::chrono::seconds(FLAGS_fuzz_stats_interval_s)) {
+      PrintStats();
+    }
+  }
+  PrintStats();
+}
+
+void ProtoapiFuzzer::PrintStats() {
+  const auto now = steady_clock::now();
+  const double total = duration<double>(now - start).count();
+  const double recent = duration<double>(now - last_report).count();
+  printf("execs: %llu  execs/s: %.1f (recent %.1f)  corpus: %zu  "
+         "crashes: %llu  no reply: %llu\n",
+         static_cast<unsigned long long>(execs),
+         total > 0 ? execs / total : 0.0,
+         recent > 0 ? (execs - last_report_execs) / recent : 0.0,
+         corpus.size(), static_cast<unsigned long long>(crashes),
+         static_cast<unsigned long long>(no_replies));
+  fflush(stdout);
+  last_report = now;
+  last_report_execs = execs;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+#ifndef ANDROID
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#else
+  if (argc || argv) {}
+#endif  // ANDROID
+
+  uint64_t seed = FLAGS_fuzz_seed;
+  if (seed == 0) {
+    std::random_device random_number_generator;
+    seed = (static_cast<uint64_t>(random_number_generator()) << 32) |
+           random_number_generator();
+  }
+  std::cout << "Seed: " << seed << "\n";
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  unique_ptr<TestHarness> harness = TestHarness::MakeUnique();
+#ifndef CONFIG_NO_UART
+  if (!harness->UsingSpi() && !harness->SwitchFromConsoleToProtoApi()) {
+    std::cerr << "Unable to switch to the protoapi\n";
+    return 1;
+  }
+#endif  // CONFIG_NO_UART
+
+  ProtoapiFuzzer fuzzer(harness.get(), seed);
+  if (!fuzzer.Init()) {
+    return 1;
+  }
+  fuzzer.Run(FLAGS_fuzz_iterations);
+  return 0;
+}
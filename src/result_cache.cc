@@ -0,0 +1,168 @@
+#include "src/result_cache.h"
+
+#include <app_nugget.h>
+#include <application.h>
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+namespace test_harness {
+namespace {
+
+// FNV-1a, which is plenty to tell builds apart and needs no crypto library.
+class Fnv64 {
+ public:
+  Fnv64() : hash(0xcbf29ce484222325ull) {}
+
+  void Add(const char* data, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+      hash ^= static_cast<uint8_t>(data[i]);
+      hash *= 0x100000001b3ull;
+    }
+  }
+  void Add(const std::string& data) {
+    // Include the length so "ab"+"c" and "a"+"bc" differ.
+    Add(data.data(), data.size());
+    const uint64_t size = data.size();
+    Add(reinterpret_cast<const char*>(&size), sizeof(size));
+  }
+
+  std::string Hex() const {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx",
+             static_cast<unsigned long long>(hash));
+    return hex;
+  }
+
+ private:
+  uint64_t hash;
+};
+
+std::string CallForString(nos::NuggetClientInterface* client, uint16_t param) {
+  std::vector<uint8_t> request;
+  std::vector<uint8_t> response;
+  response.reserve(512);
+  if (client->CallApp(APP_ID_NUGGET, param, request, &response) !=
+      APP_SUCCESS) {
+    return "";
+  }
+  // Both replies are NUL terminated strings.
+  return std::string(response.begin(), response.end()).c_str();
+}
+
+}  // namespace
+
+std::string ResultCache::DeviceKey(nos::NuggetClientInterface* client) {
+  const std::string version = CallForString(client, NUGGET_PARAM_VERSION);
+  const std::string device_id = CallForString(client, NUGGET_PARAM_DEVICE_ID);
+  if (version.empty() || device_id.empty()) {
+    return "";
+  }
+  return version + "|" + device_id.substr(0, device_id.find(':'));
+}
+
+std::string ResultCache::BinaryHash() {
+  std::ifstream binary("/proc/self/exe", std::ios::binary);
+  if (!binary) {
+    return "";
+  }
+  Fnv64 hash;
+  char buffer[64 * 1024];
+  while (binary.read(buffer, sizeof(buffer)) || binary.gcount() > 0) {
+    hash.Add(buffer, binary.gcount());
+  }
+  return hash.Hex();
+}
+
+std::string ResultCache::MakeKey(const std::string& device_key,
+                                 const std::string& binary_hash) {
+  Fnv64 hash;
+  hash.Add(device_key);
+  hash.Add(binary_hash);
+  return hash.Hex();
+}
+
+ResultCache::ResultCache(const std::string& path, const std::string& key)
+    : path(path), current_key(key) {}
+
+bool ResultCache::Load() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ifstream file(path);
+  if (!file) {
+    return true;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t tab = line.find('\t');
+    if (tab == std::string::npos) {
+      return false;
+    }
+    passed[line.substr(0, tab)].insert(line.substr(tab + 1));
+  }
+  return !file.bad();
+}
+
+bool ResultCache::Save() const {
+  // Write a new file and rename it so an interrupted run can't leave half a
+  // cache behind.
+  const std::string temp = path + ".tmp";
+  std::lock_guard<std::mutex> lock(mutex);
+  {
+    std::ofstream file(temp, std::ios::trunc);
+    for (const auto& entry : passed) {
+      for (const auto& test : entry.second) {
+        file << entry.first << '\t' << test << '\n';
+      }
+    }
+    if (!file.flush()) {
+      return false;
+    }
+  }
+  return rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool ResultCache::Passed(const std::string& test) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto entry = passed.find(current_key);
+  return entry != passed.end() && entry->second.count(test) > 0;
+}
+
+void ResultCache::Record(const std::string& test, bool test_passed) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (test_passed) {
+    passed[current_key].insert(test);
+  } else {
+    passed[current_key].erase(test);
+  }
+}
+
+void ResultCacheListener::OnTestEnd(const testing::TestInfo& test_info) {
+  cache->Record(
+      std::string(test_info.test_case_name()) + "." + test_info.name(),
+      test_info.result()->Passed());
+}
+
+void ResultCacheListener::OnTestProgramEnd(const testing::UnitTest&) {
+  if (!cache->Save()) {
+    perror("Saving the result cache");
+  }
+}
+
+std::string ExcludeFromFilter(const std::string& filter,
+                              const std::set<std::string>& tests) {
+  if (tests.empty()) {
+    return filter;
+  }
+  // Everything after the first '-' is negative, so only one is needed.
+  std::string result = filter.empty() ? "*" : filter;
+  char separator = result.find('-') == std::string::npos ? '-' : ':';
+  for (const auto& test : tests) {
+    result += separator;
+    result += test;
+    separator = ':';
+  }
+  return result;
+}
+
+}  // namespace test_harness
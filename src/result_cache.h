@@ -0,0 +1,74 @@
+#ifndef SRC_RESULT_CACHE_H
+#define SRC_RESULT_CACHE_H
+
+#include <gtest/gtest.h>
+#include <nos/NuggetClientInterface.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace test_harness {
+
+/**
+ * Remembers which tests passed against a given firmware, device and test
+ * binary so --incremental runs can skip them. The key is a hash of the
+ * NUGGET_PARAM_VERSION string, the device id class and a hash of the test
+ * binary, so flashing new firmware or rebuilding the tests starts afresh.
+ *
+ * The file holds one "key<TAB>test" line per passing test. Entries for other
+ * keys are kept, so switching back to an earlier image reuses its results.
+ *
+ * Thread safe, so the watchdog can Save() while a listener is recording. */
+class ResultCache {
+ public:
+  /** @return an empty string if the device can't be read. The device id
+   * class is the part of NUGGET_PARAM_DEVICE_ID before the ':', which is the
+   * same for every chip of a kind. */
+  static std::string DeviceKey(nos::NuggetClientInterface* client);
+  /** A hash of the running executable, or an empty string on failure. */
+  static std::string BinaryHash();
+  /** Combines the parts into the key used in the file. */
+  static std::string MakeKey(const std::string& device_key,
+                             const std::string& binary_hash);
+
+  ResultCache(const std::string& path, const std::string& key);
+
+  /** A missing file is an empty cache, not an error. */
+  bool Load();
+  bool Save() const;
+
+  bool Passed(const std::string& test) const;
+  void Record(const std::string& test, bool passed);
+
+  const std::string& key() const { return current_key; }
+
+ private:
+  const std::string path;
+  const std::string current_key;
+  mutable std::mutex mutex;
+  std::map<std::string, std::set<std::string>> passed;
+};
+
+/** Records each test's result in the cache and saves it when the program
+ * ends. */
+class ResultCacheListener : public testing::EmptyTestEventListener {
+ public:
+  explicit ResultCacheListener(ResultCache* cache) : cache(cache) {}
+
+  void OnTestEnd(const testing::TestInfo& test_info) override;
+  void OnTestProgramEnd(const testing::UnitTest& unit_test) override;
+
+ private:
+  ResultCache* cache;
+};
+
+/** Adds @tests as negative patterns to the gtest filter @filter, keeping the
+ * positive patterns it already has. */
+std::string ExcludeFromFilter(const std::string& filter,
+                              const std::set<std::string>& tests);
+
+}  // namespace test_harness
+
+#endif  // SRC_RESULT_CACHE_H
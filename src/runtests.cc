@@ -7,10 +7,15 @@
 #include <iostream>
 #include <memory>
 #include <random>
+#include <string>
+#include <thread>
 
 #include "nugget/app/protoapi/control.pb.h"
 #include "nugget/app/protoapi/header.pb.h"
 #include "nugget/app/protoapi/testing_api.pb.h"
+#include "src/assertions.h"
+#include "src/concurrent_harness.h"
+#include "src/protoapi_call.h"
 #include "src/util.h"
 
 #ifdef ANDROID
@@ -35,29 +40,13 @@ using nugget::app::protoapi::TrngTestResult;
 using std::cout;
 using std::vector;
 using std::unique_ptr;
+using test_harness::ConcurrentTestHarness;
 using test_harness::TestHarness;
 
 #define ASSERT_NO_TH_ERROR(code) \
   ASSERT_EQ(code, test_harness::error_codes::NO_ERROR) \
       << code << " is " << test_harness::error_codes_name(code)
 
-#define ASSERT_MSG_TYPE(msg, type_) \
-do{if(type_ != APImessageID::NOTICE && msg.type == APImessageID::NOTICE){ \
-  Notice received; \
-  received.ParseFromArray(reinterpret_cast<char *>(msg.data), msg.data_len); \
-  ASSERT_EQ(msg.type, type_) \
-      << msg.type << " is " << APImessageID_Name((APImessageID) msg.type) \
-      << "\n" << received.DebugString(); \
-}else{ \
-  ASSERT_EQ(msg.type, type_) \
-      << msg.type << " is " << APImessageID_Name((APImessageID) msg.type); \
-}}while(0)
-
-#define ASSERT_SUBTYPE(msg, type_) \
-  EXPECT_GT(msg.data_len, 2); \
-  uint16_t subtype = (msg.data[0] << 8) | msg.data[1]; \
-  EXPECT_EQ(subtype, type_)
-
 namespace {
 
 using test_harness::BYTE_TIME;
@@ -89,7 +78,7 @@ void NuggetOsTest::SetUpTestCase() {
 void NuggetOsTest::TearDownTestCase() {
 #ifndef CONFIG_NO_UART
   if (!harness->UsingSpi()) {
-    harness->ReadUntil(test_harness::BYTE_TIME * 1024);
+    harness->ReadUntilPromptOrIdle(test_harness::BYTE_TIME * 1024);
     EXPECT_TRUE(harness->SwitchFromProtoApiToConsole(NULL));
   }
 #endif  // CONFIG_NO_UART
@@ -167,19 +156,21 @@ TEST_F(NuggetOsTest, InvalidMessageType) {
 }
 
 TEST_F(NuggetOsTest, Sequence) {
+  uint8_t sequence[256];
+  for (size_t x = 0; x < sizeof(sequence); ++x) {
+    sequence[x] = x;
+  }
+
   test_harness::raw_message msg;
   msg.type = APImessageID::SEND_SEQUENCE;
-  msg.data_len = 256;
-  for (size_t x = 0; x < msg.data_len; ++x) {
-    msg.data[x] = x;
-  }
+  msg.data_len = sizeof(sequence);
+  std::copy(sequence, sequence + sizeof(sequence), msg.data);
 
   ASSERT_NO_TH_ERROR(harness->SendData(msg));
   ASSERT_NO_TH_ERROR(harness->GetData(&msg, 4096 * BYTE_TIME));
   ASSERT_MSG_TYPE(msg, APImessageID::SEND_SEQUENCE);
-  for (size_t x = 0; x < msg.data_len; ++x) {
-    ASSERT_EQ(msg.data[x], x) << "Inconsistency at index " << x;
-  }
+  ASSERT_LE(msg.data_len, sizeof(sequence));
+  ASSERT_BUFFER_EQ(sequence, msg.data, msg.data_len);
 }
 
 TEST_F(NuggetOsTest, Echo) {
@@ -195,13 +186,9 @@ TEST_F(NuggetOsTest, Echo) {
 
   test_harness::raw_message receive_msg;
   ASSERT_NO_TH_ERROR(harness->GetData(&receive_msg, 4096 * BYTE_TIME));
-  ASSERT_MSG_TYPE(msg, APImessageID::ECHO_THIS);
+  ASSERT_MSG_TYPE(receive_msg, APImessageID::ECHO_THIS);
   ASSERT_EQ(receive_msg.data_len, msg.data_len);
-
-  for (size_t x = 0; x < msg.data_len; ++x) {
-    ASSERT_EQ(msg.data[x], receive_msg.data[x])
-        << "Inconsistency at index " << x;
-  }
+  ASSERT_BUFFER_EQ(msg.data, receive_msg.data, msg.data_len);
 }
 
 TEST_F(NuggetOsTest, AesCbc) {
@@ -231,19 +218,8 @@ TEST_F(NuggetOsTest, AesCbc) {
       outfile.close();
     }
 
-    ASSERT_NO_TH_ERROR(harness->SendOneofProto(
-        APImessageID::TESTING_API_CALL,
-        OneofTestParametersCase::kAesCbcEncryptTest,
-        request));
-
-    test_harness::raw_message msg;
-    ASSERT_NO_TH_ERROR(harness->GetData(&msg, 4096 * BYTE_TIME));
-    ASSERT_MSG_TYPE(msg, APImessageID::TESTING_API_RESPONSE);
-    ASSERT_SUBTYPE(msg, OneofTestResultsCase::kAesCbcEncryptTestResult);
-
     AesCbcEncryptTestResult result;
-    ASSERT_TRUE(result.ParseFromArray(reinterpret_cast<char *>(msg.data + 2),
-                                      msg.data_len - 2));
+    ASSERT_CALL(harness, request, &result);
     EXPECT_EQ(result.result_code(), DcryptError::DE_NO_ERROR)
         << result.result_code() << " is "
         << DcryptError_Name(result.result_code());
@@ -261,19 +237,15 @@ TEST_F(NuggetOsTest, AesCbc) {
       AES_cbc_encrypt(reinterpret_cast<uint8_t *>(in),
                       reinterpret_cast<uint8_t *>(sw_out), AES_BLOCK_SIZE,
                       &aes_key, reinterpret_cast<uint8_t *>(iv), true);
-      for (size_t y = 0; y < AES_BLOCK_SIZE; ++y) {
-        size_t index = x * AES_BLOCK_SIZE + y;
-        ASSERT_EQ(result.cipher_text()[index] & 0x00ff,
-                  sw_out[y] & 0x00ff) << "Inconsistency at index " << index;
-      }
+      ASSERT_BUFFER_EQ(sw_out,
+                       result.cipher_text().data() + x * AES_BLOCK_SIZE,
+                       AES_BLOCK_SIZE) << "block " << x;
     }
 
     ASSERT_EQ(result.initialization_vector().size(), (size_t) AES_BLOCK_SIZE)
         << "\n" << result.DebugString();
-    for (size_t x = 0; x < AES_BLOCK_SIZE; ++x) {
-      ASSERT_EQ(result.initialization_vector()[x] & 0x00ff, iv[x] & 0x00ff)
-                << "Inconsistency at index " << x;
-    }
+    ASSERT_BUFFER_EQ(iv, result.initialization_vector().data(),
+                     AES_BLOCK_SIZE);
   }
 }
 
@@ -289,20 +261,10 @@ TEST_F(NuggetOsTest, Trng) {
   TrngTest request;
   request.set_number_of_bytes(request_size);
 
+  TrngTestResult result;
   int verbosity = harness->getVerbosity();
   for (size_t x = 0; x < repeats; ++x) {
-    ASSERT_NO_TH_ERROR(harness->SendOneofProto(
-        APImessageID::TESTING_API_CALL,
-        OneofTestParametersCase::kTrngTest,
-        request));
-    test_harness::raw_message msg;
-    ASSERT_NO_TH_ERROR(harness->GetData(&msg, 4096 * BYTE_TIME));
-    ASSERT_MSG_TYPE(msg, APImessageID::TESTING_API_RESPONSE);
-    ASSERT_SUBTYPE(msg, OneofTestResultsCase::kTrngTestResult);
-
-    TrngTestResult result;
-    ASSERT_TRUE(result.ParseFromArray(reinterpret_cast<char *>(msg.data + 2),
-                                      msg.data_len - 2));
+    ASSERT_CALL(harness, request, &result);
     ASSERT_EQ(result.random_bytes().size(), request_size);
     for (const auto rand_byte : result.random_bytes()) {
       ++counts[0x00ff & rand_byte];
@@ -329,4 +291,90 @@ TEST_F(NuggetOsTest, Trng) {
   ASSERT_LT(kl_divergence, 15.0);
 }
 
+TEST_F(NuggetOsTest, ConcurrentCallers) {
+  const size_t callers = 4;
+  const size_t rounds = 8;
+  const size_t number_of_blocks = 2;
+
+  // Every caller echoes its own bytes and encrypts under its own key through
+  // the shared harness buffers. The replies are checked here, so one handed
+  // to the wrong caller shows up as a mismatch.
+  ConcurrentTestHarness concurrent(harness.get());
+  vector<unique_ptr<ConcurrentTestHarness::Context>> contexts;
+  vector<uint32_t> seeds;
+  for (size_t i = 0; i < callers; ++i) {
+    contexts.push_back(concurrent.NewContext("caller " + std::to_string(i)));
+    seeds.push_back(random_number_generator());
+  }
+
+  vector<std::string> failures(callers);
+  auto work = [&](size_t caller) {
+    std::mt19937 rng(seeds[caller]);
+    ConcurrentTestHarness::Context& context = *contexts[caller];
+    AesCbcEncryptTest request;
+    AesCbcEncryptTestResult result;
+    for (size_t round = 0; round < rounds; ++round) {
+      const std::string where = " in round " + std::to_string(round);
+
+      test_harness::raw_message echo;
+      echo.type = APImessageID::ECHO_THIS;
+      echo.data_len = 128;
+      for (size_t x = 0; x < echo.data_len; ++x) {
+        echo.data[x] = rng();
+      }
+      test_harness::raw_message reply;
+      if (context.Exchange(echo, &reply) !=
+          test_harness::error_codes::NO_ERROR) {
+        failures[caller] = "echo failed" + where;
+        return;
+      }
+      if (reply.type != echo.type || reply.data_len != echo.data_len ||
+          !std::equal(echo.data, echo.data + echo.data_len, reply.data)) {
+        failures[caller] = "wrong echo" + where;
+        return;
+      }
+
+      uint8_t key[16];
+      for (auto& byte : key) {
+        byte = rng();
+      }
+      request.set_key_size(KeySize::s128b);
+      request.set_number_of_blocks(number_of_blocks);
+      request.set_key(key, sizeof(key));
+      if (context.Call(request, &result) !=
+          test_harness::error_codes::NO_ERROR ||
+          result.result_code() != DcryptError::DE_NO_ERROR) {
+        failures[caller] = "encryption failed" + where;
+        return;
+      }
+
+      uint8_t zeros[number_of_blocks * AES_BLOCK_SIZE] = {};
+      uint8_t expected[sizeof(zeros)];
+      uint8_t iv[AES_BLOCK_SIZE] = {};
+      AES_KEY aes_key;
+      AES_set_encrypt_key(key, sizeof(key) * 8, &aes_key);
+      AES_cbc_encrypt(zeros, expected, sizeof(zeros), &aes_key, iv, true);
+      if (result.cipher_text() !=
+          std::string(reinterpret_cast<char *>(expected), sizeof(expected))) {
+        failures[caller] = "wrong cipher text" + where;
+        return;
+      }
+    }
+  };
+
+  vector<std::thread> threads;
+  for (size_t i = 0; i < callers; ++i) {
+    threads.emplace_back(work, i);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < callers; ++i) {
+    EXPECT_EQ(failures[i], "") << contexts[i]->name();
+    EXPECT_EQ(contexts[i]->stats().calls, 2 * rounds) << contexts[i]->name();
+  }
+  ConcurrentTestHarness::PrintStats(contexts);
+}
+
 }  // namespace
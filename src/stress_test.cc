@@ -1,8 +1,15 @@
 
 #include <unistd.h>
 
+#include <app_nugget.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <memory>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #include "google/protobuf/empty.pb.h"
@@ -10,42 +17,270 @@
 #include "nugget/app/protoapi/header.pb.h"
 #include "nugget/app/protoapi/testing_api.pb.h"
 #include "src/util.h"
+#include "latency_samples.h"
+#include "probes.h"
+
+#ifdef ANDROID
+#define FLAGS_stress_monitor_period_ms 5000
+#define FLAGS_stress_monitor_max_load_pct 5
+#define FLAGS_stress_monitor_report_s 60
+#else
+#include "gflags/gflags.h"
+
+DEFINE_int32(stress_monitor_period_ms, 5000,
+             "Check on the chip this often while the stress test runs; 0 "
+             "just waits.");
+DEFINE_int32(stress_monitor_max_load_pct, 5,
+             "Stretch the period so the checks keep the chip busy for at most "
+             "this share of the time.");
+DEFINE_int32(stress_monitor_report_s, 60,
+             "Seconds between summaries; the last one is printed on SIGINT.");
+#endif  // ANDROID
 
 using google::protobuf::Empty;
 using nugget::app::protoapi::APImessageID;
 using nugget::app::protoapi::Notice;
+using nugget::app::protoapi::NoticeCode;
 using nugget::app::protoapi::OneofTestParametersCase;
 using nugget::app::protoapi::OneofTestResultsCase;
 using std::unique_ptr;
 using std::vector;
+using std::chrono::duration;
+using std::chrono::steady_clock;
 using test_harness::BYTE_TIME;
 using test_harness::TestHarness;
 
-unique_ptr<TestHarness> harness = unique_ptr<TestHarness>(new TestHarness());
+// Created in main() once the flags it reads have been parsed.
+unique_ptr<TestHarness> harness;
 
 void cleanup() {
+  if (!harness) {
+    return;
+  }
   std::cout << "Performing Reboot!\n";
   harness->RebootNugget();
   std::cout << "Done!\n";
 }
 
+volatile sig_atomic_t stop_requested = 0;
+
 void signal_handler(int signal) {
   if (signal) {}
   exit(0);
 }
+void signal_stop(int signal) {
+  if (signal) {}
+  stop_requested = 1;
+}
 void signal_ignore(int signal) { if (signal) {} }
 
-int main(void) {
+namespace {
+
+const char *const kCheckNames[] = {"ping", "version", "stats"};
+
+// Checks that the chip is still alive while it runs the stress test: a
+// NoticePing through the protoapi, a NUGGET_PARAM_VERSION call and a read of
+// the low power stats, whose hard_reset_count gives away a reboot.
+class HealthMonitor {
+ public:
+  explicit HealthMonitor(TestHarness* harness);
+
+  // Reads the reset count the stress test starts from.
+  bool Init();
+  // Checks until stop_requested is set, then prints the summary.
+  void Run();
+
+ private:
+  enum Check { PING, VERSION, STATS, NUM_CHECKS };
+
+  struct Latencies {
+    vector<double> us;
+    uint64_t failures;
+  };
+
+  bool Ping();
+  bool Version();
+  bool Stats();
+  // Times @check and returns how long it kept the chip busy.
+  steady_clock::duration Time(Check check);
+  void PrintSummary();
+
+  TestHarness* harness;
+  steady_clock::time_point start;
+  uint64_t hard_reset_count;
+  uint64_t resets;
+  Latencies latencies[NUM_CHECKS];
+};
+
+HealthMonitor::HealthMonitor(TestHarness* harness)
+    : harness(harness), hard_reset_count(0), resets(0) {
+  for (auto& latency : latencies) {
+    latency.failures = 0;
+  }
+}
+
+bool HealthMonitor::Init() {
+  struct nugget_app_low_power_stats stats;
+  if (!harness->GetLowPowerStats(&stats)) {
+    return false;
+  }
+  hard_reset_count = stats.hard_reset_count;
+  start = steady_clock::now();
+  return true;
+}
+
+bool HealthMonitor::Ping() {
+  Notice ping;
+  ping.set_notice_code(NoticeCode::PING);
+  if (harness->SendProto(APImessageID::NOTICE, ping) !=
+      test_harness::error_codes::NO_ERROR) {
+    return false;
+  }
+  test_harness::raw_message msg;
+  Notice pong;
+  return harness->GetData(&msg, 4096 * BYTE_TIME) ==
+      test_harness::error_codes::NO_ERROR &&
+      msg.type == APImessageID::NOTICE &&
+      pong.ParseFromArray(reinterpret_cast<char *>(msg.data), msg.data_len) &&
+      pong.notice_code() == NoticeCode::PONG;
+}
+
+bool HealthMonitor::Version() {
+  vector<uint8_t> request;
+  vector<uint8_t> response;
+  response.reserve(512);
+  return harness->CallApp(APP_ID_NUGGET, NUGGET_PARAM_VERSION, request,
+                          &response) == APP_SUCCESS && !response.empty();
+}
+
+bool HealthMonitor::Stats() {
+  struct nugget_app_low_power_stats stats;
+  if (!harness->GetLowPowerStats(&stats)) {
+    return false;
+  }
+  if (stats.hard_reset_count != hard_reset_count) {
+    NOS_PROBE2(monitor_reset, hard_reset_count, stats.hard_reset_count);
+    std::cout << "UNEXPECTED RESET after "
+              << duration<double>(steady_clock::now() - start).count()
+              << " s: hard_reset_count " << hard_reset_count << " -> "
+              << stats.hard_reset_count
+              << ", the stress test is no longer running\n";
+    resets += stats.hard_reset_count > hard_reset_count
+        ? stats.hard_reset_count - hard_reset_count : 1;
+    hard_reset_count = stats.hard_reset_count;
+  }
+  return true;
+}
+
+steady_clock::duration HealthMonitor::Time(Check check) {
+  const auto begin = steady_clock::now();
+  bool ok = false;
+  switch (check) {
+    case PING:
+      ok = Ping();
+      break;
+    case VERSION:
+      ok = Version();
+      break;
+    case STATS:
+      ok = Stats();
+      break;
+    case NUM_CHECKS:
+      break;
+  }
+  const auto elapsed = steady_clock::now() - begin;
+  const double us = duration<double, std::micro>(elapsed).count();
+  NOS_PROBE3(monitor_check, static_cast<int>(check), ok,
+             static_cast<uint64_t>(us));
+  if (ok) {
+    latencies[check].us.push_back(us);
+  } else {
+    latencies[check].failures++;
+    std::cout << kCheckNames[check] << " check failed after " << us
+              << " us\n";
+  }
+  return elapsed;
+}
+
+void HealthMonitor::Run() {
+  const auto period =
+      std::chrono::milliseconds(FLAGS_stress_monitor_period_ms);
+  const double max_load =
+      std::max(1, std::min(100, FLAGS_stress_monitor_max_load_pct)) / 100.0;
+  auto last_report = steady_clock::now();
+
+  while (!stop_requested) {
+    const auto round_start = steady_clock::now();
+    steady_clock::duration busy(0);
+    for (int check = 0; check < NUM_CHECKS && !stop_requested; ++check) {
+      busy += Time(static_cast<Check>(check));
+    }
+
+    // A chip slowed down by the stress test takes longer to answer, so back
+    // off rather than add to the load.
+    const auto next = round_start + std::max<steady_clock::duration>(
+        period, std::chrono::duration_cast<steady_clock::duration>(
+            busy / max_load));
+    while (!stop_requested && steady_clock::now() < next) {
+      std::this_thread::sleep_for(std::min<steady_clock::duration>(
+          next - steady_clock::now(), std::chrono::milliseconds(100)));
+    }
+
+    if (FLAGS_stress_monitor_report_s > 0 &&
+        steady_clock::now() - last_report >=
+            std::chrono::seconds(FLAGS_stress_monitor_report_s)) {
+      PrintSummary();
+      last_report = steady_clock::now();
+    }
+  }
+  PrintSummary();
+}
+
+void HealthMonitor::PrintSummary() {
+  printf("After %.0f s: %llu unexpected resets\n",
+         duration<double>(steady_clock::now() - start).count(),
+         static_cast<unsigned long long>(resets));
+  printf("  %-8s %8s %8s %10s %10s %10s %10s\n", "check", "ok", "failed",
+         "min us", "p50 us", "p95 us", "max us");
+  for (int check = 0; check < NUM_CHECKS; ++check) {
+    vector<double> us = latencies[check].us;
+    const nugget_tools::LatencySummary summary =
+        nugget_tools::SummarizeLatencies(&us);
+    printf("  %-8s %8zu %8llu %10.0f %10.0f %10.0f %10.0f\n",
+           kCheckNames[check], summary.count,
+           static_cast<unsigned long long>(latencies[check].failures),
+           summary.min, summary.median, summary.p95, summary.max);
+  }
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+#ifndef ANDROID
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#else
+  if (argc || argv) {}
+#endif  // ANDROID
+  harness = unique_ptr<TestHarness>(new TestHarness());
+
   vector<uint8_t> input_buffer;
   vector<uint8_t> output_buffer;
   input_buffer.reserve(0x4000);
   output_buffer.reserve(0x4000);
 
   std::atexit(cleanup);
-  signal(SIGINT, signal_handler);
+  signal(SIGINT, signal_stop);
   signal(SIGABRT, signal_handler);
   signal(SIGHUP, signal_ignore);
 
+  HealthMonitor monitor(harness.get());
+  const bool monitoring = FLAGS_stress_monitor_period_ms > 0;
+  if (monitoring && !monitor.Init()) {
+    std::cerr << "Unable to read the low power stats\n";
+    return 1;
+  }
+
   std::cout << "SendOneofProto()\n";
   int result = harness->SendOneofProto(
       APImessageID::TESTING_API_CALL,
@@ -95,8 +330,12 @@ int main(void) {
   }
 
   std::cout << "Waiting!\n";
-  while (true) {
-    sleep(15);
+  if (monitoring) {
+    monitor.Run();
+  } else {
+    while (!stop_requested) {
+      sleep(15);
+    }
   }
   return 0;
 }
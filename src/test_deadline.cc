@@ -0,0 +1,19 @@
+#include "src/test_deadline.h"
+
+namespace test_harness {
+
+TestDeadlineListener::TestDeadlineListener(std::chrono::milliseconds timeout)
+    : timeout(timeout) {}
+
+void TestDeadlineListener::OnTestStart(const testing::TestInfo& test_info) {
+  nugget_tools::SetWatchdogContext(std::string(test_info.test_case_name()) +
+                                   "." + test_info.name());
+  deadline.reset(new nugget_tools::ScopedDeadline("the test", timeout));
+}
+
+void TestDeadlineListener::OnTestEnd(const testing::TestInfo&) {
+  deadline = nullptr;
+  nugget_tools::SetWatchdogContext("");
+}
+
+}  // namespace test_harness
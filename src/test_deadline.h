@@ -0,0 +1,33 @@
+#ifndef SRC_TEST_DEADLINE_H
+#define SRC_TEST_DEADLINE_H
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "watchdog.h"
+
+namespace test_harness {
+
+/**
+ * Names the running test in watchdog reports and, if @timeout is positive,
+ * exits through the watchdog when a single test runs longer than that. The
+ * per call deadlines catch a chip which stops answering; this catches a test
+ * which keeps talking to it but never finishes. */
+class TestDeadlineListener : public testing::EmptyTestEventListener {
+ public:
+  explicit TestDeadlineListener(std::chrono::milliseconds timeout);
+
+  void OnTestStart(const testing::TestInfo& test_info) override;
+  void OnTestEnd(const testing::TestInfo& test_info) override;
+
+ private:
+  const std::chrono::milliseconds timeout;
+  std::unique_ptr<nugget_tools::ScopedDeadline> deadline;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_TEST_DEADLINE_H
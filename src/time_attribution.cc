@@ -0,0 +1,109 @@
+#include "src/time_attribution.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#include "nugget_tools.h"
+#include "time_accounting.h"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+namespace test_harness {
+namespace {
+
+nanoseconds ThreadCpuTime() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return nanoseconds(0);
+  }
+  return std::chrono::seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+}
+
+double Millis(nanoseconds ns) {
+  return duration_cast<microseconds>(ns).count() / 1000.0;
+}
+
+}  // namespace
+
+void TimeAttributionListener::OnTestStart(const testing::TestInfo&) {
+  // Read the chip first so the CallApp isn't charged to the test.
+  start.have_cycles = nugget_tools::ActiveClientCyclesSinceBoot(&start.cycles);
+  start.transport = nugget_tools::AccountedTime(nugget_tools::TIME_TRANSPORT);
+  start.sleep = nugget_tools::AccountedTime(nugget_tools::TIME_SLEEP);
+  start.cpu = ThreadCpuTime();
+  start.wall = steady_clock::now();
+}
+
+void TimeAttributionListener::OnTestEnd(const testing::TestInfo& test_info) {
+  Row row;
+  row.wall = steady_clock::now() - start.wall;
+  row.cpu = ThreadCpuTime() - start.cpu;
+  row.transport =
+      nugget_tools::AccountedTime(nugget_tools::TIME_TRANSPORT) -
+      start.transport;
+  row.sleep =
+      nugget_tools::AccountedTime(nugget_tools::TIME_SLEEP) - start.sleep;
+
+  uint32_t cycles = 0;
+  row.have_cycles = start.have_cycles &&
+      nugget_tools::ActiveClientCyclesSinceBoot(&cycles);
+  // The counter is 32 bits and wraps; unsigned subtraction handles one wrap.
+  row.cycles = cycles - start.cycles;
+
+  row.name = std::string(test_info.test_case_name()) + "." + test_info.name();
+  rows.push_back(row);
+}
+
+void TimeAttributionListener::OnTestProgramEnd(const testing::UnitTest&) {
+  if (rows.empty()) {
+    return;
+  }
+
+  size_t name_width = 4;
+  for (const auto& row : rows) {
+    name_width = std::max(name_width, row.name.size());
+  }
+
+  printf("\nTime attribution (ms):\n");
+  printf("%-*s %10s %10s %10s %10s %10s %14s\n", static_cast<int>(name_width),
+         "Test", "wall", "host cpu", "transport", "sleep", "other",
+         "chip cycles");
+
+  Row total{"Total", nanoseconds(0), nanoseconds(0), nanoseconds(0),
+            nanoseconds(0), true, 0};
+  uint64_t total_cycles = 0;
+  for (const auto& row : rows) {
+    const nanoseconds other = std::max(
+        nanoseconds(0), row.wall - row.cpu - row.transport - row.sleep);
+    printf("%-*s %10.1f %10.1f %10.1f %10.1f %10.1f ",
+           static_cast<int>(name_width), row.name.c_str(), Millis(row.wall),
+           Millis(row.cpu), Millis(row.transport), Millis(row.sleep),
+           Millis(other));
+    if (row.have_cycles) {
+      printf("%14u\n", row.cycles);
+      total_cycles += row.cycles;
+    } else {
+      printf("%14s\n", "-");
+    }
+
+    total.wall += row.wall;
+    total.cpu += row.cpu;
+    total.transport += row.transport;
+    total.sleep += row.sleep;
+  }
+
+  const nanoseconds other = std::max(
+      nanoseconds(0), total.wall - total.cpu - total.transport - total.sleep);
+  printf("%-*s %10.1f %10.1f %10.1f %10.1f %10.1f %14llu\n",
+         static_cast<int>(name_width), total.name.c_str(), Millis(total.wall),
+         Millis(total.cpu), Millis(total.transport), Millis(total.sleep),
+         Millis(other), static_cast<unsigned long long>(total_cycles));
+  fflush(stdout);
+}
+
+}  // namespace test_harness
@@ -0,0 +1,54 @@
+#ifndef SRC_TIME_ATTRIBUTION_H
+#define SRC_TIME_ATTRIBUTION_H
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace test_harness {
+
+/**
+ * Splits the wall time of each test into host CPU time, time blocked on the
+ * transport, deliberate sleeps and whatever is left over, and prints one table
+ * when the test program ends. The number of chip cycles that elapsed during
+ * the test is read through the most recently opened Nugget client, if any.
+ *
+ * Transport time is the wall time spent in CallApp() and on the UART, so the
+ * host CPU spent inside those calls is counted in both columns. Only the main
+ * test thread is measured. */
+class TimeAttributionListener : public testing::EmptyTestEventListener {
+ public:
+  void OnTestStart(const testing::TestInfo& test_info) override;
+  void OnTestEnd(const testing::TestInfo& test_info) override;
+  void OnTestProgramEnd(const testing::UnitTest& unit_test) override;
+
+ private:
+  struct Snapshot {
+    std::chrono::steady_clock::time_point wall;
+    std::chrono::nanoseconds cpu;
+    std::chrono::nanoseconds transport;
+    std::chrono::nanoseconds sleep;
+    bool have_cycles;
+    uint32_t cycles;
+  };
+
+  struct Row {
+    std::string name;
+    std::chrono::nanoseconds wall;
+    std::chrono::nanoseconds cpu;
+    std::chrono::nanoseconds transport;
+    std::chrono::nanoseconds sleep;
+    bool have_cycles;
+    uint32_t cycles;
+  };
+
+  Snapshot start;
+  std::vector<Row> rows;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_TIME_ATTRIBUTION_H
@@ -0,0 +1,51 @@
+#include "src/trace_listener.h"
+
+#include <string>
+
+#include "trace_events.h"
+
+using nugget_tools::TraceArgs;
+using nugget_tools::TraceSpan;
+using std::chrono::steady_clock;
+
+namespace test_harness {
+
+void TraceListener::OnTestCaseStart(const testing::TestCase& test_case) {
+  (void) test_case;
+  case_start = steady_clock::now();
+  test_end = case_start;
+  case_has_run_test = false;
+}
+
+void TraceListener::OnTestStart(const testing::TestInfo& test_info) {
+  test_start = steady_clock::now();
+  if (!case_has_run_test) {
+    case_has_run_test = true;
+    TraceSpan(nugget_tools::TRACK_FIXTURES,
+              std::string(test_info.test_case_name()) + " set up",
+              case_start, test_start);
+  }
+}
+
+void TraceListener::OnTestEnd(const testing::TestInfo& test_info) {
+  test_end = steady_clock::now();
+  const testing::TestResult *result = test_info.result();
+  TraceSpan(nugget_tools::TRACK_TESTS,
+            std::string(test_info.test_case_name()) + "." + test_info.name(),
+            test_start, test_end,
+            TraceArgs().Add("result", result->Failed() ? "FAILED" : "OK"));
+}
+
+void TraceListener::OnTestCaseEnd(const testing::TestCase& test_case) {
+  const auto end = steady_clock::now();
+  if (case_has_run_test) {
+    TraceSpan(nugget_tools::TRACK_FIXTURES,
+              std::string(test_case.name()) + " tear down", test_end, end);
+  }
+  TraceSpan(nugget_tools::TRACK_FIXTURES, test_case.name(), case_start, end,
+            TraceArgs()
+                .Add("tests", test_case.test_to_run_count())
+                .Add("failed", test_case.failed_test_count()));
+}
+
+}  // namespace test_harness
@@ -0,0 +1,32 @@
+#ifndef SRC_TRACE_LISTENER_H
+#define SRC_TRACE_LISTENER_H
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+namespace test_harness {
+
+/**
+ * Adds the tests to the --nos_trace_out timeline. Each test is a span on the
+ * tests track. The fixture's SetUpTestCase() and TearDownTestCase() are the
+ * gaps between the test case starting and its first test, and between its
+ * last test and the test case ending, so they get spans of their own on the
+ * fixtures track. */
+class TraceListener : public testing::EmptyTestEventListener {
+ public:
+  void OnTestCaseStart(const testing::TestCase& test_case) override;
+  void OnTestStart(const testing::TestInfo& test_info) override;
+  void OnTestEnd(const testing::TestInfo& test_info) override;
+  void OnTestCaseEnd(const testing::TestCase& test_case) override;
+
+ private:
+  std::chrono::steady_clock::time_point case_start;
+  std::chrono::steady_clock::time_point test_start;
+  std::chrono::steady_clock::time_point test_end;
+  bool case_has_run_test;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_TRACE_LISTENER_H
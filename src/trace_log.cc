@@ -0,0 +1,175 @@
+#include "src/trace_log.h"
+
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+namespace test_harness {
+
+constexpr size_t TraceLog::kSlotCount;
+constexpr size_t TraceLog::kSlotBytes;
+
+TraceLog& TraceLog::Get() {
+  static TraceLog log;
+  return log;
+}
+
+TraceLog::TraceLog()
+    : epoch(steady_clock::now()), head(0), tail(0), stopping(false),
+      in_call(false), need_prefix(true), line_tag(nullptr), line_time_us(0) {
+  // Same escaping the harness has always used for raw bytes.
+  for (int c = 0; c < 256; ++c) {
+    if (c == '\\') {
+      strcpy(escape[c], "\\\\");
+    } else if (isprint(c)) {
+      escape[c][0] = static_cast<char>(c);
+      escape[c][1] = '\0';
+    } else {
+      snprintf(escape[c], sizeof(escape[c]), "\\x%02x", c);
+    }
+    escape_len[c] = static_cast<uint8_t>(strlen(escape[c]));
+  }
+  worker = std::thread(&TraceLog::Run, this);
+}
+
+TraceLog::~TraceLog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  not_empty.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+void TraceLog::Bytes(const char* tag, const void* data, size_t len) {
+  Push(tag, static_cast<const uint8_t*>(data), len);
+}
+
+void TraceLog::Text(const char* text) {
+  Push(nullptr, reinterpret_cast<const uint8_t*>(text), strlen(text));
+}
+
+void TraceLog::Error(const char* text) {
+  Text(text);
+  Flush();
+}
+
+void TraceLog::Push(const char* tag, const uint8_t* data, size_t len) {
+  const int64_t now_us =
+      duration_cast<microseconds>(steady_clock::now() - epoch).count();
+
+  std::lock_guard<std::mutex> producer_lock(producer_mutex);
+  std::unique_lock<std::mutex> lock(mutex);
+  do {
+    not_full.wait(lock, [this] { return head - tail < kSlotCount; });
+
+    Slot& slot = slots[head % kSlotCount];
+    const size_t chunk = len < kSlotBytes ? len : kSlotBytes;
+    slot.time_us = now_us;
+    slot.tag = tag;
+    slot.len = static_cast<uint16_t>(chunk);
+    slot.more = chunk < len;
+    memcpy(slot.data, data, chunk);
+    data += chunk;
+    len -= chunk;
+
+    // Only the consumer waits on this, so skip the wake up if it is busy.
+    if (head++ == tail) {
+      not_empty.notify_one();
+    }
+  } while (len > 0);
+}
+
+void TraceLog::Flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  const uint64_t target = head;
+  drained.wait(lock, [this, target] { return tail >= target || stopping; });
+}
+
+void TraceLog::Run() {
+  std::string out;
+  out.reserve(kSlotCount * kSlotBytes);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    not_empty.wait(lock, [this] { return head != tail || stopping; });
+    if (head == tail) {
+      break;  // Stopping and drained.
+    }
+
+    // Slots between tail and head are not touched by producers until tail
+    // moves, so they can be formatted without the lock.
+    const uint64_t end = head;
+    lock.unlock();
+    out.clear();
+    for (uint64_t i = tail; i != end; ++i) {
+      Format(slots[i % kSlotCount], &out);
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    lock.lock();
+
+    tail = end;
+    not_full.notify_all();
+    drained.notify_all();
+  }
+}
+
+void TraceLog::AppendPrefix(std::string* out) {
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "[%6" PRId64 ".%06" PRId64 "] ",
+           line_time_us / 1000000, line_time_us % 1000000);
+  out->append(prefix);
+  if (line_tag) {
+    out->append(line_tag);
+    out->append(": ");
+  }
+  need_prefix = false;
+}
+
+void TraceLog::Format(const Slot& slot, std::string* out) {
+  if (!in_call) {
+    line_tag = slot.tag;
+    line_time_us = slot.time_us;
+    need_prefix = true;
+    // An empty span still gets its own line, as the old tracing did.
+    if (slot.len == 0) {
+      AppendPrefix(out);
+    }
+  }
+
+  if (slot.tag == nullptr) {
+    if (need_prefix && slot.len > 0) {
+      AppendPrefix(out);
+    }
+    out->append(reinterpret_cast<const char*>(slot.data), slot.len);
+  } else {
+    for (size_t i = 0; i < slot.len; ++i) {
+      if (need_prefix) {
+        AppendPrefix(out);
+      }
+      const uint8_t c = slot.data[i];
+      if (c == '\n') {
+        out->append("\n");
+        need_prefix = true;
+      } else {
+        out->append(escape[c], escape_len[c]);
+      }
+    }
+  }
+
+  in_call = slot.more;
+  if (!in_call && !need_prefix) {
+    out->append("\n");
+    need_prefix = true;
+  }
+}
+
+}  // namespace test_harness
@@ -0,0 +1,94 @@
+#ifndef SRC_TRACE_LOG_H
+#define SRC_TRACE_LOG_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace test_harness {
+
+/**
+ * Background writer for the INFO level transport traces.
+ *
+ * Callers copy raw bytes into a fixed ring of slots together with a timestamp
+ * and return; a consumer thread does the escaping and writes to stdout. The
+ * hot path never allocates or formats, it only blocks if the consumer falls a
+ * whole ring behind.
+ *
+ * Each line looks like:
+ *   [    1.234567] SPI_TX: \x00\x01hello
+ *
+ * Tags are stored by pointer so they must be string literals. */
+class TraceLog {
+ public:
+  static TraceLog& Get();
+
+  ~TraceLog();
+
+  /** Queues @len bytes to be printed escaped after "@tag: ". A '\n' in the
+   * data starts a new line with the same tag. */
+  void Bytes(const char* tag, const void* data, size_t len);
+  void Bytes(const char* tag, const std::string& data) {
+    Bytes(tag, data.data(), data.size());
+  }
+
+  /** Queues @text to be printed verbatim on its own line. */
+  void Text(const char* text);
+  /** Text() followed by Flush(), for errors which must not be lost if the
+   * process ends soon after. */
+  void Error(const char* text);
+
+  /** Blocks until everything queued so far has been written out. */
+  void Flush();
+
+ private:
+  static constexpr size_t kSlotCount = 512;
+  static constexpr size_t kSlotBytes = 240;
+
+  struct Slot {
+    int64_t time_us;
+    const char* tag;  // nullptr for Text().
+    uint16_t len;
+    bool more;        // The next slot holds the rest of the same call.
+    uint8_t data[kSlotBytes];
+  };
+
+  TraceLog();
+
+  void Push(const char* tag, const uint8_t* data, size_t len);
+  void Run();
+  void Format(const Slot& slot, std::string* out);
+  void AppendPrefix(std::string* out);
+
+  const std::chrono::steady_clock::time_point epoch;
+  char escape[256][5];
+  uint8_t escape_len[256];
+
+  // Keeps a span which needs several slots in one piece.
+  std::mutex producer_mutex;
+
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::condition_variable drained;
+  // Monotonic counters; the slot is the counter modulo kSlotCount.
+  uint64_t head;
+  uint64_t tail;
+  bool stopping;
+  Slot slots[kSlotCount];
+
+  // Consumer state.
+  bool in_call;
+  bool need_prefix;
+  const char* line_tag;
+  int64_t line_time_us;
+  std::thread worker;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_TRACE_LOG_H
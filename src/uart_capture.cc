@@ -0,0 +1,101 @@
+#include "src/uart_capture.h"
+
+#include <algorithm>
+#include <iostream>
+
+#ifdef ANDROID
+#define FLAGS_util_uart_capture_kb 0
+#else
+#include "gflags/gflags.h"
+
+DEFINE_int32(util_uart_capture_kb, 256,
+             "Size of the buffer holding recent UART output for failed tests; "
+             "0 disables the capture.");
+#endif  // ANDROID
+
+namespace test_harness {
+namespace {
+
+// Keeps the reports readable; the end of the output is the interesting part.
+constexpr size_t kMaxAttachedBytes = 16 * 1024;
+
+}  // namespace
+
+UartCapture& UartCapture::Get() {
+  static UartCapture capture;
+  return capture;
+}
+
+UartCapture::UartCapture()
+    : ring(FLAGS_util_uart_capture_kb > 0 ?
+           FLAGS_util_uart_capture_kb * 1024 : 0),
+      written(0) {}
+
+void UartCapture::Append(const char* data, size_t len) {
+  if (ring.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (len > ring.size()) {
+    written += len - ring.size();
+    data += len - ring.size();
+    len = ring.size();
+  }
+  const size_t offset = written % ring.size();
+  const size_t first = std::min(len, ring.size() - offset);
+  std::copy(data, data + first, ring.begin() + offset);
+  std::copy(data + first, data + len, ring.begin());
+  written += len;
+}
+
+uint64_t UartCapture::Mark() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return written;
+}
+
+std::string UartCapture::Since(uint64_t start, size_t max_len) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (ring.empty()) {
+    return "";
+  }
+  const uint64_t oldest = written > ring.size() ? written - ring.size() : 0;
+  start = std::max(start, oldest);
+  if (written - start > max_len) {
+    start = written - max_len;
+  }
+
+  std::string out;
+  out.reserve(written - start);
+  for (uint64_t i = start; i < written; ++i) {
+    const char c = ring[i % ring.size()];
+    if (c != '\r') {
+      out.push_back(c);
+    }
+  }
+  return out;
+}
+
+void UartCaptureListener::OnTestStart(const testing::TestInfo&) {
+  start = UartCapture::Get().Mark();
+}
+
+void UartCaptureListener::OnTestEnd(const testing::TestInfo& test_info) {
+  if (!test_info.result()->Failed() || !UartCapture::Get().Enabled()) {
+    return;
+  }
+  const std::string output = UartCapture::Get().Since(start,
+                                                      kMaxAttachedBytes);
+  if (output.empty()) {
+    return;
+  }
+  // The test is still current here, so the property is recorded against it.
+  testing::Test::RecordProperty("uart", output);
+  std::cout << "UART output during " << test_info.test_case_name() << "."
+            << test_info.name() << ":\n" << output;
+  if (output[output.size() - 1] != '\n') {
+    std::cout << "\n";
+  }
+  std::cout.flush();
+}
+
+}  // namespace test_harness
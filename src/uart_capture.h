@@ -0,0 +1,60 @@
+#ifndef SRC_UART_CAPTURE_H
+#define SRC_UART_CAPTURE_H
+
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace test_harness {
+
+/**
+ * Ring buffer holding the most recent Citadel console output. The UART is
+ * drained into it in the background while the transport is SPI, so the
+ * console of a failing test is available without rerunning with
+ * --util_print_uart. Positions are byte counts since the start of the
+ * program. */
+class UartCapture {
+ public:
+  static UartCapture& Get();
+
+  /** Whether --util_uart_capture_kb is non-zero. */
+  bool Enabled() const { return !ring.empty(); }
+
+  void Append(const char* data, size_t len);
+
+  /** The position the next byte will be written at. */
+  uint64_t Mark();
+
+  /** Up to the last @max_len bytes written since @start. Older bytes which
+   * have already been overwritten are skipped. */
+  std::string Since(uint64_t start, size_t max_len);
+
+ private:
+  UartCapture();
+
+  std::mutex mutex;
+  std::vector<char> ring;
+  uint64_t written;
+};
+
+/** Attaches the console output of each failed test to its result as the
+ * "uart" property, which ends up in the XML and JSON reports, and prints it
+ * after the failure. Passing tests only cost two Mark()s. */
+class UartCaptureListener : public testing::EmptyTestEventListener {
+ public:
+  UartCaptureListener() : start(0) {}
+
+  void OnTestStart(const testing::TestInfo& test_info) override;
+  void OnTestEnd(const testing::TestInfo& test_info) override;
+
+ private:
+  uint64_t start;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_UART_CAPTURE_H
@@ -1,6 +1,5 @@
 #include "src/util.h"
 
-#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -12,6 +11,14 @@
 #include <application.h>
 
 #include "nugget_tools.h"
+#include "probes.h"
+#include "time_accounting.h"
+#include "trace_events.h"
+#include "watchdog.h"
+#include "src/device_discovery.h"
+#include "src/low_power_sampler.h"
+#include "src/trace_log.h"
+#include "src/uart_capture.h"
 #include "nugget/app/protoapi/control.pb.h"
 #include "nugget/app/protoapi/header.pb.h"
 
@@ -22,12 +29,22 @@
 #ifdef ANDROID
 #define FLAGS_util_use_ahdlc false
 #define FLAGS_util_print_uart false
+#define FLAGS_util_low_power_stats_csv std::string()
+#define FLAGS_util_low_power_period_ms 10000
 #else
 #include "gflags/gflags.h"
 
 DEFINE_bool(util_use_ahdlc, false, "Use aHDLC over UART instead of SPI.");
 DEFINE_bool(util_print_uart, false, "Print the output of citadel UART.");
 DEFINE_string(util_verbosity, "ERROR", "One of SILENT, CRITICAL, ERROR, WARNING, or INFO.");
+DEFINE_string(util_low_power_stats_csv, "",
+              "Append a time series of the low power stats to this CSV file.");
+DEFINE_int32(util_low_power_period_ms, 10000,
+             "Low power stats sampling period. Sampling wakes the chip, so "
+             "keep this above the deep sleep timeout or the chip never "
+             "sleeps between tests.");
+DEFINE_int32(util_uart_wait_ms, 2000,
+             "How long to wait for the UltraDebug UART to appear.");
 #endif  // ANDROID
 
 using nugget::app::protoapi::APImessageID;
@@ -67,28 +84,14 @@ int GetVerbosityFromFlag() {
 
 #ifndef ANDROID
 string find_uart(int verbosity) {
-  constexpr char dir_path[] = "/dev/";
-  auto dir = opendir(dir_path);
-  if (!dir) {
-    return "";
-  }
-
-  string manual_serial_no = nugget_tools::GetCitadelUSBSerialNo();
-  const char prefix[] = "ttyUltraTarget_";
+  const string manual_serial_no = nugget_tools::GetCitadelUSBSerialNo();
 
-  string return_value = "";
-  if (manual_serial_no.empty()) {
-    const size_t prefix_length = sizeof(prefix) / sizeof(prefix[0]) - 1;
-    while (auto listing = readdir(dir)) {
-      // The following is always true so it is not checked:
-      // sizeof(listing->d_name) >= sizeof(prefix)
-      if (std::equal(prefix, prefix + prefix_length, listing->d_name)) {
-        return_value = string(dir_path) + listing->d_name;
-        break;
-      }
-    }
-  } else {
-    return_value = string(dir_path) + prefix + manual_serial_no;
+  // The board may still be re-enumerating after a reboot.
+  string return_value = DeviceDiscovery::Get().WaitForUart(
+      manual_serial_no, std::chrono::milliseconds(FLAGS_util_uart_wait_ms));
+  if (return_value.empty() && !manual_serial_no.empty()) {
+    // Let open() report what is wrong with it.
+    return_value = string("/dev/ttyUltraTarget_") + manual_serial_no;
   }
 
   if (verbosity >= TestHarness::VerbosityLevels::INFO) {
@@ -99,11 +102,44 @@ string find_uart(int verbosity) {
     }
   }
 
-  closedir(dir);
   return return_value;
 }
 #endif  // ANDROID
 
+#ifndef CONFIG_NO_UART
+// Collects bytes read one at a time so a whole frame reaches the trace log as
+// a single span.
+class TraceBuffer {
+ public:
+  TraceBuffer(const char* tag, bool enabled)
+      : tag(tag), enabled(enabled), len(0) {}
+  ~TraceBuffer() { Flush(); }
+
+  void Add(uint8_t value) {
+    if (!enabled) {
+      return;
+    }
+    if (len == sizeof(data)) {
+      Flush();
+    }
+    data[len++] = value;
+  }
+
+  void Flush() {
+    if (enabled && len > 0) {
+      TraceLog::Get().Bytes(tag, data, len);
+      len = 0;
+    }
+  }
+
+ private:
+  const char* tag;
+  bool enabled;
+  size_t len;
+  uint8_t data[PROTO_BUFFER_MAX_LEN * 2];
+};
+#endif  // CONFIG_NO_UART
+
 }  // namespace
 
 std::unique_ptr<TestHarness> TestHarness::MakeUnique() {
@@ -112,7 +148,8 @@ std::unique_ptr<TestHarness> TestHarness::MakeUnique() {
 
 TestHarness::TestHarness() : verbosity(GetVerbosityFromFlag()),
                              output_buffer(PROTO_BUFFER_MAX_LEN, 0),
-                             input_buffer(PROTO_BUFFER_MAX_LEN, 0), tty_fd(-1) {
+                             input_buffer(PROTO_BUFFER_MAX_LEN, 0), tty_fd(-1),
+                             stop_uart_worker(false) {
 #ifdef CONFIG_NO_UART
   Init(nullptr);
 #else
@@ -123,30 +160,44 @@ TestHarness::TestHarness() : verbosity(GetVerbosityFromFlag()),
 
 TestHarness::TestHarness(const char* path) :
     verbosity(ERROR), output_buffer(PROTO_BUFFER_MAX_LEN, 0),
-    input_buffer(PROTO_BUFFER_MAX_LEN, 0), tty_fd(-1) {
+    input_buffer(PROTO_BUFFER_MAX_LEN, 0), tty_fd(-1),
+    stop_uart_worker(false) {
   Init(path);
 }
 
 TestHarness::~TestHarness() {
+  // The sampler shares the client so it has to go first.
+  if (low_power_sampler) {
+    low_power_sampler->Stop();
+    low_power_sampler = nullptr;
+  }
+
 #ifndef CONFIG_NO_UART
   if (verbosity >= INFO) {
-    std::cout << "CLOSING TEST HARNESS" << std::endl;
+    TraceLog::Get().Text("CLOSING TEST HARNESS");
+  }
+  // The worker reads tty_fd, so it has to stop before the fd is closed.
+  if (print_uart_worker) {
+    stop_uart_worker = true;
+    print_uart_worker->join();
+    print_uart_worker = nullptr;
   }
   if (ttyState()) {
     auto temp = tty_fd;
     tty_fd = -1;
     close(temp);
   }
-  if (print_uart_worker) {
-    print_uart_worker->join();
-    print_uart_worker = nullptr;
-  }
 #endif  // CONFIG_NO_UART
 
   if (client) {
     client->Close();
     client = unique_ptr<nos::NuggetClientInterface >();
   }
+
+  // Make sure the traces are out before anything else hits stdout.
+  if (verbosity >= INFO || FLAGS_util_print_uart) {
+    TraceLog::Get().Flush();
+  }
 }
 
 bool TestHarness::ttyState() const {
@@ -170,31 +221,73 @@ void TestHarness::flushConsole() {
 }
 
 bool TestHarness::RebootNugget() {
+  std::lock_guard<std::mutex> lock(client_mutex);
+  OpenClient();
   return nugget_tools::RebootNugget(client.get());
 }
 
-void print_bin(std::ostream &out, uint8_t c) {
-  if (c == '\\') {
-    out << "\\\\";
-  } else if (isprint(c)) {
-    out << c;
-  } else if (c < 16) {
-    out << "\\x0" << std::hex << (uint32_t) c;
-  } else {
-    out << "\\x" << std::hex << (uint32_t) c;
+void TestHarness::OpenClient() {
+  if (client) {
+    return;
+  }
+
+  client = nugget_tools::MakeNuggetClient();
+  client->Open();
+  if (!client->IsOpen()) {
+    FatalError("Unable to connect");
+  }
+
+  // The sampler only attaches to harnesses which talk to the chip themselves
+  // so fixtures with their own client don't end up with a second connection.
+  if (!FLAGS_util_low_power_stats_csv.empty() && !low_power_sampler) {
+    low_power_sampler.reset(new LowPowerSampler(
+        this, FLAGS_util_low_power_stats_csv,
+        std::chrono::milliseconds(FLAGS_util_low_power_period_ms)));
+    if (!low_power_sampler->Start()) {
+      low_power_sampler = nullptr;
+    }
   }
 }
 
+uint32_t TestHarness::CallApp(uint32_t app_id, uint16_t param,
+                              const vector<uint8_t>& request,
+                              vector<uint8_t>* response) {
+  std::lock_guard<std::mutex> lock(client_mutex);
+  OpenClient();
+  return client->CallApp(app_id, param, request, response);
+}
+
+bool TestHarness::GetLowPowerStats(
+    struct nugget_app_low_power_stats* stats) {
+  std::lock_guard<std::mutex> lock(client_mutex);
+  OpenClient();
+  return nugget_tools::GetLowPowerStats(client.get(), stats);
+}
+
+bool TestHarness::CyclesSinceBoot(uint32_t* cycles) {
+  std::lock_guard<std::mutex> lock(client_mutex);
+  OpenClient();
+  return nugget_tools::CyclesSinceBoot(client.get(), cycles);
+}
+
 int TestHarness::SendData(const raw_message& msg) {
+  nugget_tools::ScopedTraceSpan trace(nugget_tools::TRACK_MESSAGES,
+                                      "SendData");
 #ifdef CONFIG_NO_UART
-  return SendSpi(msg);
+  const int code = SendSpi(msg);
 #else
-  return FLAGS_util_use_ahdlc ? SendAhdlc(msg) : SendSpi(msg);
+  const int code = FLAGS_util_use_ahdlc ? SendAhdlc(msg) : SendSpi(msg);
 #endif  // ANDROID
+  if (nugget_tools::TraceEnabled()) {
+    trace.args().Add("type", msg.type).Add("bytes", msg.data_len)
+        .Add("result", error_codes_name(code));
+  }
+  return code;
 }
 
 #ifndef CONFIG_NO_UART
 int TestHarness::SendAhdlc(const raw_message& msg) {
+  NOS_PROBE2(ahdlc_send, msg.type, msg.data_len);
   if (EncodeNewFrame(&encoder) != AHDLC_OK) {
     return TRANSPORT_ERROR;
   }
@@ -215,50 +308,46 @@ int TestHarness::SendAhdlc(const raw_message& msg) {
 #endif  // CONFIG_NO_UART
 
 int TestHarness::SendSpi(const raw_message& msg) {
-  if (!client) {
-    client = nugget_tools::MakeNuggetClient();
-    client->Open();
-    if (!client->IsOpen()) {
-      FatalError("Unable to connect");
-    }
-  }
-
   input_buffer.resize(msg.data_len + sizeof(msg.type));
   input_buffer[0] = msg.type >> 8;
   input_buffer[1] = (uint8_t) msg.type;
   std::copy(msg.data, msg.data + msg.data_len, input_buffer.begin() + 2);
+  return CallSpi(msg.type);
+}
 
+int TestHarness::CallSpi(uint16_t type) {
   if (verbosity >= INFO) {
-    std::cout << "SPI_TX: ";
-    for (char c : input_buffer) {
-      if (c == '\n') {
-        std::cout << "\nSPI_TX: ";
-      } else {
-        print_bin(std::cout, c);
-      }
-    }
-    std::cout << "\n";
-    std::cout.flush();
+    TraceLog::Get().Bytes("SPI_TX", input_buffer.data(), input_buffer.size());
   }
 
   output_buffer.resize(output_buffer.capacity());
-  return client->CallApp(APP_ID_PROTOBUF, msg.type, input_buffer,
-                                &output_buffer);
+  NOS_PROBE2(spi_send, type, input_buffer.size() - sizeof(type));
+  const uint32_t status = CallApp(APP_ID_PROTOBUF, type, input_buffer,
+                                  &output_buffer);
+  NOS_PROBE3(spi_send_done, type, status, output_buffer.size());
+  return status;
 }
 
 int TestHarness::SendOneofProto(uint16_t type, uint16_t subtype,
                                 const google::protobuf::Message& message) {
-  test_harness::raw_message msg;
-  msg.type = type;
   int msg_size = message.ByteSize();
   if (msg_size + 2 > (int) PROTO_BUFFER_MAX_LEN) {
     return OVERFLOW_ERROR;
   }
+  if (UsingSpi()) {
+    return SendOneofProtoSpi(type, subtype, message, msg_size);
+  }
+
+  test_harness::raw_message msg;
+  msg.type = type;
   msg.data[0] = subtype >> 8;
   msg.data[1] = (uint8_t) subtype;
 
   msg.data_len = (uint16_t) (msg_size + 2);
-  if (!message.SerializeToArray(msg.data + 2, msg_size)) {
+  // ByteSize() cached the sizes, so serialize without walking the message
+  // again.
+  if (message.SerializeWithCachedSizesToArray(msg.data + 2) !=
+      msg.data + msg.data_len) {
     return SERIALIZE_ERROR;
   }
 
@@ -266,6 +355,31 @@ int TestHarness::SendOneofProto(uint16_t type, uint16_t subtype,
   return return_value;
 }
 
+// Serializes straight into the SPI request, skipping the raw_message which
+// SendSpi() would copy from.
+int TestHarness::SendOneofProtoSpi(uint16_t type, uint16_t subtype,
+                                   const google::protobuf::Message& message,
+                                   int msg_size) {
+  nugget_tools::ScopedTraceSpan trace(nugget_tools::TRACK_MESSAGES,
+                                      "SendData");
+  input_buffer.resize(msg_size + 4);
+  input_buffer[0] = type >> 8;
+  input_buffer[1] = (uint8_t) type;
+  input_buffer[2] = subtype >> 8;
+  input_buffer[3] = (uint8_t) subtype;
+  if (message.SerializeWithCachedSizesToArray(input_buffer.data() + 4) !=
+      input_buffer.data() + input_buffer.size()) {
+    return SERIALIZE_ERROR;
+  }
+
+  const int code = CallSpi(type);
+  if (nugget_tools::TraceEnabled()) {
+    trace.args().Add("type", type).Add("bytes", msg_size + 2)
+        .Add("result", error_codes_name(code));
+  }
+  return code;
+}
+
 int TestHarness::SendProto(uint16_t type,
                            const google::protobuf::Message& message) {
   test_harness::raw_message msg;
@@ -275,7 +389,8 @@ int TestHarness::SendProto(uint16_t type,
     return OVERFLOW_ERROR;
   }
   msg.data_len = (uint16_t) msg_size;
-  if (!message.SerializeToArray(msg.data, msg.data_len)) {
+  if (message.SerializeWithCachedSizesToArray(msg.data) !=
+      msg.data + msg.data_len) {
     return SERIALIZE_ERROR;
   }
 
@@ -285,9 +400,10 @@ int TestHarness::SendProto(uint16_t type,
 
 #ifndef CONFIG_NO_UART
 int TestHarness::GetAhdlc(raw_message* msg, microseconds timeout) {
-  if (verbosity >= INFO) {
-    std::cout << "RX: ";
-  }
+  nugget_tools::ScopedTimeAccount account(nugget_tools::TIME_TRANSPORT);
+  // Frames are not console output, so they stay out of the capture.
+  std::lock_guard<std::mutex> console(console_mutex);
+  TraceBuffer trace("RX", verbosity >= INFO);
   size_t read_count = 0;
   while (true) {
     uint8_t read_value;
@@ -296,10 +412,7 @@ int TestHarness::GetAhdlc(raw_message* msg, microseconds timeout) {
       if (timeout >= microseconds(0) &&
          duration_cast<microseconds>(high_resolution_clock::now() - start) >
          microseconds(timeout)) {
-        if (verbosity >= INFO) {
-          std::cout << "\n";
-          std::cout.flush();
-        }
+        NOS_PROBE1(ahdlc_timeout, read_count);
         return TIMEOUT;
       }
     }
@@ -308,23 +421,16 @@ int TestHarness::GetAhdlc(raw_message* msg, microseconds timeout) {
     ahdlc_op_return return_value =
         DecodeFrameByte(&decoder, read_value);
 
-    if (verbosity >= INFO) {
-      if (read_value == '\n') {
-        std::cout << "\nRX: ";
-      } else {
-        print_bin(std::cout, read_value);
-      }
-      std::cout.flush();
-    }
+    trace.Add(read_value);
 
     if (read_count > 7) {
       if (return_value == AHDLC_COMPLETE ||
           decoder.decoder_state == DECODE_COMPLETE_BAD_CRC) {
         if (decoder.frame_info.buffer_index < 2) {
+          NOS_PROBE1(ahdlc_underflow, decoder.frame_info.buffer_index);
           if (verbosity >= ERROR) {
-            std::cout << "\n";
-            std::cout << "UNDERFLOW ERROR\n";
-            std::cout.flush();
+            trace.Flush();
+            TraceLog::Get().Error("UNDERFLOW ERROR");
           }
           return TRANSPORT_ERROR;
         }
@@ -335,31 +441,35 @@ int TestHarness::GetAhdlc(raw_message* msg, microseconds timeout) {
                   decoder.pdu_buffer + decoder.frame_info.buffer_index,
                   msg->data);
 
+        if (return_value == AHDLC_COMPLETE) {
+          NOS_PROBE2(ahdlc_frame, msg->type, msg->data_len);
+        } else {
+          NOS_PROBE1(ahdlc_bad_crc, msg->data_len);
+        }
         if (verbosity >= INFO) {
-          std::cout << "\n";
+          trace.Flush();
           if (return_value == AHDLC_COMPLETE) {
-            std::cout << "GOOD CRC\n";
+            TraceLog::Get().Text("GOOD CRC");
           } else {
-            std::cout << "BAD CRC\n";
+            TraceLog::Get().Text("BAD CRC");
           }
-          std::cout.flush();
         }
         return NO_ERROR;
       } else if (decoder.decoder_state == DECODE_COMPLETE_BAD_CRC) {
+        NOS_PROBE1(ahdlc_bad_crc, decoder.frame_info.buffer_index);
         if (verbosity >= ERROR) {
-          std::cout << "\n";
-          std::cout << "AHDLC BAD CRC\n";
-          std::cout.flush();
+          trace.Flush();
+          TraceLog::Get().Error("AHDLC BAD CRC");
         }
         return TRANSPORT_ERROR;
       } else if (decoder.frame_info.buffer_index >= PROTO_BUFFER_MAX_LEN) {
+        NOS_PROBE1(ahdlc_overflow, decoder.frame_info.buffer_index);
         if (AhdlcDecoderInit(&decoder, CRC16, NULL) != AHDLC_OK) {
           FatalError("AhdlcDecoderInit()");
         }
         if (verbosity >= ERROR) {
-          std::cout << "\n";
-          std::cout.flush();
-          std::cout << "OVERFLOW ERROR\n";
+          trace.Flush();
+          TraceLog::Get().Error("OVERFLOW ERROR");
         }
         return OVERFLOW_ERROR;
       }
@@ -369,22 +479,16 @@ int TestHarness::GetAhdlc(raw_message* msg, microseconds timeout) {
 #endif  // CONFIG_NO_UART
 
 int TestHarness::GetSpi(raw_message* msg, microseconds timeout) {
+  // The reply was collected by the CallApp in SendSpi(), which the watchdog
+  // bounds, so there is nothing left to wait for.
   if (timeout > microseconds(0)) {}  // Prevent unused parameter warning.
   if (output_buffer.size() < 2) {
     return GENERIC_ERROR;
   }
+  NOS_PROBE1(spi_receive, output_buffer.size());
 
   if (verbosity >= INFO) {
-    std::cout << "SPI_RX: ";
-    for (char c : output_buffer) {
-      if (c == '\n') {
-        std::cout << "\nSPI_RX: ";
-      } else {
-        print_bin(std::cout, c);
-      }
-    }
-    std::cout << "\n";
-    std::cout.flush();
+    TraceLog::Get().Bytes("SPI_RX", output_buffer.data(), output_buffer.size());
   }
 
   msg->type = (output_buffer[0] << 8) | output_buffer[1];
@@ -395,17 +499,79 @@ int TestHarness::GetSpi(raw_message* msg, microseconds timeout) {
 }
 
 int TestHarness::GetData(raw_message* msg, microseconds timeout) {
+  nugget_tools::ScopedTraceSpan trace(nugget_tools::TRACK_MESSAGES,
+                                      "GetData");
 #ifdef CONFIG_NO_UART
-  return GetSpi(msg, timeout);
+  const int code = GetSpi(msg, timeout);
 #else
-  return FLAGS_util_use_ahdlc ? GetAhdlc(msg, timeout) : GetSpi(msg, timeout);
+  const int code = FLAGS_util_use_ahdlc ? GetAhdlc(msg, timeout)
+                                        : GetSpi(msg, timeout);
 #endif  // CONFIG_NO_UART
+  if (nugget_tools::TraceEnabled()) {
+    trace.args().Add("result", error_codes_name(code));
+    if (code == NO_ERROR) {
+      trace.args().Add("type", msg->type).Add("bytes", msg->data_len);
+    }
+  }
+  return code;
+}
+
+int TestHarness::ReceiveReply(uint16_t* type, const uint8_t** data,
+                              size_t* len, microseconds timeout) {
+  if (!UsingSpi()) {
+    const int code = GetData(&reply, timeout);
+    *type = reply.type;
+    *data = reply.data;
+    *len = reply.data_len;
+    return code;
+  }
+
+  // As GetSpi(), but the reply stays in output_buffer.
+  nugget_tools::ScopedTraceSpan trace(nugget_tools::TRACK_MESSAGES,
+                                      "GetData");
+  int code = GENERIC_ERROR;
+  if (output_buffer.size() >= 2) {
+    NOS_PROBE1(spi_receive, output_buffer.size());
+    if (verbosity >= INFO) {
+      TraceLog::Get().Bytes("SPI_RX", output_buffer.data(),
+                            output_buffer.size());
+    }
+    *type = (output_buffer[0] << 8) | output_buffer[1];
+    *data = output_buffer.data() + 2;
+    *len = output_buffer.size() - 2;
+    code = NO_ERROR;
+  }
+  if (nugget_tools::TraceEnabled()) {
+    trace.args().Add("result", error_codes_name(code));
+    if (code == NO_ERROR) {
+      trace.args().Add("type", *type).Add("bytes", *len);
+    }
+  }
+  return code;
+}
+
+void TestHarness::ReleaseReply(int code, uint16_t type, const uint8_t* data,
+                               size_t len) {
+  // Only a reply Call() rejected is kept for LastReply().
+  if (code != NO_ERROR && data != reply.data) {
+    len = std::min(len, sizeof(reply.data));
+    reply.type = type;
+    reply.data_len = len;
+    std::copy(data, data + len, reply.data);
+  }
+  output_buffer.resize(0);
+}
+
+const raw_message& TestHarness::LastReply() const {
+  return reply;
 }
 
 void TestHarness::Init(const char* path) {
+  reply.type = 0;
+  reply.data_len = 0;
+
   if (verbosity >= INFO) {
-    std::cout << "init() start\n";
-    std::cout.flush();
+    TraceLog::Get().Text("init() start");
   }
 
 #ifndef CONFIG_NO_UART
@@ -469,23 +635,23 @@ void TestHarness::Init(const char* path) {
   // libnos SPI transport is initialized on first use for interoperability.
 
   if (verbosity >= INFO) {
-    std::cout << "init() finish\n";
-    std::cout.flush();
+    TraceLog::Get().Text("init() finish");
   }
 
-  if (FLAGS_util_print_uart) {
+  // In SPI mode the console is otherwise unused, so it is drained into the
+  // capture buffer for failed tests.
+  if (FLAGS_util_print_uart ||
+      (UsingSpi() && UartCapture::Get().Enabled() && ttyState())) {
     print_uart_worker = std::unique_ptr<std::thread>(new std::thread(
         [](TestHarness* harness){
           if (harness->getVerbosity() >= INFO) {
-            std::cout << "Citadel UART printing enabled!\n";
-            std::cout.flush();
+            TraceLog::Get().Text("Citadel UART printing enabled!");
           }
-          while(harness->ttyState()) {
+          while (harness->ttyState() && !harness->stop_uart_worker) {
             harness->PrintUntilClosed();
           }
           if (harness->getVerbosity() >= INFO) {
-            std::cout << "Citadel UART printing disabled!\n";
-            std::cout.flush();
+            TraceLog::Get().Text("Citadel UART printing disabled!");
           }
         }, this));
   }
@@ -498,30 +664,43 @@ bool TestHarness::UsingSpi() const {
 #ifndef CONFIG_NO_UART
 bool TestHarness::SwitchFromConsoleToProtoApi() {
   if (verbosity >= INFO) {
-    std::cout << "SwitchFromConsoleToProtoApi() start\n";
-    std::cout.flush();
+    TraceLog::Get().Text("SwitchFromConsoleToProtoApi() start");
   }
 
   if (!ttyState()) { return false; }
 
-  ReadUntil(BYTE_TIME * 1024);
+  // The fixed delays the console used to get are now only upper bounds.
+  ReadUntilPromptOrIdle(BYTE_TIME * 1024);
 
   BlockingWrite("version\n", 1);
 
-  ReadUntil(BYTE_TIME * 1024);
+  ReadUntilPromptOrIdle(BYTE_TIME * 1024);
 
   BlockingWrite("\n", 1);
 
-  while (ReadLineUntilBlock() != "> ") {}
+  // Only the prompt ends this wait, but don't spin forever on a console
+  // which never shows one.
+  const string prompt = "> ";
+  const string output = ReadUntilPromptOrIdle(BYTE_TIME * 16384,
+                                              BYTE_TIME * 16384, prompt);
+  if (output.size() < prompt.size() ||
+      output.compare(output.size() - prompt.size(), prompt.size(),
+                     prompt) != 0) {
+    if (verbosity >= ERROR) {
+      TraceLog::Get().Error("No console prompt");
+    }
+    return false;
+  }
 
   const char command[] = "protoapi uart on 1\n";
   BlockingWrite(command, sizeof(command) - 1);
 
-  ReadUntil(BYTE_TIME * 1024);
+  // Nothing marks the switch being done and the echo of the command comes
+  // before it, so keep the full delay here.
+  ReadUntilPromptOrIdle(BYTE_TIME * 1024, BYTE_TIME * 1024);
 
   if (verbosity >= INFO) {
-    std::cout << "SwitchFromConsoleToProtoApi() finish\n";
-    std::cout.flush();
+    TraceLog::Get().Text("SwitchFromConsoleToProtoApi() finish");
   }
 
   return true;
@@ -529,8 +708,7 @@ bool TestHarness::SwitchFromConsoleToProtoApi() {
 
 bool TestHarness::SwitchFromProtoApiToConsole(raw_message* out_msg) {
   if (verbosity >= INFO) {
-    std::cout << "SwitchFromProtoApiToConsole() start\n";
-    std::cout.flush();
+    TraceLog::Get().Text("SwitchFromProtoApiToConsole() start");
   }
 
   ControlRequest controlRequest;
@@ -554,21 +732,19 @@ bool TestHarness::SwitchFromProtoApiToConsole(raw_message* out_msg) {
     Notice message;
     message.ParseFromArray((char *) msg.data, msg.data_len);
     if (verbosity >= INFO) {
-      std::cout << message.DebugString() << std::endl;
+      TraceLog::Get().Text(message.DebugString().c_str());
     }
   } else {
     if (verbosity >= ERROR) {
-      std::cout << "Receive Error" << std::endl;
-      std::cout.flush();
+      TraceLog::Get().Error("Receive Error");
     }
     return false;
   }
 
-  ReadUntil(BYTE_TIME * 4096);
+  ReadUntilPromptOrIdle(BYTE_TIME * 4096, CONSOLE_IDLE_TIME, "> ");
 
   if (verbosity >= INFO) {
-    std::cout << "SwitchFromProtoApiToConsole() finish\n";
-    std::cout.flush();
+    TraceLog::Get().Text("SwitchFromProtoApiToConsole() finish");
   }
   if (out_msg) {
     *out_msg = std::move(msg);
@@ -578,21 +754,16 @@ bool TestHarness::SwitchFromProtoApiToConsole(raw_message* out_msg) {
 #endif  // CONFIG_NO_UART
 
 void TestHarness::BlockingWrite(const char* data, size_t len) {
+  nugget_tools::ScopedTimeAccount account(nugget_tools::TIME_TRANSPORT);
+  nugget_tools::ScopedDeadline deadline("UART write",
+                                        nugget_tools::CallDeadline());
   if (verbosity >= INFO) {
-    std::cout << "TX: ";
-    for (size_t i = 0; i < len; ++i) {
-      uint8_t value = data[i];
-      if (value == '\n') {
-        std::cout << "\nTX: ";
-      } else {
-        print_bin(std::cout, value);
-      }
-    }
-    std::cout << "\n";
-    std::cout.flush();
+    TraceLog::Get().Bytes("TX", data, len);
   }
 
+  NOS_PROBE1(uart_write, len);
   size_t loc = 0;
+  size_t retries = 0;
   while (loc < len) {
     errno = 0;
     int return_value = write(tty_fd, data + loc, len - loc);
@@ -603,30 +774,32 @@ void TestHarness::BlockingWrite(const char* data, size_t len) {
       if (errno != EWOULDBLOCK && errno != EAGAIN) {
         FatalError("write(tty_fd,...)");
       } else {
+        retries++;
         std::this_thread::sleep_for(BYTE_TIME);
       }
     } else {
       loc += return_value;
     }
   }
+  NOS_PROBE2(uart_write_done, len, retries);
 }
 
 string TestHarness::ReadLineUntilBlock() {
+  nugget_tools::ScopedTimeAccount account(nugget_tools::TIME_TRANSPORT);
   if (!ttyState()) {
     return "";
   }
+  std::lock_guard<std::mutex> console(console_mutex);
 
   string line = "";
   line.reserve(128);
   char read_value = ' ';
-  std::stringstream ss;
 
   auto last_success = high_resolution_clock::now();
   while (true) {
     errno = 0;
     while (read_value != '\n' && read(tty_fd, &read_value, 1) > 0) {
       last_success = high_resolution_clock::now();
-      print_bin(ss, read_value);
       line.append(1, read_value);
     }
     if (verbosity >= CRITICAL && errno != 0) {
@@ -646,13 +819,19 @@ string TestHarness::ReadLineUntilBlock() {
   }
 
   if (verbosity >= INFO && line.size() > 0) {
-    std::cout << "RX: " << ss.str() <<"\n";
-    std::cout.flush();
+    TraceLog::Get().Bytes("RX", line);
   }
+  if (nugget_tools::TraceEnabled() && line.size() > 0) {
+    nugget_tools::TraceInstant(
+        nugget_tools::TRACK_CONSOLE,
+        line.substr(0, line.find_last_not_of("\r\n") + 1));
+  }
+  CaptureForegroundRead(line);
   return line;
 }
 
 string TestHarness::ReadUntil(microseconds end) {
+  nugget_tools::ScopedTimeAccount account(nugget_tools::TIME_SLEEP);
 #ifdef CONFIG_NO_UART
   std::this_thread::sleep_for(end);
   return "";
@@ -660,10 +839,11 @@ string TestHarness::ReadUntil(microseconds end) {
   if (!ttyState()) {
     return "";
   }
+  std::lock_guard<std::mutex> console(console_mutex);
 
   char read_value = ' ';
-  bool first = true;
   std::stringstream ss;
+  TraceBuffer trace("RX", verbosity >= INFO);
 
   auto start = high_resolution_clock::now();
   while (duration_cast<microseconds>(high_resolution_clock::now() -
@@ -671,79 +851,137 @@ string TestHarness::ReadUntil(microseconds end) {
     errno = 0;
     while (read(tty_fd, &read_value, 1) > 0) {
       ss << read_value;
-      if (verbosity >= INFO) {
-        if (first) {
-          first = false;
-          std::cout << "RX: ";
-          print_bin(std::cout, read_value);
-        } else if (read_value == '\n') {
-          std::cout << "\n";
-          std::cout.flush();
-          std::cout << "RX: ";
-        } else {
-          print_bin(std::cout, read_value);
-        }
-      }
+      trace.Add(read_value);
     }
     if (verbosity >= CRITICAL && errno != 0) {
       perror("ERROR read()");
     }
+    trace.Flush();
 
     /* Wait for at least one bit time before checking read() again. */
     std::this_thread::sleep_for(BIT_TIME);
   }
-  if (verbosity >= INFO && !first) {
-    std::cout << "\n";
-    std::cout.flush();
-  }
 
+  CaptureForegroundRead(ss.str());
   return ss.str();
 #endif  // CONFIG_NO_UART
 }
 
-void TestHarness::PrintUntilClosed() {
+string TestHarness::ReadUntilPromptOrIdle(microseconds limit,
+                                          microseconds idle,
+                                          const string& prompt) {
+  nugget_tools::ScopedTimeAccount account(nugget_tools::TIME_SLEEP);
 #ifdef CONFIG_NO_UART
+  // There is no console to watch, so give the chip the whole limit as the
+  // fixed delays did.
+  if (idle > microseconds(0) || !prompt.empty()) {}
+  std::this_thread::sleep_for(limit);
+  return "";
 #else
   if (!ttyState()) {
-    return;
+    return "";
   }
+  std::lock_guard<std::mutex> console(console_mutex);
 
   char read_value = ' ';
-  bool first = true;
-  std::stringstream ss("UART: ");
-
-  while (ttyState()) {
+  string output;
+  size_t line_start = 0;
+  TraceBuffer trace("RX", verbosity >= INFO);
+
+  const auto start = high_resolution_clock::now();
+  // The idle clock only starts once the console has said something, so a
+  // slow chip still gets the whole limit to start answering.
+  bool heard = false;
+  auto last_read = start;
+  while (true) {
     errno = 0;
+    bool got_data = false;
     while (read(tty_fd, &read_value, 1) > 0) {
-      first = false;
-      if (read_value == '\r')
-        continue;
+      output.append(1, read_value);
+      trace.Add(read_value);
       if (read_value == '\n') {
-        ss << "\n";
-        std::cout.flush();
-        std::cout << ss.str();
-        std::cout.flush();
-        ss.str("");
-        ss << "UART: ";
-      } else {
-        print_bin(ss, read_value);
+        line_start = output.size();
       }
+      got_data = true;
     }
-    if (verbosity >= CRITICAL && errno != 0 && errno != EAGAIN) {
-      if (errno != EBADF) {
-        perror("ERROR read()");
+    if (verbosity >= CRITICAL && errno != 0) {
+      perror("ERROR read()");
+    }
+    trace.Flush();
+
+    const auto now = high_resolution_clock::now();
+    if (got_data) {
+      heard = true;
+      last_read = now;
+      if (!prompt.empty() && output.size() - line_start == prompt.size() &&
+          output.compare(line_start, prompt.size(), prompt) == 0) {
+        break;
       }
+    }
+    if ((heard && duration_cast<microseconds>(now - last_read) >= idle) ||
+        duration_cast<microseconds>(now - start) >= limit) {
       break;
     }
 
     /* Wait for at least one bit time before checking read() again. */
     std::this_thread::sleep_for(BIT_TIME);
   }
-  if (!first) {
-    ss << "\n";
-    std::cout.flush();
-    std::cout << ss.str();
-    std::cout.flush();
+
+  CaptureForegroundRead(output);
+  return output;
+#endif  // CONFIG_NO_UART
+}
+
+void TestHarness::CaptureForegroundRead(const string& data) {
+  if (print_uart_worker && !data.empty()) {
+    UartCapture::Get().Append(data.data(), data.size());
+  }
+}
+
+void TestHarness::PrintUntilClosed() {
+#ifdef CONFIG_NO_UART
+#else
+  if (!ttyState()) {
+    return;
+  }
+
+  char buffer[256];
+  TraceBuffer trace("UART", FLAGS_util_print_uart);
+  const bool trace_lines = nugget_tools::TraceEnabled();
+  string line;
+
+  while (ttyState() && !stop_uart_worker) {
+    std::unique_lock<std::mutex> console(console_mutex);
+    errno = 0;
+    ssize_t len;
+    while ((len = read(tty_fd, buffer, sizeof(buffer))) > 0) {
+      UartCapture::Get().Append(buffer, len);
+      for (ssize_t i = 0; i < len; ++i) {
+        if (buffer[i] == '\r')
+          continue;
+        trace.Add(buffer[i]);
+        if (buffer[i] == '\n') {
+          trace.Flush();
+          if (trace_lines) {
+            nugget_tools::TraceInstant(nugget_tools::TRACK_CONSOLE, line);
+            line.clear();
+          }
+        } else if (trace_lines) {
+          line.push_back(buffer[i]);
+        }
+      }
+    }
+    if (verbosity >= CRITICAL && errno != 0 && errno != EAGAIN) {
+      if (errno != EBADF) {
+        perror("ERROR read()");
+      }
+      break;
+    }
+    console.unlock();
+
+    /* The tty buffers far more than this, so nothing is lost by waiting a
+     * few bytes' time rather than spinning. */
+    std::this_thread::sleep_for(BYTE_TIME * 16);
   }
 #endif  // CONFIG_NO_UART
 }
@@ -768,6 +1006,12 @@ const char* error_codes_name(int code) {
       return "OVERFLOW_ERROR";
     case error_codes::SERIALIZE_ERROR:
       return "SERIALIZE_ERROR";
+    case error_codes::UNEXPECTED_TYPE:
+      return "UNEXPECTED_TYPE";
+    case error_codes::UNEXPECTED_SUBTYPE:
+      return "UNEXPECTED_SUBTYPE";
+    case error_codes::PARSE_ERROR:
+      return "PARSE_ERROR";
     default:
       return "unknown";
   }
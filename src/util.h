@@ -1,9 +1,11 @@
 #ifndef SRC_UTIL_H
 #define SRC_UTIL_H
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -33,6 +35,8 @@ const auto BIT_TIME = std::chrono::microseconds(10000 / 1152);
 /** The approximate time it takes to transmit one byte over UART at 115200
  * baud. */
 const auto BYTE_TIME = std::chrono::microseconds(80000 / 1152);
+/** How long the console has to stay quiet before it is considered done. */
+const auto CONSOLE_IDLE_TIME = BYTE_TIME * 256;
 
 const size_t PROTO_BUFFER_MAX_LEN = 512;
 
@@ -43,10 +47,19 @@ enum error_codes : int {
   TRANSPORT_ERROR = 3,
   OVERFLOW_ERROR = 4,
   SERIALIZE_ERROR = 5,
+  UNEXPECTED_TYPE = 6,
+  UNEXPECTED_SUBTYPE = 7,
+  PARSE_ERROR = 8,
 };
 
 const char* error_codes_name(int code);
 
+class LowPowerSampler;
+
+/** Maps a TESTING_API_CALL request to its result; see src/protoapi_call.h. */
+template <typename Request>
+struct TestCall;
+
 struct raw_message {
   uint16_t type;  // The "magic number" used to identify the contents of data[].
   uint16_t data_len;  // How much data is in the buffer data[].
@@ -83,10 +96,26 @@ class TestHarness {
   void flushConsole();
   /** Reads from tty until the specified duration has passed. */
   string ReadUntil(std::chrono::microseconds end);
+  /** Reads from tty until @prompt is the whole of the current line, nothing
+   * has arrived for @idle since the first byte, or @limit has passed,
+   * whichever comes first. With an empty @prompt only the idle and limit
+   * checks apply. Without a UART this just sleeps for @limit. */
+  string ReadUntilPromptOrIdle(std::chrono::microseconds limit,
+                               std::chrono::microseconds idle =
+                                   CONSOLE_IDLE_TIME,
+                               const string& prompt = "");
+  /** Prints the console until the tty is closed or the worker is stopped. */
   void PrintUntilClosed();
 
   bool RebootNugget();
 
+  /** Calls into an app over the libnos client, opening it on first use. The
+   * client is shared with the low power sampler so calls are serialized. */
+  uint32_t CallApp(uint32_t app_id, uint16_t param,
+                   const vector<uint8_t>& request, vector<uint8_t>* response);
+  bool GetLowPowerStats(struct nugget_app_low_power_stats* stats);
+  bool CyclesSinceBoot(uint32_t* cycles);
+
   int SendData(const raw_message& msg);
   int SendOneofProto(uint16_t type, uint16_t subtype,
                      const google::protobuf::Message& message);
@@ -94,6 +123,20 @@ class TestHarness {
 
   int GetData(raw_message* msg, std::chrono::microseconds timeout);
 
+  /** Sends @request as a TESTING_API_CALL and parses the reply into @result,
+   * which may be reused between calls. The oneof cases are picked at compile
+   * time from the request type. Defined in src/protoapi_call.h.
+   *
+   * @return an error_codes value. On UNEXPECTED_TYPE or UNEXPECTED_SUBTYPE
+   * the reply is left in LastReply(). */
+  template <typename Request>
+  int Call(const Request& request,
+           typename TestCall<Request>::Result* result,
+           std::chrono::microseconds timeout = 4096 * BYTE_TIME);
+
+  /** The reply to the last Call() which failed after receiving one. */
+  const raw_message& LastReply() const;
+
   bool UsingSpi() const;
 
 #ifndef CONFIG_NO_UART
@@ -130,11 +173,38 @@ class TestHarness {
   int tty_fd;
 
   // Needed for libnos / SPI.
+  std::mutex client_mutex;
   unique_ptr<nos::NuggetClientInterface> client;
+  /** Opens the libnos client if needed. client_mutex must be held. */
+  void OpenClient();
   int SendSpi(const raw_message& msg);
+  /** Sends input_buffer, which already starts with @type. */
+  int CallSpi(uint16_t type);
   int GetSpi(raw_message* msg, std::chrono::microseconds timeout);
+  int SendOneofProtoSpi(uint16_t type, uint16_t subtype,
+                        const google::protobuf::Message& message,
+                        int msg_size);
+
+  /** Receives the reply for Call() without copying it out of the transport
+   * buffer. @data stays valid until ReleaseReply(). */
+  int ReceiveReply(uint16_t* type, const uint8_t** data, size_t* len,
+                   std::chrono::microseconds timeout);
+  /** Keeps the reply in LastReply() if @code is an error. */
+  void ReleaseReply(int code, uint16_t type, const uint8_t* data, size_t len);
+
+  // Over AHDLC Call() receives into this rather than the stack.
+  raw_message reply;
 
   std::unique_ptr<std::thread> print_uart_worker;
+  std::atomic<bool> stop_uart_worker;
+  /** Held by the UART worker while it reads and by the foreground console
+   * reads for their whole wait, so the worker can't take their bytes. */
+  std::mutex console_mutex;
+  /** Adds what a foreground read took to the capture the worker would have
+   * put it in. */
+  void CaptureForegroundRead(const string& data);
+  // Started with the client when --util_low_power_stats_csv is set.
+  std::unique_ptr<LowPowerSampler> low_power_sampler;
 };
 
 void FatalError(const string& msg);
@@ -1,11 +1,15 @@
 
 #include <memory>
 #include <random>
+#include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "avb_tools.h"
 #include "nugget_tools.h"
 #include "nugget/app/weaver/weaver.pb.h"
+#include "src/assertions.h"
+#include "src/concurrent_harness.h"
 #include "util.h"
 #include "Weaver.client.h"
 
@@ -16,6 +20,7 @@
 using std::cout;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 using namespace nugget::app::weaver;
 
@@ -45,6 +50,15 @@ class WeaverTest: public testing::Test {
 
   void activateThrottle(uint32_t slot, const uint8_t *key,
                         const uint8_t *wrong_key, uint32_t throttle_sec);
+
+  // Reused by the helpers so the sweeps don't allocate fresh messages for
+  // every call; Clear() keeps the capacity of the string fields.
+  WriteRequest write_request;
+  WriteResponse write_response;
+  ReadRequest read_request;
+  ReadResponse read_response;
+  EraseValueRequest erase_request;
+  EraseValueResponse erase_response;
  public:
   static constexpr size_t KEY_SIZE = 16;
   static constexpr size_t VALUE_SIZE = 16;
@@ -84,55 +98,48 @@ void WeaverTest::TearDownTestCase() {
 
 void WeaverTest::testWrite(const string& msg, uint32_t slot, const uint8_t *key,
                            const uint8_t *value) {
-  WriteRequest request;
-  WriteResponse response;
-  request.set_slot(slot);
-  request.set_key(key, KEY_SIZE);
-  request.set_value(value, VALUE_SIZE);
+  write_request.Clear();
+  write_request.set_slot(slot);
+  write_request.set_key(key, KEY_SIZE);
+  write_request.set_value(value, VALUE_SIZE);
 
   Weaver service(*client);
-  ASSERT_NO_ERROR(service.Write(request, &response), msg);
+  ASSERT_NO_ERROR(service.Write(write_request, &write_response), msg);
 }
 
 void WeaverTest::testRead(const string& msg, uint32_t slot, const uint8_t *key,
                           const uint8_t *value) {
-  ReadRequest request;
-  ReadResponse response;
-  request.set_slot(slot);
-  request.set_key(key, KEY_SIZE);
+  read_request.Clear();
+  read_request.set_slot(slot);
+  read_request.set_key(key, KEY_SIZE);
 
   Weaver service(*client);
-  ASSERT_NO_ERROR(service.Read(request, &response), msg);
-  ASSERT_EQ(response.error(), ReadResponse::NONE) << msg;
-  ASSERT_EQ(response.throttle_msec(), 0u) << msg;
-  auto response_value = response.value();
-  for (size_t x = 0; x < KEY_SIZE; ++x) {
-    ASSERT_EQ(response_value[x], value[x]) << "Inconsistency at index " << x
-                                           <<" " << msg;
-  }
+  ASSERT_NO_ERROR(service.Read(read_request, &read_response), msg);
+  ASSERT_EQ(read_response.error(), ReadResponse::NONE) << msg;
+  ASSERT_EQ(read_response.throttle_msec(), 0u) << msg;
+  ASSERT_EQ(read_response.value().size(), (size_t) VALUE_SIZE) << msg;
+  ASSERT_BUFFER_EQ(value, read_response.value().data(), VALUE_SIZE) << msg;
 }
 
 void WeaverTest::testEraseValue(const string& msg, uint32_t slot) {
-  EraseValueRequest request;
-  EraseValueResponse response;
-  request.set_slot(slot);
+  erase_request.Clear();
+  erase_request.set_slot(slot);
 
   Weaver service(*client);
-  ASSERT_NO_ERROR(service.EraseValue(request, &response), msg);
+  ASSERT_NO_ERROR(service.EraseValue(erase_request, &erase_response), msg);
 }
 
 void WeaverTest::testReadWrongKey(const string& msg, uint32_t slot,
                                   const uint8_t *key, uint32_t throttle_sec) {
-  ReadRequest request;
-  ReadResponse response;
-  request.set_slot(slot);
-  request.set_key(key, KEY_SIZE);
+  read_request.Clear();
+  read_request.set_slot(slot);
+  read_request.set_key(key, KEY_SIZE);
 
   Weaver service(*client);
-  ASSERT_NO_ERROR(service.Read(request, &response), msg);
-  ASSERT_EQ(response.error(), ReadResponse::WRONG_KEY) << msg;
-  ASSERT_EQ(response.throttle_msec(), throttle_sec * 1000) << msg;
-  auto response_value = response.value();
+  ASSERT_NO_ERROR(service.Read(read_request, &read_response), msg);
+  ASSERT_EQ(read_response.error(), ReadResponse::WRONG_KEY) << msg;
+  ASSERT_EQ(read_response.throttle_msec(), throttle_sec * 1000) << msg;
+  const string& response_value = read_response.value();
   for (size_t x = 0; x < response_value.size(); ++x) {
     ASSERT_EQ(response_value[x], 0) << "Inconsistency at index " << x
                                     <<" " << msg;
@@ -141,17 +148,16 @@ void WeaverTest::testReadWrongKey(const string& msg, uint32_t slot,
 
 void WeaverTest::testReadThrottle(const string& msg, uint32_t slot,
                                   const uint8_t *key, uint32_t throttle_sec) {
-  ReadRequest request;
-  ReadResponse response;
-  request.set_slot(slot);
-  request.set_key(key, KEY_SIZE);
+  read_request.Clear();
+  read_request.set_slot(slot);
+  read_request.set_key(key, KEY_SIZE);
 
   Weaver service(*client);
-  ASSERT_NO_ERROR(service.Read(request, &response), msg);
-  ASSERT_EQ(response.error(), ReadResponse::THROTTLE) << msg;
-  ASSERT_NE(response.throttle_msec(), 0u) << msg;
-  ASSERT_LE(response.throttle_msec(), throttle_sec * 1000) << msg;
-  auto response_value = response.value();
+  ASSERT_NO_ERROR(service.Read(read_request, &read_response), msg);
+  ASSERT_EQ(read_response.error(), ReadResponse::THROTTLE) << msg;
+  ASSERT_NE(read_response.throttle_msec(), 0u) << msg;
+  ASSERT_LE(read_response.throttle_msec(), throttle_sec * 1000) << msg;
+  const string& response_value = read_response.value();
   for (size_t x = 0; x < response_value.size(); ++x) {
     ASSERT_EQ(response_value[x], 0) << "Inconsistency at index " << x
                                     <<" " << msg;
@@ -337,4 +343,70 @@ TEST_F(WeaverTest, WipeUserDataWriteSlot0ReadSlot1) {
   testRead(__STAMP__, 1, TEST_KEY, ZERO_VALUE);
 }
 
+TEST_F(WeaverTest, ConcurrentSlots) {
+  const size_t callers = 4;
+  const size_t rounds = 8;
+
+  // Each caller has its own context and slot; the values are checked here
+  // rather than on the device so a mixed up reply shows as a wrong value.
+  test_harness::ConcurrentTestHarness concurrent(uart_printer.get(),
+                                                 client.get());
+  vector<unique_ptr<test_harness::ConcurrentTestHarness::Context>> contexts;
+  for (size_t i = 0; i < callers; ++i) {
+    contexts.push_back(concurrent.NewContext("caller " + std::to_string(i)));
+  }
+
+  vector<string> failures(callers);
+  auto work = [&](size_t caller) {
+    const uint32_t caller_slot = (WeaverTest::slot + caller) & SLOT_MASK;
+    Weaver service(*contexts[caller]);
+    WriteRequest write;
+    WriteResponse written;
+    ReadRequest read;
+    ReadResponse response;
+    for (size_t round = 0; round < rounds; ++round) {
+      uint8_t value[VALUE_SIZE];
+      for (size_t x = 0; x < VALUE_SIZE; ++x) {
+        value[x] = caller * rounds + round + x;
+      }
+
+      write.set_slot(caller_slot);
+      write.set_key(TEST_KEY, KEY_SIZE);
+      write.set_value(value, VALUE_SIZE);
+      if (service.Write(write, &written) != APP_SUCCESS) {
+        failures[caller] = "write failed in round " + std::to_string(round);
+        return;
+      }
+
+      read.set_slot(caller_slot);
+      read.set_key(TEST_KEY, KEY_SIZE);
+      if (service.Read(read, &response) != APP_SUCCESS ||
+          response.error() != ReadResponse::NONE) {
+        failures[caller] = "read failed in round " + std::to_string(round);
+        return;
+      }
+      if (response.value() !=
+          string(reinterpret_cast<const char *>(value), VALUE_SIZE)) {
+        failures[caller] = "wrong value in round " + std::to_string(round);
+        return;
+      }
+    }
+  };
+
+  vector<std::thread> threads;
+  for (size_t i = 0; i < callers; ++i) {
+    threads.emplace_back(work, i);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < callers; ++i) {
+    EXPECT_EQ(failures[i], "") << contexts[i]->name();
+    EXPECT_EQ(contexts[i]->stats().calls, 2 * rounds)
+        << contexts[i]->name();
+  }
+  test_harness::ConcurrentTestHarness::PrintStats(contexts);
+}
+
 }  // namespace
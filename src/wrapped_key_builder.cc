@@ -0,0 +1,265 @@
+#include "src/wrapped_key_builder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "src/blob.h"
+
+#include "openssl/bn.h"
+#include "openssl/ec_key.h"
+#include "openssl/evp.h"
+#include "openssl/nid.h"
+#include "openssl/rand.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
+
+using std::string;
+using std::unique_ptr;
+
+using namespace nugget::app::keymaster;
+
+namespace test_harness {
+namespace {
+
+constexpr size_t kTransportKeySize = 32;
+constexpr size_t kIvSize = 12;
+constexpr size_t kTagSize = 16;
+
+string RandomBytes(size_t size) {
+  string bytes(size, '\0');
+  RAND_bytes(reinterpret_cast<uint8_t *>(&bytes[0]), size);
+  return bytes;
+}
+
+BIGNUM *LittleEndianToBignum(const uint8_t *bytes, size_t size) {
+  string big_endian(reinterpret_cast<const char *>(bytes), size);
+  std::reverse(big_endian.begin(), big_endian.end());
+  return BN_bin2bn(reinterpret_cast<const uint8_t *>(big_endian.data()),
+                   big_endian.size(), nullptr);
+}
+
+// Just enough DER to encode a KeyDescription.
+string DerLength(size_t length) {
+  if (length < 0x80) {
+    return string(1, length);
+  }
+  string bytes;
+  for (; length; length >>= 8) {
+    bytes.insert(bytes.begin(), length & 0xff);
+  }
+  return string(1, 0x80 | bytes.size()) + bytes;
+}
+
+string DerTagged(uint8_t tag, const string& contents) {
+  return string(1, tag) + DerLength(contents.size()) + contents;
+}
+
+string DerInteger(uint64_t value) {
+  string bytes;
+  do {
+    bytes.insert(bytes.begin(), value & 0xff);
+    value >>= 8;
+  } while (value);
+  if (bytes[0] & 0x80) {
+    bytes.insert(bytes.begin(), '\0');
+  }
+  return DerTagged(0x02, bytes);
+}
+
+// KeyDescription ::= SEQUENCE {
+//   keyFormat INTEGER,
+//   keyParams AuthorizationList,
+// }
+// with an empty purpose set, the algorithm, the key size and the curve for EC.
+string KeyDescription(const WrappedKeySpec& spec) {
+  string params = DerTagged(0xa1, DerTagged(0x31, "")) +
+      DerTagged(0xa2, DerInteger(spec.algorithm)) +
+      DerTagged(0xa3, DerInteger(spec.key_size));
+  if (spec.algorithm == Algorithm::EC) {
+    params += DerTagged(0xaa, DerInteger(
+        spec.key_size == 224 ? EcCurve::P_224 : EcCurve::P_256));
+  }
+  return DerTagged(0x30, DerInteger(spec.format) + DerTagged(0x30, params));
+}
+
+bool AesGcmEncrypt(const string& key, const string& iv, const string& aad,
+                   const string& plaintext, string *ciphertext, string *tag) {
+  unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx(
+      EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+  int len;
+  ciphertext->resize(plaintext.size());
+  tag->resize(kTagSize);
+  return ctx &&
+      EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr,
+                         nullptr) &&
+      EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, iv.size(),
+                          nullptr) &&
+      EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr,
+                         reinterpret_cast<const uint8_t *>(key.data()),
+                         reinterpret_cast<const uint8_t *>(iv.data())) &&
+      EVP_EncryptUpdate(ctx.get(), nullptr, &len,
+                        reinterpret_cast<const uint8_t *>(aad.data()),
+                        aad.size()) &&
+      EVP_EncryptUpdate(ctx.get(),
+                        reinterpret_cast<uint8_t *>(&(*ciphertext)[0]), &len,
+                        reinterpret_cast<const uint8_t *>(plaintext.data()),
+                        plaintext.size()) &&
+      EVP_EncryptFinal_ex(ctx.get(), nullptr, &len) &&
+      EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, kTagSize,
+                          &(*tag)[0]);
+}
+
+}  // namespace
+
+WrappedKeySpec RandomAesKeySpec(uint32_t key_size) {
+  return WrappedKeySpec{Algorithm::AES, KeyFormat::RAW, key_size,
+                        RandomBytes(key_size / 8), string()};
+}
+
+WrappedKeySpec RandomHmacKeySpec(uint32_t key_size) {
+  return WrappedKeySpec{Algorithm::HMAC, KeyFormat::RAW, key_size,
+                        RandomBytes(key_size / 8), string()};
+}
+
+WrappedKeySpec RandomEcKeySpec(uint32_t key_size) {
+  WrappedKeySpec spec{Algorithm::EC, KeyFormat::PKCS8, key_size, string(),
+                      string()};
+  unique_ptr<EC_KEY, decltype(&EC_KEY_free)> ec(
+      EC_KEY_new_by_curve_name(key_size == 224 ? NID_secp224r1
+                                               : NID_X9_62_prime256v1),
+      EC_KEY_free);
+  unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> pkey(EVP_PKEY_new(),
+                                                     EVP_PKEY_free);
+  if (!ec || !pkey || !EC_KEY_generate_key(ec.get()) ||
+      !EVP_PKEY_set1_EC_KEY(pkey.get(), ec.get())) {
+    return spec;
+  }
+  unique_ptr<PKCS8_PRIV_KEY_INFO, decltype(&PKCS8_PRIV_KEY_INFO_free)> pkcs8(
+      EVP_PKEY2PKCS8(pkey.get()), PKCS8_PRIV_KEY_INFO_free);
+  uint8_t *der = nullptr;
+  const int der_len = pkcs8 ? i2d_PKCS8_PRIV_KEY_INFO(pkcs8.get(), &der) : -1;
+  if (der_len > 0) {
+    spec.key_material.assign(reinterpret_cast<char *>(der), der_len);
+  }
+  OPENSSL_free(der);
+  return spec;
+}
+
+WrappedKeyBuilder::WrappedKeyBuilder(const uint8_t *n, const uint8_t *d,
+                                     size_t size, uint32_t e)
+    : rsa(RSA_new()) {
+  BIGNUM *bn_e = BN_new();
+  BN_set_word(bn_e, e);
+  RSA_set0_key(rsa, LittleEndianToBignum(n, size),
+               bn_e, LittleEndianToBignum(d, size));
+
+  struct km_blob blob;
+  memset(&blob, 0, sizeof(blob));
+  blob.b.algorithm = BLOB_RSA;
+  blob.b.key.rsa.rsa.e = e;
+  blob.b.key.rsa.rsa.N.dmax = size / sizeof(uint32_t);
+  blob.b.key.rsa.rsa.d.dmax = size / sizeof(uint32_t);
+  memcpy(&blob.b.key.rsa.N_bytes, n,
+         std::min(size, sizeof(blob.b.key.rsa.N_bytes)));
+  memcpy(&blob.b.key.rsa.d_bytes, d,
+         std::min(size, sizeof(blob.b.key.rsa.d_bytes)));
+
+  blob.b.tee_enforced.params[0].tag = Tag::PADDING;
+  blob.b.tee_enforced.params[0].integer = PaddingMode::PADDING_RSA_OAEP;
+  blob.b.tee_enforced.params_count++;
+  blob.b.tee_enforced.params[1].tag = Tag::PURPOSE;
+  blob.b.tee_enforced.params[1].integer = KeyPurpose::WRAP_KEY;
+  blob.b.tee_enforced.params_count++;
+  SHA256(reinterpret_cast<const uint8_t *>(&blob),
+         sizeof(struct km_blob) - SHA256_DIGEST_LENGTH,
+         reinterpret_cast<uint8_t *>(&blob.hmac));
+  wrapping_key_blob.assign(reinterpret_cast<const char *>(&blob),
+                           sizeof(blob));
+}
+
+WrappedKeyBuilder::~WrappedKeyBuilder() {
+  RSA_free(rsa);
+}
+
+bool WrappedKeyBuilder::Build(const WrappedKeySpec& spec,
+                              ImportWrappedKeyRequest *request) const {
+  const string masking_key = spec.masking_key.empty()
+      ? string(kTransportKeySize, '\0') : spec.masking_key;
+  if (spec.key_material.empty() || masking_key.size() != kTransportKeySize) {
+    return false;
+  }
+
+  const string transport_key = RandomBytes(kTransportKeySize);
+  string envelope(RSA_size(rsa), '\0');
+  const int envelope_len = RSA_public_encrypt(
+      transport_key.size(),
+      reinterpret_cast<const uint8_t *>(transport_key.data()),
+      reinterpret_cast<uint8_t *>(&envelope[0]), rsa, RSA_PKCS1_OAEP_PADDING);
+  if (envelope_len <= 0) {
+    return false;
+  }
+  envelope.resize(envelope_len);
+
+  string gcm_key = transport_key;
+  for (size_t i = 0; i < gcm_key.size(); i++) {
+    gcm_key[i] ^= masking_key[i];
+  }
+  const string iv = RandomBytes(kIvSize);
+  const string aad = KeyDescription(spec);
+  string encrypted_key;
+  string tag;
+  if (!AesGcmEncrypt(gcm_key, iv, aad, spec.key_material, &encrypted_key,
+                     &tag)) {
+    return false;
+  }
+
+  request->Clear();
+  request->set_key_format(spec.format);
+  KeyParameter *param = request->mutable_params()->add_params();
+  param->set_tag(Tag::ALGORITHM);
+  param->set_integer((uint32_t)spec.algorithm);
+  request->set_rsa_envelope(envelope);
+  request->set_initialization_vector(iv);
+  request->set_encrypted_import_key(encrypted_key);
+  request->set_aad(aad);
+  request->set_gcm_tag(tag);
+  request->mutable_wrapping_key_blob()->set_blob(wrapping_key_blob);
+  request->set_masking_key(masking_key);
+  return true;
+}
+
+bool WrappedKeyBuilder::BuildAll(
+    const std::vector<WrappedKeySpec>& specs,
+    std::vector<ImportWrappedKeyRequest> *requests, size_t threads) const {
+  requests->resize(specs.size());
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, specs.size());
+
+  // EC and RSA work varies per spec, so workers take the next spec rather
+  // than a fixed slice.
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+  auto work = [&]() {
+    for (size_t i; (i = next++) < specs.size();) {
+      if (!Build(specs[i], &(*requests)[i])) {
+        ok = false;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return ok;
+}
+
+}  // namespace test_harness
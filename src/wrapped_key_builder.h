@@ -0,0 +1,71 @@
+#ifndef SRC_WRAPPED_KEY_BUILDER_H
+#define SRC_WRAPPED_KEY_BUILDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nugget/app/keymaster/keymaster.pb.h"
+#include "nugget/app/keymaster/keymaster_defs.pb.h"
+#include "nugget/app/keymaster/keymaster_types.pb.h"
+
+#include "openssl/rsa.h"
+
+namespace test_harness {
+
+/* A key to be imported with ImportWrappedKey. */
+struct WrappedKeySpec {
+  nugget::app::keymaster::Algorithm algorithm;
+  nugget::app::keymaster::KeyFormat format;
+  uint32_t key_size;         /* In bits. */
+  std::string key_material;  /* Raw bytes, or PKCS#8 DER for EC. */
+  std::string masking_key;   /* 32 bytes, empty for all zeros. */
+};
+
+/* Fresh random key material of each kind. */
+WrappedKeySpec RandomAesKeySpec(uint32_t key_size);
+WrappedKeySpec RandomHmacKeySpec(uint32_t key_size);
+/* Only 224 and 256 bit curves are supported. */
+WrappedKeySpec RandomEcKeySpec(uint32_t key_size);
+
+/**
+ * Builds ImportWrappedKeyRequests the way a remote provisioning server
+ * would. A fresh transport key is sealed to the wrapping key with RSA-OAEP
+ * (SHA-1). The key material is sealed with AES-256-GCM under the transport
+ * key XOR the masking key, with the DER KeyDescription as the AAD.
+ *
+ * The wrapping key is given as little endian words, as stored in a
+ * struct km_blob. Build() may be called from several threads at once. */
+class WrappedKeyBuilder {
+ public:
+  WrappedKeyBuilder(const uint8_t *n, const uint8_t *d, size_t size,
+                    uint32_t e = 65537);
+  ~WrappedKeyBuilder();
+
+  WrappedKeyBuilder(const WrappedKeyBuilder&) = delete;
+  WrappedKeyBuilder& operator=(const WrappedKeyBuilder&) = delete;
+
+  /* The wrapping key as a km_blob, sealed with a SHA-256 of its contents. */
+  const std::string& WrappingKeyBlob() const { return wrapping_key_blob; }
+
+  /* Returns false if any of the crypto fails. */
+  bool Build(const WrappedKeySpec& spec,
+             nugget::app::keymaster::ImportWrappedKeyRequest *request) const;
+
+  /* Builds a request for each spec on @threads threads (0 uses one per
+   * core) so the host crypto is done before the device is timed. Returns
+   * false if any request failed to build. */
+  bool BuildAll(
+      const std::vector<WrappedKeySpec>& specs,
+      std::vector<nugget::app::keymaster::ImportWrappedKeyRequest> *requests,
+      size_t threads = 0) const;
+
+ private:
+  RSA *rsa;
+  std::string wrapping_key_blob;
+};
+
+}  // namespace test_harness
+
+#endif  // SRC_WRAPPED_KEY_BUILDER_H
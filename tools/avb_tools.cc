@@ -1,5 +1,6 @@
 #include "avb_tools.h"
 
+#include "device_state.h"
 #include "gtest/gtest.h"
 #include "nugget/app/avb/avb.pb.h"
 
@@ -8,7 +9,10 @@
 #include <avb.h>
 #include <nos/NuggetClient.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -60,7 +64,7 @@ void GetState(nos::NuggetClientInterface *client, bool *bootloader,
   if (production != NULL)
     *production = response.production();
 
-  auto response_locks = response.locks();
+  const auto& response_locks = response.locks();
   if (locks != NULL) {
     for (size_t i = 0; i < response_locks.size(); i++)
       locks[i] = response_locks[i];
@@ -81,6 +85,12 @@ int Reset(nos::NuggetClientInterface *client, ResetRequest_ResetKind kind,
     request.mutable_token()->set_signature(empty, sizeof(empty));
   }
 
+  // A production reset clears keymaster's root of trust along with it, so
+  // whoever asked for it, the next test has to set it again.
+  if (kind == ResetRequest::PRODUCTION) {
+    device_state::InvalidateRootOfTrust();
+  }
+
   Avb service(*client);
   return service.Reset(request, nullptr);
 }
@@ -149,4 +159,109 @@ void ResetProduction(nos::NuggetClientInterface *client)
   ASSERT_EQ(production, false);
 }
 
+double TransferStats::BytesPerSecond() const
+{
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  return seconds > 0 ? bytes / seconds : 0;
+}
+
+namespace {
+
+// Reads @size bytes of the owner key and hands each chunk to @on_chunk,
+// which returns false to stop early.
+int ReadOwnerKeyChunks(
+    nos::NuggetClientInterface *client, size_t size, TransferStats *stats,
+    const std::function<bool(size_t, const std::string&)>& on_chunk)
+{
+  GetOwnerKeyRequest request;
+  GetOwnerKeyResponse response;
+  Avb service(*client);
+  TransferStats local;
+  const auto start = std::chrono::steady_clock::now();
+  int code = APP_SUCCESS;
+
+  for (size_t offset = 0; offset < size;) {
+    request.set_offset(offset);
+    request.set_size(std::min<size_t>(size - offset, AVB_CHUNK_MAX_SIZE));
+    response.Clear();
+    code = service.GetOwnerKey(request, &response);
+    local.calls++;
+    if (code != APP_SUCCESS) {
+      break;
+    }
+    const std::string& chunk = response.chunk();
+    if (chunk.empty() || chunk.size() > size - offset) {
+      code = APP_ERROR_INTERNAL;
+      break;
+    }
+    local.bytes += chunk.size();
+    if (!on_chunk(offset, chunk)) {
+      break;
+    }
+    offset += chunk.size();
+  }
+
+  local.elapsed = std::chrono::steady_clock::now() - start;
+  if (stats) {
+    *stats = local;
+  }
+  return code;
+}
+
+}  // namespace
+
+int ReadOwnerKey(nos::NuggetClientInterface *client, uint8_t *key,
+                 size_t size, TransferStats *stats)
+{
+  return ReadOwnerKeyChunks(client, size, stats,
+      [key](size_t offset, const std::string& chunk) {
+        memcpy(key + offset, chunk.data(), chunk.size());
+        return true;
+      });
+}
+
+int VerifyOwnerKey(nos::NuggetClientInterface *client, const uint8_t *expected,
+                   size_t size, size_t *mismatch, TransferStats *stats)
+{
+  bool differs = false;
+  const int code = ReadOwnerKeyChunks(client, size, stats,
+      [expected, mismatch, &differs](size_t offset, const std::string& chunk) {
+        const uint8_t *want = expected + offset;
+        const auto diff = std::mismatch(chunk.begin(), chunk.end(), want,
+            [](char got, uint8_t byte) { return (uint8_t)got == byte; });
+        if (diff.first != chunk.end()) {
+          differs = true;
+          if (mismatch) {
+            *mismatch = offset + (diff.first - chunk.begin());
+          }
+          return false;
+        }
+        return true;
+      });
+  if (code == APP_SUCCESS && differs) {
+    return APP_ERROR_BOGUS_ARGS;
+  }
+  return code;
+}
+
+int WriteOwnerKey(nos::NuggetClientInterface *client, uint8_t locked,
+                  const uint8_t *key, size_t size, TransferStats *stats)
+{
+  SetOwnerLockRequest request;
+  request.set_locked(locked);
+  if (key != NULL && size > 0) {
+    request.set_key(key, size);
+  }
+
+  Avb service(*client);
+  const auto start = std::chrono::steady_clock::now();
+  const int code = service.SetOwnerLock(request, nullptr);
+  if (stats) {
+    stats->bytes = code == APP_SUCCESS ? size : 0;
+    stats->calls = 1;
+    stats->elapsed = std::chrono::steady_clock::now() - start;
+  }
+  return code;
+}
+
 }  // namespace nugget_tools
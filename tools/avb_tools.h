@@ -9,6 +9,8 @@
 
 #include "nugget/app/avb/avb.pb.h"
 
+#include <chrono>
+#include <cstddef>
 #include <memory>
 #include <string>
 
@@ -42,6 +44,30 @@ int SetProduction(nos::NuggetClientInterface *client, bool production,
                   const uint8_t *data, size_t size);
 void ResetProduction(nos::NuggetClientInterface *client);
 
+// What an owner key transfer moved and how long it took.
+struct TransferStats {
+  size_t bytes;
+  size_t calls;
+  std::chrono::nanoseconds elapsed;
+
+  TransferStats() : bytes(0), calls(0), elapsed(0) {}
+  double BytesPerSecond() const;
+};
+
+// Owner key transfers in as few calls as the transport allows. Reads use
+// AVB_CHUNK_MAX_SIZE chunks back to back, reusing the messages. @stats may
+// be null.
+int ReadOwnerKey(nos::NuggetClientInterface *client, uint8_t *key,
+                 size_t size, TransferStats *stats);
+// Compares each chunk with @expected as it arrives and stops at the first
+// difference, returning APP_ERROR_BOGUS_ARGS if there is one. @mismatch, which
+// may be null, is then set to the offset of the difference for diagnostics.
+int VerifyOwnerKey(nos::NuggetClientInterface *client, const uint8_t *expected,
+                   size_t size, size_t *mismatch, TransferStats *stats);
+// SetOwnerLock takes the whole key in a single call.
+int WriteOwnerKey(nos::NuggetClientInterface *client, uint8_t locked,
+                  const uint8_t *key, size_t size, TransferStats *stats);
+
 }  // namespace avb_tools
 
 #endif  // AVB_TOOLS_H
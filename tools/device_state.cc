@@ -0,0 +1,127 @@
+#include "device_state.h"
+
+#include "avb_tools.h"
+#include "keymaster_tools.h"
+#include "nugget_tools.h"
+
+#include "gtest/gtest.h"
+
+#include <app_nugget.h>
+
+#include <cstring>
+#include <mutex>
+
+namespace device_state {
+namespace {
+
+// The low power counters when the root of trust was last set. Setting it
+// needs a trip through the bootloader, so it is only repeated once Citadel may
+// have lost it.
+struct RootOfTrustFingerprint {
+  bool valid;
+  uint64_t hard_reset_count;
+  uint64_t deep_sleep_count;
+};
+
+std::mutex fingerprint_mutex;
+RootOfTrustFingerprint fingerprint = {false, 0, 0};
+
+bool ReadFingerprint(nos::NuggetClientInterface *client,
+                     RootOfTrustFingerprint *out) {
+  struct nugget_app_low_power_stats stats;
+  if (!nugget_tools::GetLowPowerStats(client, &stats)) {
+    return false;
+  }
+  out->valid = true;
+  out->hard_reset_count = stats.hard_reset_count;
+  out->deep_sleep_count = stats.deep_sleep_count;
+  return true;
+}
+
+void EnsureRootOfTrust(nos::NuggetClientInterface *client) {
+  std::lock_guard<std::mutex> lock(fingerprint_mutex);
+
+  RootOfTrustFingerprint current = {false, 0, 0};
+  const bool have_current = ReadFingerprint(client, &current);
+  if (have_current && fingerprint.valid &&
+      fingerprint.hard_reset_count == current.hard_reset_count &&
+      fingerprint.deep_sleep_count == current.deep_sleep_count) {
+    return;
+  }
+
+  fingerprint.valid = false;
+  keymaster_tools::SetRootOfTrust(client);
+  if (!::testing::Test::HasFatalFailure() && have_current) {
+    fingerprint = current;
+  }
+}
+
+bool LocksClear(const AvbState& state) {
+  for (size_t i = 0; i < sizeof(state.locks); ++i) {
+    if (state.locks[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void Ensure(nos::NuggetClientInterface *client, const Requirements& required,
+            AvbState *state) {
+  AvbState current;
+  memset(&current, 0, sizeof(current));
+  ASSERT_NO_FATAL_FAILURE(avb_tools::GetState(client, &current.bootloader,
+                                              &current.production,
+                                              current.locks));
+
+  const bool reset_production = required.production_cleared &&
+      current.production;
+  // The locks are only known to be clear if nothing was reset.
+  const bool reset_locks = required.locks_cleared &&
+      (reset_production || !LocksClear(current));
+
+  bool changed = false;
+  // The resets are done outside of the bootloader, as the tests always did.
+  if ((reset_production || reset_locks ||
+       required.bootloader == BOOTLOADER_DONE) && current.bootloader) {
+    ASSERT_NO_FATAL_FAILURE(avb_tools::BootloaderDone(client));
+    changed = true;
+  }
+  if (reset_production) {
+    // Also forgets the root of trust.
+    ASSERT_NO_FATAL_FAILURE(avb_tools::ResetProduction(client));
+    changed = true;
+  }
+  if (reset_locks) {
+    ASSERT_NO_ERROR(avb_tools::Reset(client, ResetRequest::LOCKS, nullptr, 0),
+                    "");
+    changed = true;
+  }
+  if (required.root_of_trust) {
+    // Leaves the bootloader done.
+    ASSERT_NO_FATAL_FAILURE(EnsureRootOfTrust(client));
+  }
+  if (required.bootloader == BOOTLOADER_ACTIVE &&
+      (!current.bootloader || changed || required.root_of_trust)) {
+    ASSERT_NO_FATAL_FAILURE(avb_tools::SetBootloader(client));
+    changed = true;
+  }
+
+  if (state == nullptr) {
+    return;
+  }
+  if (changed || required.root_of_trust) {
+    ASSERT_NO_FATAL_FAILURE(avb_tools::GetState(client, &current.bootloader,
+                                                &current.production,
+                                                current.locks));
+  }
+  *state = current;
+}
+
+void InvalidateRootOfTrust() {
+  std::lock_guard<std::mutex> lock(fingerprint_mutex);
+  fingerprint.valid = false;
+}
+
+}  // namespace device_state
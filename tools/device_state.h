@@ -0,0 +1,51 @@
+#ifndef DEVICE_STATE_H
+#define DEVICE_STATE_H
+
+#include <nos/NuggetClientInterface.h>
+
+#include <cstdint>
+
+namespace device_state {
+
+enum Bootloader {
+  BOOTLOADER_ANY,
+  BOOTLOADER_ACTIVE,  // avb_tools::SetBootloader()
+  BOOTLOADER_DONE,    // avb_tools::BootloaderDone()
+};
+
+// The device state a test needs before it starts.
+struct Requirements {
+  Requirements()
+      : bootloader(BOOTLOADER_ANY), production_cleared(false),
+        locks_cleared(false), root_of_trust(false) {}
+
+  Bootloader bootloader;
+  bool production_cleared;
+  bool locks_cleared;
+  // Keymaster's root of trust has been set since the last reboot.
+  bool root_of_trust;
+};
+
+// The AVB state as reported by GetState.
+struct AvbState {
+  bool bootloader;
+  bool production;
+  uint8_t locks[4];
+};
+
+// Brings the device into @required with as few transitions as possible. The
+// AVB state is read once and only the parts which don't match are reset, so a
+// device which is already clean costs a single GetState. State which GetState
+// doesn't report is not touched. Failures are reported with gtest assertions.
+//
+// If @state is not null it receives the AVB state the device was left in.
+void Ensure(nos::NuggetClientInterface *client, const Requirements& required,
+            AvbState *state = nullptr);
+
+// Forgets that the root of trust was set, e.g. after a wipe. Production
+// resets through avb_tools::Reset() call this themselves.
+void InvalidateRootOfTrust();
+
+}  // namespace device_state
+
+#endif  // DEVICE_STATE_H
@@ -0,0 +1,110 @@
+#include "latency_samples.h"
+
+#include <application.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+
+#ifdef ANDROID
+#define FLAGS_nos_latency_csv std::string()
+#else
+#include "gflags/gflags.h"
+
+DEFINE_string(nos_latency_csv, "",
+              "Append the latency of every CallApp to this CSV file.");
+#endif  // ANDROID
+
+namespace nugget_tools {
+namespace {
+
+std::mutex file_mutex;
+FILE *file = nullptr;
+bool file_failed = false;
+
+const char *AppName(uint32_t app_id) {
+  switch (app_id) {
+    case APP_ID_NUGGET:
+      return "NUGGET";
+    case APP_ID_AVB:
+      return "AVB";
+    case APP_ID_AVB_TEST:
+      return "AVB_TEST";
+    case APP_ID_KEYMASTER:
+      return "KEYMASTER";
+    case APP_ID_WEAVER:
+      return "WEAVER";
+    case APP_ID_PROTOBUF:
+      return "PROTOBUF";
+    default:
+      return nullptr;
+  }
+}
+
+}  // namespace
+
+std::string LatencyOperationName(uint32_t app_id, uint16_t param) {
+  char name[32];
+  const char *app = AppName(app_id);
+  if (app) {
+    snprintf(name, sizeof(name), "%s/%u", app, param);
+  } else {
+    snprintf(name, sizeof(name), "0x%x/%u", app_id, param);
+  }
+  return name;
+}
+
+void RecordLatency(uint32_t app_id, uint16_t param,
+                   std::chrono::nanoseconds elapsed) {
+  if (FLAGS_nos_latency_csv.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (!file && !file_failed) {
+    file = fopen(FLAGS_nos_latency_csv.c_str(), "a");
+    if (!file) {
+      perror(FLAGS_nos_latency_csv.c_str());
+      file_failed = true;
+    } else if (ftell(file) == 0) {
+      fprintf(file, "operation,latency_us\n");
+    }
+  }
+  if (file) {
+    // Flushed when the program exits or by FlushLatencies().
+    fprintf(file, "%s,%.3f\n", LatencyOperationName(app_id, param).c_str(),
+            elapsed.count() / 1000.0);
+  }
+}
+
+double LatencyPercentile(const std::vector<double>& sorted,
+                         double percentile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  // The smallest sample with at least @percentile of them at or below it.
+  const double rank = std::ceil(percentile / 100 * sorted.size());
+  const size_t index = rank < 1 ? 0 : static_cast<size_t>(rank) - 1;
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+LatencySummary SummarizeLatencies(std::vector<double> *samples) {
+  std::sort(samples->begin(), samples->end());
+  LatencySummary summary;
+  summary.count = samples->size();
+  summary.min = LatencyPercentile(*samples, 0);
+  summary.median = LatencyPercentile(*samples, 50);
+  summary.p95 = LatencyPercentile(*samples, 95);
+  summary.max = LatencyPercentile(*samples, 100);
+  return summary;
+}
+
+void FlushLatencies() {
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (file) {
+    fflush(file);
+  }
+}
+
+}  // namespace nugget_tools
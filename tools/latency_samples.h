@@ -0,0 +1,41 @@
+#ifndef LATENCY_SAMPLES_H
+#define LATENCY_SAMPLES_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nugget_tools {
+
+// Appends one "operation,latency_us" row to the --nos_latency_csv file for a
+// CallApp which took @elapsed. Does nothing if the flag is not set. The rows
+// of two runs can be compared with perf_compare.
+void RecordLatency(uint32_t app_id, uint16_t param,
+                   std::chrono::nanoseconds elapsed);
+
+// Writes out the rows buffered so far, e.g. before the watchdog ends the
+// process without running the exit handlers.
+void FlushLatencies();
+
+// The distribution of a set of latencies, in the unit they were taken in.
+struct LatencySummary {
+  size_t count;
+  double min;
+  double median;
+  double p95;
+  double max;
+};
+
+// The nearest rank @percentile of @sorted, or zero if it is empty.
+double LatencyPercentile(const std::vector<double>& sorted, double percentile);
+
+// Sorts @samples and summarizes them. Everything is zero if there are none.
+LatencySummary SummarizeLatencies(std::vector<double> *samples);
+
+// The operation name used in the samples, e.g. "WEAVER/2".
+std::string LatencyOperationName(uint32_t app_id, uint16_t param);
+
+}  // namespace nugget_tools
+
+#endif  // LATENCY_SAMPLES_H
@@ -3,13 +3,23 @@
 #include <app_nugget.h>
 #include <nos/NuggetClient.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cinttypes>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+#include "device_state.h"
+#include "latency_samples.h"
+#include "probes.h"
+#include "time_accounting.h"
+#include "trace_events.h"
+#include "watchdog.h"
+
 #ifdef ANDROID
 #include <android-base/endian.h>
 #include "nos/CitadeldProxyClient.h"
@@ -31,6 +41,104 @@ using std::string;
 
 namespace nugget_tools {
 
+namespace {
+
+class InstrumentedNuggetClient;
+
+// Clients made by MakeNuggetClient() that are currently open, most recently
+// opened last.
+std::mutex open_clients_mutex;
+std::vector<InstrumentedNuggetClient *> open_clients;
+
+// Wraps the transport specific client so the time spent blocked in CallApp is
+// accounted as TIME_TRANSPORT on the calling thread, its latency is sampled
+// for --nos_latency_csv and --nos_trace_out and a call which never returns
+// trips the watchdog.
+// Calls are serialized so the client can also be used from observers such as
+// ActiveClientCyclesSinceBoot().
+class InstrumentedNuggetClient : public nos::NuggetClientInterface {
+ public:
+  explicit InstrumentedNuggetClient(
+      std::unique_ptr<nos::NuggetClientInterface> client)
+      : client(std::move(client)) {
+    if (this->client->IsOpen()) {
+      Register();
+    }
+  }
+
+  ~InstrumentedNuggetClient() override {
+    Unregister();
+  }
+
+  void Open() override {
+    client->Open();
+    if (client->IsOpen()) {
+      Register();
+    }
+  }
+
+  void Close() override {
+    Unregister();
+    client->Close();
+  }
+
+  bool IsOpen() const override {
+    return client->IsOpen();
+  }
+
+  uint32_t CallApp(uint32_t appId, uint16_t arg,
+                   const std::vector<uint8_t>& request,
+                   std::vector<uint8_t>* response) override {
+    ScopedTimeAccount account(TIME_TRANSPORT);
+    std::lock_guard<std::mutex> lock(call_mutex);
+    ScopedDeadline deadline("CallApp", CallDeadline());
+    NOS_PROBE3(call_app, appId, arg, request.size());
+    const auto start = std::chrono::steady_clock::now();
+    const uint32_t result = client->CallApp(appId, arg, request, response);
+    const auto end = std::chrono::steady_clock::now();
+    NOS_PROBE3(call_app_done, appId, arg, result);
+    RecordLatency(appId, arg, end - start);
+    if (TraceEnabled()) {
+      TraceSpan(TRACK_CALLS, LatencyOperationName(appId, arg), start, end,
+                TraceArgs()
+                    .Add("request_bytes", request.size())
+                    .Add("response_bytes", response ? response->size() : 0)
+                    .Add("status", result));
+    }
+    return result;
+  }
+
+ private:
+  void Register() {
+    std::lock_guard<std::mutex> lock(open_clients_mutex);
+    if (std::find(open_clients.begin(), open_clients.end(), this) ==
+        open_clients.end()) {
+      open_clients.push_back(this);
+    }
+  }
+
+  void Unregister() {
+    std::lock_guard<std::mutex> lock(open_clients_mutex);
+    open_clients.erase(
+        std::remove(open_clients.begin(), open_clients.end(), this),
+        open_clients.end());
+  }
+
+  std::unique_ptr<nos::NuggetClientInterface> client;
+  std::mutex call_mutex;
+};
+
+// The number of WaitForSleep() calls in progress.
+std::atomic<int> sleep_waits(0);
+
+class ScopedSleepWait {
+ public:
+  ScopedSleepWait() { ++sleep_waits; }
+  ~ScopedSleepWait() { --sleep_waits; }
+};
+
+}  // namespace
+
 std::string GetCitadelUSBSerialNo() {
 #ifdef ANDROID
   return "";
@@ -46,7 +154,7 @@ std::string GetCitadelUSBSerialNo() {
 #endif
 }
 
-std::unique_ptr<nos::NuggetClientInterface> MakeNuggetClient() {
+static std::unique_ptr<nos::NuggetClientInterface> MakeTransportClient() {
 #ifdef ANDROID
   std::unique_ptr<nos::NuggetClientInterface> client =
       std::unique_ptr<nos::NuggetClientInterface>(new nos::NuggetClient());
@@ -62,6 +170,20 @@ std::unique_ptr<nos::NuggetClientInterface> MakeNuggetClient() {
 #endif
 }
 
+std::unique_ptr<nos::NuggetClientInterface> MakeNuggetClient() {
+  return std::unique_ptr<nos::NuggetClientInterface>(
+      new InstrumentedNuggetClient(MakeTransportClient()));
+}
+
+bool ActiveClientCyclesSinceBoot(uint32_t *cycles) {
+  // Hold the list lock so the client can't be destroyed during the call.
+  std::lock_guard<std::mutex> lock(open_clients_mutex);
+  if (open_clients.empty()) {
+    return false;
+  }
+  return CyclesSinceBoot(open_clients.back(), cycles);
+}
+
 bool CyclesSinceBoot(nos::NuggetClientInterface *client, uint32_t *cycles) {
   std::vector<uint8_t> buffer;
   buffer.reserve(sizeof(uint32_t));
@@ -79,6 +201,23 @@ bool CyclesSinceBoot(nos::NuggetClientInterface *client, uint32_t *cycles) {
   return true;
 }
 
+bool GetLowPowerStats(nos::NuggetClientInterface *client,
+                      struct nugget_app_low_power_stats *stats) {
+  std::vector<uint8_t> buffer;
+  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
+  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
+                      buffer, &buffer) != app_status::APP_SUCCESS) {
+    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
+    return false;
+  }
+  if (buffer.size() < sizeof(*stats)) {
+    LOG(ERROR) << "Unexpected size of low power stats!\n";
+    return false;
+  }
+  memcpy(stats, buffer.data(), sizeof(*stats));
+  return true;
+}
+
 static void ShowStats(const char *msg,
                       const struct nugget_app_low_power_stats& stats) {
   printf("%s\n", msg);
@@ -95,19 +234,32 @@ static void ShowStats(const char *msg,
          stats.time_spent_in_deep_sleep);
 }
 
+// Pass the result of a step through, firing its probe on the way out.
+static bool RebootDone(bool ok) {
+  NOS_PROBE1(reboot_done, ok);
+  return ok;
+}
+
+static bool SleepDone(bool ok) {
+  NOS_PROBE1(sleep_done, ok);
+  return ok;
+}
+
+static bool WipeDone(bool ok) {
+  NOS_PROBE1(wipe_done, ok);
+  return ok;
+}
+
 bool RebootNugget(nos::NuggetClientInterface *client) {
+  ScopedTraceSpan trace(TRACK_WAITS, "RebootNugget");
+  NOS_PROBE(reboot_start);
   struct nugget_app_low_power_stats stats0;
   struct nugget_app_low_power_stats stats1;
-  std::vector<uint8_t> buffer;
 
   // Grab stats before sleeping
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats0)) {
+    return RebootDone(false);
   }
-  memcpy(&stats0, buffer.data(), sizeof(stats0));
 
   // Capture the time here to allow for some tolerance on the reported time.
   auto start = high_resolution_clock::now();
@@ -117,18 +269,14 @@ bool RebootNugget(nos::NuggetClientInterface *client) {
   if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_REBOOT, ignored,
                       nullptr) != app_status::APP_SUCCESS) {
     LOG(ERROR) << "CallApp(..., NUGGET_PARAM_REBOOT, ...) failed!\n";
-    return false;
+    return RebootDone(false);
   }
+  NOS_PROBE(reboot_requested);
 
   // Grab stats after sleeping
-  buffer.empty();
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats1)) {
+    return RebootDone(false);
   }
-  memcpy(&stats1, buffer.data(), sizeof(stats1));
 
   // Figure a max elapsed time that Nugget OS should see (our time + 5%).
   auto max_usecs =
@@ -140,7 +288,7 @@ bool RebootNugget(nos::NuggetClientInterface *client) {
       stats1.time_at_last_wake == 0 &&
       stats1.deep_sleep_count == 0 &&
       std::chrono::microseconds(stats1.time_since_hard_reset) < max_usecs) {
-    return true;
+    return RebootDone(true);
   }
 
   LOG(ERROR) << "Citadel didn't reboot within "
@@ -148,36 +296,33 @@ bool RebootNugget(nos::NuggetClientInterface *client) {
   ShowStats("stats before waiting", stats0);
   ShowStats("stats after waiting", stats1);
 
-  return false;
+  return RebootDone(false);
 }
 
 bool WaitForSleep(nos::NuggetClientInterface *client, uint32_t *seconds_waited) {
+  ScopedTraceSpan trace(TRACK_WAITS, "WaitForSleep");
+  ScopedSleepWait waiting;
+  NOS_PROBE(sleep_start);
   struct nugget_app_low_power_stats stats0;
   struct nugget_app_low_power_stats stats1;
-  std::vector<uint8_t> buffer;
 
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
   // Grab stats before sleeping
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats0)) {
+    return SleepDone(false);
   }
-  memcpy(&stats0, buffer.data(), sizeof(stats0));
 
   // Wait for Citadel to fall asleep
   constexpr uint32_t wait_seconds = 4;
-  std::this_thread::sleep_for(std::chrono::seconds(wait_seconds));
+  {
+    ScopedTimeAccount account(TIME_SLEEP);
+    std::this_thread::sleep_for(std::chrono::seconds(wait_seconds));
+  }
+  NOS_PROBE1(sleep_waited, wait_seconds);
 
   // Grab stats after sleeping
-  buffer.empty();
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats1)) {
+    return SleepDone(false);
   }
-  memcpy(&stats1, buffer.data(), sizeof(stats1));
 
   // Verify that Citadel went to sleep but didn't reboot
   if (stats1.hard_reset_count == stats0.hard_reset_count &&
@@ -188,54 +333,55 @@ bool WaitForSleep(nos::NuggetClientInterface *client, uint32_t *seconds_waited)
     if (seconds_waited) {
       *seconds_waited = wait_seconds;
     }
-    return true;
+    return SleepDone(true);
   }
 
   LOG(ERROR) << "Citadel didn't sleep\n";
   ShowStats("stats before waiting", stats0);
   ShowStats("stats after waiting", stats1);
 
-  return false;
+  return SleepDone(false);
+}
+
+bool WaitingForSleep() {
+  return sleep_waits > 0;
 }
 
 bool WipeUserData(nos::NuggetClientInterface *client) {
+  ScopedTraceSpan trace(TRACK_WAITS, "WipeUserData");
+  NOS_PROBE(wipe_start);
   struct nugget_app_low_power_stats stats0;
   struct nugget_app_low_power_stats stats1;
   std::vector<uint8_t> buffer;
 
   // Grab stats before sleeping
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats0)) {
+    return WipeDone(false);
   }
-  memcpy(&stats0, buffer.data(), sizeof(stats0));
 
   // Request wipe of user data which should hard reboot
   buffer.resize(4);
   *reinterpret_cast<uint32_t *>(buffer.data()) = htole32(ERASE_CONFIRMATION);
   if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_NUKE_FROM_ORBIT,
                          buffer, nullptr) != app_status::APP_SUCCESS) {
-    return false;
+    return WipeDone(false);
   }
+  NOS_PROBE(wipe_requested);
+
+  // The wipe may have taken keymaster's root of trust with it.
+  device_state::InvalidateRootOfTrust();
 
   // Grab stats after sleeping
-  buffer.empty();
-  buffer.reserve(sizeof(struct nugget_app_low_power_stats));
-  if (client->CallApp(APP_ID_NUGGET, NUGGET_PARAM_GET_LOW_POWER_STATS,
-                      buffer, &buffer) != app_status::APP_SUCCESS) {
-    LOG(ERROR) << "CallApp(..., NUGGET_PARAM_GET_LOW_POWER_STATS, ...) failed!\n";
-    return false;
+  if (!GetLowPowerStats(client, &stats1)) {
+    return WipeDone(false);
   }
-  memcpy(&stats1, buffer.data(), sizeof(stats1));
 
   // Verify that Citadel didn't reset
   const bool ret = stats1.hard_reset_count == stats0.hard_reset_count;
   if (!ret) {
     LOG(ERROR) << "Citadel reset while wiping user data\n";
   }
-  return ret;
+  return WipeDone(ret);
 }
 
 }  // namespace nugget_tools
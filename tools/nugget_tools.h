@@ -20,8 +20,21 @@ namespace nugget_tools {
 
 std::string GetCitadelUSBSerialNo();
 
+// The returned client accounts the time spent in CallApp() as
+// TIME_TRANSPORT, see time_accounting.h.
 std::unique_ptr<nos::NuggetClientInterface> MakeNuggetClient();
 
+// Reads the free running cycle counter of the chip.
+bool CyclesSinceBoot(nos::NuggetClientInterface *client, uint32_t *cycles);
+
+// Reads the cycle counter through the most recently opened client made by
+// MakeNuggetClient(). Returns false if there is no open client.
+bool ActiveClientCyclesSinceBoot(uint32_t *cycles);
+
+// Reads the reset, wake and deep sleep counters kept by Nugget OS.
+bool GetLowPowerStats(nos::NuggetClientInterface *client,
+                      struct nugget_app_low_power_stats *stats);
+
 // Always does a hard reboot. Use WaitForSleep() if you just want deep sleep.
 bool RebootNugget(nos::NuggetClientInterface *client);
 
@@ -29,6 +42,10 @@ bool RebootNugget(nos::NuggetClientInterface *client);
 // Passes back an underestimate of the number of seconds waited if so.
 bool WaitForSleep(nos::NuggetClientInterface *client, uint32_t *seconds_waited);
 
+// Whether a WaitForSleep() is in progress on any thread. Any call wakes the
+// chip, so background pollers should hold off meanwhile.
+bool WaitingForSleep();
+
 bool WipeUserData(nos::NuggetClientInterface *client);
 
 }  // namespace nugget_tools
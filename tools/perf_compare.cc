@@ -0,0 +1,231 @@
+// Compares two sets of latency samples, e.g. from runs against two firmware
+// builds with --nos_latency_csv, and flags operations which got significantly
+// slower.
+//
+//   perf_compare [flags] baseline.csv candidate.csv
+//
+// Each operation is compared with a Mann-Whitney U test, which doesn't assume
+// the latencies are normally distributed, and a bootstrap confidence interval
+// for the ratio of the medians. An operation is a regression if the
+// difference is significant, the whole interval is above 1 and the median
+// moved by at least --min_effect. The exit status is 1 if there is any
+// regression so release scripts can gate on it.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+DEFINE_double(alpha, 0.01, "Significance level of the Mann-Whitney test.");
+DEFINE_double(min_effect, 0.05,
+              "Smallest relative change of the median worth flagging.");
+DEFINE_double(confidence, 0.95, "Confidence level of the bootstrap interval.");
+DEFINE_int32(bootstrap_resamples, 2000, "Number of bootstrap resamples.");
+DEFINE_int32(min_samples, 10,
+             "Operations with fewer samples on either side are not judged.");
+DEFINE_uint64(seed, 1, "Seed for the bootstrap so reports are reproducible.");
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::map<string, vector<double>> Samples;
+
+bool ReadSamples(const string& path, Samples* samples) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Unable to open " << path << "\n";
+    return false;
+  }
+
+  string line;
+  size_t line_number = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    const size_t comma = line.rfind(',');
+    if (line.empty() || line == "operation,latency_us") {
+      continue;
+    }
+    char *end = nullptr;
+    const double value =
+        comma == string::npos ? 0 : strtod(line.c_str() + comma + 1, &end);
+    if (comma == string::npos || end == line.c_str() + comma + 1) {
+      std::cerr << path << ":" << line_number << ": malformed sample\n";
+      return false;
+    }
+    (*samples)[line.substr(0, comma)].push_back(value);
+  }
+  return true;
+}
+
+// Reorders @values.
+double Median(vector<double>* values) {
+  const size_t mid = values->size() / 2;
+  std::nth_element(values->begin(), values->begin() + mid, values->end());
+  const double upper = (*values)[mid];
+  if (values->size() % 2) {
+    return upper;
+  }
+  return (*std::max_element(values->begin(), values->begin() + mid) + upper) /
+      2;
+}
+
+// Two sided p-value of the Mann-Whitney U test using the normal approximation
+// with tie correction.
+double MannWhitneyP(const vector<double>& a, const vector<double>& b) {
+  vector<std::pair<double, int>> all;
+  all.reserve(a.size() + b.size());
+  for (double value : a) {
+    all.push_back(std::make_pair(value, 0));
+  }
+  for (double value : b) {
+    all.push_back(std::make_pair(value, 1));
+  }
+  std::sort(all.begin(), all.end());
+
+  const double n1 = a.size();
+  const double n2 = b.size();
+  const double n = n1 + n2;
+  double rank_sum_a = 0;
+  double tie_term = 0;
+  for (size_t i = 0; i < all.size();) {
+    size_t j = i;
+    while (j < all.size() && all[j].first == all[i].first) {
+      ++j;
+    }
+    // Ties share the average of the ranks i + 1 .. j.
+    const double rank = (i + 1 + j) / 2.0;
+    const double ties = j - i;
+    tie_term += ties * ties * ties - ties;
+    for (size_t k = i; k < j; ++k) {
+      if (all[k].second == 0) {
+        rank_sum_a += rank;
+      }
+    }
+    i = j;
+  }
+
+  const double u = rank_sum_a - n1 * (n1 + 1) / 2;
+  const double mean = n1 * n2 / 2;
+  const double variance = n1 * n2 / 12 * ((n + 1) - tie_term / (n * (n - 1)));
+  if (variance <= 0) {
+    return 1;
+  }
+  const double z = std::max(std::fabs(u - mean) - 0.5, 0.0) /
+      std::sqrt(variance);
+  return std::erfc(z / std::sqrt(2.0));
+}
+
+// Confidence interval for median(candidate) / median(baseline).
+void BootstrapRatio(const vector<double>& baseline,
+                    const vector<double>& candidate, std::mt19937_64* rng,
+                    double *low, double *high) {
+  vector<double> ratios;
+  ratios.reserve(FLAGS_bootstrap_resamples);
+  vector<double> base_resample(baseline.size());
+  vector<double> cand_resample(candidate.size());
+  std::uniform_int_distribution<size_t> pick_base(0, baseline.size() - 1);
+  std::uniform_int_distribution<size_t> pick_cand(0, candidate.size() - 1);
+  for (int i = 0; i < FLAGS_bootstrap_resamples; ++i) {
+    for (double& value : base_resample) {
+      value = baseline[pick_base(*rng)];
+    }
+    for (double& value : cand_resample) {
+      value = candidate[pick_cand(*rng)];
+    }
+    const double base_median = Median(&base_resample);
+    if (base_median > 0) {
+      ratios.push_back(Median(&cand_resample) / base_median);
+    }
+  }
+  if (ratios.empty()) {
+    *low = *high = NAN;
+    return;
+  }
+  std::sort(ratios.begin(), ratios.end());
+  const double tail = (1 - FLAGS_confidence) / 2;
+  *low = ratios[static_cast<size_t>(tail * (ratios.size() - 1))];
+  *high = ratios[static_cast<size_t>((1 - tail) * (ratios.size() - 1))];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  google::SetUsageMessage("perf_compare [flags] baseline.csv candidate.csv");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 3 || FLAGS_bootstrap_resamples <= 0) {
+    google::ShowUsageWithFlagsRestrict(argv[0], "perf_compare");
+    return 2;
+  }
+
+  Samples baseline;
+  Samples candidate;
+  if (!ReadSamples(argv[1], &baseline) || !ReadSamples(argv[2], &candidate)) {
+    return 2;
+  }
+
+  std::set<string> operations;
+  for (const auto& entry : baseline) {
+    operations.insert(entry.first);
+  }
+  for (const auto& entry : candidate) {
+    operations.insert(entry.first);
+  }
+
+  std::mt19937_64 rng(FLAGS_seed);
+  int regressions = 0;
+  printf("%-20s %7s %7s %12s %12s %8s %19s %9s  %s\n", "operation", "n base",
+         "n cand", "median base", "median cand", "ratio", "ratio CI", "p",
+         "verdict");
+  for (const string& operation : operations) {
+    vector<double> base = baseline[operation];
+    vector<double> cand = candidate[operation];
+    if (base.size() < (size_t) FLAGS_min_samples ||
+        cand.size() < (size_t) FLAGS_min_samples) {
+      printf("%-20s %7zu %7zu %12s %12s %8s %19s %9s  too few samples\n",
+             operation.c_str(), base.size(), cand.size(), "", "", "", "", "");
+      continue;
+    }
+
+    const double p = MannWhitneyP(base, cand);
+    double low;
+    double high;
+    BootstrapRatio(base, cand, &rng, &low, &high);
+    const double base_median = Median(&base);
+    const double cand_median = Median(&cand);
+    const double ratio = base_median > 0 ? cand_median / base_median : NAN;
+
+    const char *verdict = "same";
+    if (p < FLAGS_alpha && low > 1 && ratio >= 1 + FLAGS_min_effect) {
+      verdict = "REGRESSION";
+      ++regressions;
+    } else if (p < FLAGS_alpha && high < 1 &&
+               ratio <= 1 - FLAGS_min_effect) {
+      verdict = "improvement";
+    }
+
+    char interval[32];
+    snprintf(interval, sizeof(interval), "[%.3f, %.3f]", low, high);
+    printf("%-20s %7zu %7zu %12.1f %12.1f %8.3f %19s %9.2g  %s\n",
+           operation.c_str(), base.size(), cand.size(), base_median,
+           cand_median, ratio, interval, p, verdict);
+  }
+
+  if (regressions) {
+    printf("\n%d operation%s regressed.\n", regressions,
+           regressions == 1 ? "" : "s");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT (SystemTap style) static tracepoints under the "nos" provider, for
+// attaching bpftrace, perf or stap to a running test binary. When nobody is
+// attached a probe is a single nop, so they can sit on the transport hot
+// paths. See the README for the list of probes.
+//
+// The probes are compiled in when <sys/sdt.h> is available (systemtap-sdt-dev
+// on Debian) and NOS_NO_PROBES is not defined. Otherwise the macros expand to
+// nothing and their arguments are not evaluated.
+
+#if !defined(NOS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NOS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef NOS_HAVE_PROBES
+#define NOS_PROBE(name) DTRACE_PROBE(nos, name)
+#define NOS_PROBE1(name, a) DTRACE_PROBE1(nos, name, a)
+#define NOS_PROBE2(name, a, b) DTRACE_PROBE2(nos, name, a, b)
+#define NOS_PROBE3(name, a, b, c) DTRACE_PROBE3(nos, name, a, b, c)
+#else
+#define NOS_PROBE(name) do {} while (0)
+#define NOS_PROBE1(name, a) do {} while (0)
+#define NOS_PROBE2(name, a, b) do {} while (0)
+#define NOS_PROBE3(name, a, b, c) do {} while (0)
+#endif  // NOS_HAVE_PROBES
+
+#endif  // PROBES_H
@@ -0,0 +1,47 @@
+#include "time_accounting.h"
+
+#include <cstdint>
+
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+namespace nugget_tools {
+namespace {
+
+thread_local int64_t accounted_ns[TIME_CATEGORY_COUNT];
+
+}  // namespace
+
+const char *TimeCategoryName(TimeCategory category) {
+  switch (category) {
+    case TIME_TRANSPORT:
+      return "transport";
+    case TIME_SLEEP:
+      return "sleep";
+    default:
+      return "unknown";
+  }
+}
+
+void AccountTime(TimeCategory category, nanoseconds elapsed) {
+  if (category < 0 || category >= TIME_CATEGORY_COUNT) {
+    return;
+  }
+  accounted_ns[category] += elapsed.count();
+}
+
+nanoseconds AccountedTime(TimeCategory category) {
+  if (category < 0 || category >= TIME_CATEGORY_COUNT) {
+    return nanoseconds(0);
+  }
+  return nanoseconds(accounted_ns[category]);
+}
+
+ScopedTimeAccount::ScopedTimeAccount(TimeCategory category)
+    : category(category), start(steady_clock::now()) {}
+
+ScopedTimeAccount::~ScopedTimeAccount() {
+  AccountTime(category, steady_clock::now() - start);
+}
+
+}  // namespace nugget_tools
@@ -0,0 +1,37 @@
+#ifndef TIME_ACCOUNTING_H
+#define TIME_ACCOUNTING_H
+
+#include <chrono>
+
+namespace nugget_tools {
+
+// Where a thread spent wall time it was not running its own code. Totals are
+// kept per thread so worker threads don't skew the main test thread.
+enum TimeCategory : int {
+  TIME_TRANSPORT = 0,  // Blocked in CallApp or on the UART.
+  TIME_SLEEP,          // Deliberately waiting, e.g. WaitForSleep, ReadUntil.
+  TIME_CATEGORY_COUNT,
+};
+
+const char *TimeCategoryName(TimeCategory category);
+
+// Adds @elapsed to the calling thread's total for @category.
+void AccountTime(TimeCategory category, std::chrono::nanoseconds elapsed);
+
+// Returns the calling thread's running total for @category.
+std::chrono::nanoseconds AccountedTime(TimeCategory category);
+
+// Accounts the lifetime of the object to @category.
+class ScopedTimeAccount {
+ public:
+  explicit ScopedTimeAccount(TimeCategory category);
+  ~ScopedTimeAccount();
+
+ private:
+  TimeCategory category;
+  std::chrono::steady_clock::time_point start;
+};
+
+}  // namespace nugget_tools
+
+#endif  // TIME_ACCOUNTING_H
@@ -0,0 +1,194 @@
+#include "trace_events.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#ifdef ANDROID
+#define FLAGS_nos_trace_out std::string()
+#else
+#include "gflags/gflags.h"
+
+DEFINE_string(nos_trace_out, "",
+              "Write a Chrome trace event JSON timeline of the tests, app "
+              "calls, messages, console lines and waits to this file.");
+#endif  // ANDROID
+
+using std::chrono::steady_clock;
+
+namespace nugget_tools {
+namespace {
+
+const steady_clock::time_point epoch = steady_clock::now();
+
+std::mutex file_mutex;
+FILE *file = nullptr;
+bool file_done = false;
+
+const char *TrackName(TraceTrack track) {
+  switch (track) {
+    case TRACK_TESTS:
+      return "Tests";
+    case TRACK_FIXTURES:
+      return "Fixtures";
+    case TRACK_CALLS:
+      return "CallApp";
+    case TRACK_MESSAGES:
+      return "Messages";
+    case TRACK_CONSOLE:
+      return "Console";
+    case TRACK_WAITS:
+      return "Waits";
+  }
+  return "?";
+}
+
+void AppendEscaped(const std::string& text, std::string *out) {
+  out->push_back('"');
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20 || c >= 0x7f) {
+      // The console is not guaranteed to be UTF-8, so escape anything which
+      // could make the file invalid.
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+double Micros(steady_clock::time_point time) {
+  return std::chrono::duration<double, std::micro>(time - epoch).count();
+}
+
+// Opens the file on the first event. file_mutex must be held.
+bool OpenTrace() {
+  if (file || file_done) {
+    return file != nullptr;
+  }
+  file = fopen(FLAGS_nos_trace_out.c_str(), "w");
+  if (!file) {
+    perror(FLAGS_nos_trace_out.c_str());
+    file_done = true;
+    return false;
+  }
+  atexit(FinishTrace);
+
+  fprintf(file, "[");
+  for (int track = TRACK_TESTS; track <= TRACK_WAITS; track++) {
+    fprintf(file, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}},"
+            "\n{\"ph\":\"M\",\"name\":\"thread_sort_index\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+            track == TRACK_TESTS ? "" : ",", track,
+            TrackName(static_cast<TraceTrack>(track)), track, track);
+  }
+  return true;
+}
+
+void WriteEvent(const char *phase, TraceTrack track, const std::string& name,
+                steady_clock::time_point start, const double *duration,
+                const TraceArgs& args) {
+  // Format outside the lock; only the write is serialized.
+  std::string event = "{\"ph\":\"";
+  event += phase;
+  event += "\",\"pid\":1,\"tid\":";
+  event += std::to_string(static_cast<int>(track));
+  event += ",\"name\":";
+  AppendEscaped(name, &event);
+  char times[64];
+  snprintf(times, sizeof(times), ",\"ts\":%.3f", Micros(start));
+  event += times;
+  if (duration) {
+    snprintf(times, sizeof(times), ",\"dur\":%.3f", *duration);
+    event += times;
+  } else {
+    // Instant events are drawn across their own track only.
+    event += ",\"s\":\"t\"";
+  }
+  event += ",\"args\":{";
+  event += args.Json();
+  event += "}}";
+
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (OpenTrace()) {
+    fprintf(file, ",\n%s", event.c_str());
+  }
+}
+
+}  // namespace
+
+bool TraceEnabled() {
+  return !FLAGS_nos_trace_out.empty();
+}
+
+TraceArgs& TraceArgs::Add(const char *name, int64_t value) {
+  if (!fields.empty()) {
+    fields += ",";
+  }
+  fields += "\"";
+  fields += name;
+  fields += "\":";
+  fields += std::to_string(value);
+  return *this;
+}
+
+TraceArgs& TraceArgs::Add(const char *name, const std::string& value) {
+  if (!fields.empty()) {
+    fields += ",";
+  }
+  fields += "\"";
+  fields += name;
+  fields += "\":";
+  AppendEscaped(value, &fields);
+  return *this;
+}
+
+void TraceSpan(TraceTrack track, const std::string& name,
+               steady_clock::time_point start, steady_clock::time_point end,
+               const TraceArgs& args) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  const double duration =
+      std::chrono::duration<double, std::micro>(end - start).count();
+  WriteEvent("X", track, name, start, &duration, args);
+}
+
+void TraceInstant(TraceTrack track, const std::string& name,
+                  const TraceArgs& args) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  WriteEvent("i", track, name, steady_clock::now(), nullptr, args);
+}
+
+ScopedTraceSpan::ScopedTraceSpan(TraceTrack track, const char *name)
+    : enabled(TraceEnabled()), track(track), name(name) {
+  if (enabled) {
+    start = steady_clock::now();
+  }
+}
+
+ScopedTraceSpan::~ScopedTraceSpan() {
+  if (enabled) {
+    TraceSpan(track, name, start, steady_clock::now(), span_args);
+  }
+}
+
+void FinishTrace() {
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (file) {
+    fprintf(file, "\n]\n");
+    fclose(file);
+    file = nullptr;
+  }
+  file_done = true;
+}
+
+}  // namespace nugget_tools
@@ -0,0 +1,74 @@
+#ifndef TRACE_EVENTS_H
+#define TRACE_EVENTS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace nugget_tools {
+
+// The rows of the timeline written to --nos_trace_out. The file is Chrome
+// trace event JSON, which both chrome://tracing and ui.perfetto.dev load.
+enum TraceTrack {
+  TRACK_TESTS = 1,   // gtest tests.
+  TRACK_FIXTURES,    // SetUpTestCase() and TearDownTestCase().
+  TRACK_CALLS,       // Every CallApp().
+  TRACK_MESSAGES,    // TestHarness SendData() and GetData().
+  TRACK_CONSOLE,     // Citadel console lines.
+  TRACK_WAITS,       // Sleeping, rebooting and wiping the chip.
+};
+
+// Whether --nos_trace_out is set. Callers check this before building the
+// name or arguments of an event so tracing costs nothing when it is off.
+bool TraceEnabled();
+
+// The arguments shown for an event when it is selected in the viewer.
+class TraceArgs {
+ public:
+  TraceArgs& Add(const char *name, int64_t value);
+  TraceArgs& Add(const char *name, const std::string& value);
+
+  // The members of the "args" object, without the braces.
+  const std::string& Json() const { return fields; }
+
+ private:
+  std::string fields;
+};
+
+// Records a span from @start to @end.
+void TraceSpan(TraceTrack track, const std::string& name,
+               std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end,
+               const TraceArgs& args = TraceArgs());
+
+// Records a point in time.
+void TraceInstant(TraceTrack track, const std::string& name,
+                  const TraceArgs& args = TraceArgs());
+
+// Records a span covering its own lifetime. The arguments may be filled in
+// before it goes out of scope, e.g. with the result of the traced call.
+class ScopedTraceSpan {
+ public:
+  ScopedTraceSpan(TraceTrack track, const char *name);
+  ~ScopedTraceSpan();
+
+  ScopedTraceSpan(const ScopedTraceSpan&) = delete;
+  ScopedTraceSpan& operator=(const ScopedTraceSpan&) = delete;
+
+  TraceArgs& args() { return span_args; }
+
+ private:
+  const bool enabled;
+  const TraceTrack track;
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  TraceArgs span_args;
+};
+
+// Terminates the JSON and closes the file. Called at exit, and may be called
+// earlier, e.g. before a watchdog ends the process. Later events are dropped.
+void FinishTrace();
+
+}  // namespace nugget_tools
+
+#endif  // TRACE_EVENTS_H
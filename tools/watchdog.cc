@@ -0,0 +1,139 @@
+#include "watchdog.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#ifdef ANDROID
+#define FLAGS_nos_call_deadline_ms 30000
+#else
+#include "gflags/gflags.h"
+
+DEFINE_int32(nos_call_deadline_ms, 30000,
+             "Exit if a single call to the chip takes longer than this; 0 "
+             "waits forever.");
+#endif  // ANDROID
+
+using std::chrono::steady_clock;
+
+namespace nugget_tools {
+namespace {
+
+// Ordered by deadline; the owner keeps entries unique.
+typedef std::tuple<steady_clock::time_point, const ScopedDeadline *,
+                   const char *> Entry;
+
+class Watchdog {
+ public:
+  static Watchdog& Get() {
+    // Never destroyed so deadlines armed by static objects stay safe.
+    static Watchdog *watchdog = new Watchdog();
+    return *watchdog;
+  }
+
+  void Arm(const Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const bool earliest = entries.empty() || entry < *entries.begin();
+    entries.insert(entry);
+    if (!started) {
+      std::thread(&Watchdog::Run, this).detach();
+      started = true;
+    }
+    if (earliest) {
+      changed.notify_one();
+    }
+  }
+
+  void Disarm(const Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.erase(entry);
+  }
+
+  void SetContext(const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    context = value;
+  }
+
+  void SetHook(std::function<void(const std::string&)> value) {
+    std::lock_guard<std::mutex> lock(mutex);
+    hook = std::move(value);
+  }
+
+ private:
+  Watchdog() : started(false) {}
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      if (entries.empty()) {
+        changed.wait(lock);
+        continue;
+      }
+      const Entry first = *entries.begin();
+      const steady_clock::time_point deadline = std::get<0>(first);
+      if (changed.wait_until(lock, deadline) == std::cv_status::timeout &&
+          entries.count(first) != 0 && steady_clock::now() >= deadline) {
+        Expire(std::get<2>(first));
+      }
+    }
+  }
+
+  // mutex must be held. Does not return.
+  void Expire(const char *what) {
+    std::string report = std::string(what) + " missed its deadline";
+    if (!context.empty()) {
+      report += " in " + context;
+    }
+    report += "; the device is probably wedged";
+    std::cerr << "\nWATCHDOG: " << report << ". Exiting." << std::endl;
+    if (hook) {
+      hook(report);
+    }
+    fflush(stdout);
+    std::_Exit(kWatchdogExitCode);
+  }
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::set<Entry> entries;
+  std::string context;
+  std::function<void(const std::string&)> hook;
+  bool started;
+};
+
+}  // namespace
+
+ScopedDeadline::ScopedDeadline(const char *what,
+                               std::chrono::milliseconds timeout)
+    : what(what), armed(timeout > std::chrono::milliseconds(0)) {
+  if (armed) {
+    deadline = steady_clock::now() + timeout;
+    Watchdog::Get().Arm(Entry(deadline, this, what));
+  }
+}
+
+ScopedDeadline::~ScopedDeadline() {
+  if (armed) {
+    Watchdog::Get().Disarm(Entry(deadline, this, what));
+  }
+}
+
+std::chrono::milliseconds CallDeadline() {
+  return std::chrono::milliseconds(FLAGS_nos_call_deadline_ms);
+}
+
+void SetWatchdogContext(const std::string& context) {
+  Watchdog::Get().SetContext(context);
+}
+
+void SetWatchdogExpiryHook(std::function<void(const std::string&)> hook) {
+  Watchdog::Get().SetHook(std::move(hook));
+}
+
+}  // namespace nugget_tools
@@ -0,0 +1,48 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+namespace nugget_tools {
+
+// Exit status used when a deadline expires, the same as timeout(1).
+constexpr int kWatchdogExitCode = 124;
+
+// Deadlines for operations which block forever on a wedged device. A single
+// thread tracks every armed deadline. When one expires it reports what was
+// running, runs the expiry hook and exits the process with kWatchdogExitCode.
+// A thread stuck inside the driver can't be unblocked safely, so exiting is
+// the only way to let the runner move on to the next binary or board.
+class ScopedDeadline {
+ public:
+  // @what must outlive the object. A @timeout of zero or less disables it.
+  ScopedDeadline(const char *what, std::chrono::milliseconds timeout);
+  ~ScopedDeadline();
+
+  ScopedDeadline(const ScopedDeadline&) = delete;
+  ScopedDeadline& operator=(const ScopedDeadline&) = delete;
+
+ private:
+  const char *what;
+  std::chrono::steady_clock::time_point deadline;
+  bool armed;
+};
+
+// The deadline for a single CallApp or UART write, from --nos_call_deadline_ms.
+std::chrono::milliseconds CallDeadline();
+
+// Included in the report, e.g. the name of the running test.
+void SetWatchdogContext(const std::string& context);
+
+// Runs on the watchdog thread before the process exits, with the report that
+// was printed, e.g. to record the failure and flush logs. The process exits
+// without running atexit handlers or static destructors, which would tear
+// down objects the stuck thread is still using, so anything which must reach
+// the disk has to be written by the hook.
+void SetWatchdogExpiryHook(std::function<void(const std::string&)> hook);
+
+}  // namespace nugget_tools
+
+#endif  // WATCHDOG_H